@@ -42,9 +42,7 @@
  * autocomplete::autocomplete *
  ******************************/
 
-autocomplete::autocomplete() {
-  _lists.push_back(&_list);
-}
+autocomplete::autocomplete() : _root(), _clock(0), _generation(0) {}
 
 /*******************************
  * autocomplete::~autocomplete *
@@ -57,59 +55,296 @@ autocomplete::~autocomplete() noexcept {}
  *********************/
 
 void autocomplete::add(const std::string &val) {
-  _list.push_back(val);
+  /* Adding the same value again only counts it, it stays a completion until
+   * it's been removed as many times.
+   */
+  if (not val.empty()) {
+    insert(_root, val, val);
+    _generation++;
+  }
 }
 
-void autocomplete::add(std::list<std::string> &list) {
-  _lists.push_back(&list);
+/************************
+ * autocomplete::remove *
+ ************************/
+
+void autocomplete::remove(const std::string &val) {
+  if (not val.empty() and erase(_root, val)) _generation++;
 }
 
-/*******************************
- * autocomplete::~autocomplete *
- *******************************/
+/*********************
+ * autocomplete::use *
+ *********************/
+
+void autocomplete::use(const std::string &line) {
+  /* Every completion the line starts with, up to a space or the end of the
+   * line, gets used. So sending "/msg bob hi" ranks "/msg bob" up.
+   */
+  if (not line.empty()) touch(_root, line);
+}
+
+/****************************
+ * autocomplete::operator() *
+ ****************************/
 
 std::string autocomplete::operator()(const std::string &prefix,
                                      std::string &suggest,
                                      bool &is_more) {
-  size_t len = prefix.size();
-  std::string answer;
-  std::list<std::string>::iterator result;
-  bool is_first = true;
+  std::string answer = prefix;
+  std::string_view key(prefix);
+  const node *n = &_root;
   is_more = false;
 
-  // Iterator through all the completion lists.
-  for (auto &list: _lists) {
-
-    // Searching for matches in this list.
-    result = list->begin();
-    while ((result = find_if(result, list->end(),
-                            [len, prefix](const std::string &val) {
-                              return (val.compare(0, len, prefix) == 0);
-                             })) != list->end()) {
-      if (is_first) {
-        // Our first match.
-        answer = *result;
-        suggest = *result;
-        is_first = false;
-        continue;
-      }
+  // Follow the prefix down the tree.
+  size_t at = 0;
+  while (at < key.size()) {
+    auto child = n->children.find(key[at]);
+    if (child == n->children.end()) {
+      suggest.clear();
+      return prefix;
+    }
+
+    const node *next = child->second.get();
+    const auto rest = key.substr(at);
+    const auto len = std::min(rest.size(), next->label.size());
+    if (next->label.compare(0, len, rest, 0, len) != 0) {
+      suggest.clear();
+      return prefix;
+    }
+
+    // The prefix may end part way into the label, all matches share it.
+    answer.append(next->label, len);
+    at += len;
+    n = next;
+  }
+
+  // Nodes that aren't a completion with only one way on are shared too.
+  while (not n->refs and n->children.size() == 1) {
+    n = n->children.begin()->second.get();
+    answer += n->label;
+  }
+
+  if (not n->best) {
+    suggest.clear();
+    return prefix;
+  }
+
+  suggest = n->best->value;
+  is_more = (n->count > 1);
+  return answer;
+}
+
+/************************
+ * autocomplete::insert *
+ ************************/
 
-      // We found more than one match.
-      is_more = true;
+void autocomplete::insert(node &n, std::string_view key,
+                          const std::string &val) {
+  if (key.empty()) {
+    // The value ends at this node.
+    if (n.refs++ == 0) n.value = val;
+    n.when = ++_clock;
 
-      // Find the as much unique matching as possible.
-      std::pair<std::string::iterator, std::string::iterator> res;
+  } else {
+    auto &child = n.children[key[0]];
+    if (not child) {
+      // Nothing starts with this yet, a new leaf.
+      child = std::make_unique<node>();
+      child->label = key;
+      child->refs = 1;
+      child->value = val;
+      child->when = ++_clock;
+      refresh(*child);
 
-      res = std::mismatch(result->begin(), result->end(),
-                          answer.begin());
-      if (res.second != answer.end()) {
-        answer.erase(res.second, answer.end());
+    } else {
+      const auto len = std::min(key.size(), child->label.size());
+      const auto diff = std::mismatch(key.begin(), key.begin() + len,
+                                      child->label.begin()).first;
+      const size_t common = diff - key.begin();
+
+      if (common < child->label.size()) {
+        // Split the label where the key leaves it.
+        auto split = std::make_unique<node>();
+        split->label = child->label.substr(0, common);
+        child->label.erase(0, common);
+        split->children[child->label[0]] = std::move(child);
+        child = std::move(split);
       }
-      result++;
+
+      insert(*child, key.substr(common), val);
     }
   }
 
-  // Return an answer.
-  if (answer.empty()) answer = prefix;
-  return answer;
+  refresh(n);
+}
+
+/***********************
+ * autocomplete::erase *
+ ***********************/
+
+bool autocomplete::erase(node &n, std::string_view key) {
+  if (key.empty()) {
+    if (not n.refs) return false;
+    if (--n.refs == 0) {
+      n.value.clear();
+      n.uses = 0;
+    }
+    refresh(n);
+    return true;
+  }
+
+  auto child = n.children.find(key[0]);
+  if (child == n.children.end()) return false;
+
+  node &next = *child->second;
+  if (key.compare(0, next.label.size(), next.label) != 0) return false;
+  if (not erase(next, key.substr(next.label.size()))) return false;
+
+  // Prune the child or merge it with its only child, keeping the tree tight.
+  if (not next.refs) {
+    if (next.children.empty()) {
+      n.children.erase(child);
+    } else if (next.children.size() == 1) {
+      auto only = std::move(next.children.begin()->second);
+      only->label.insert(0, next.label);
+      child->second = std::move(only);
+    }
+  }
+
+  refresh(n);
+  return true;
+}
+
+/***********************
+ * autocomplete::touch *
+ ***********************/
+
+void autocomplete::touch(node &n, std::string_view key) {
+  if (n.refs and (key.empty() or key[0] == ' ')) {
+    n.uses++;
+    n.when = ++_clock;
+  }
+
+  if (not key.empty()) {
+    auto child = n.children.find(key[0]);
+    if (child != n.children.end() and
+        key.compare(0, child->second->label.size(),
+                    child->second->label) == 0) {
+      touch(*child->second, key.substr(child->second->label.size()));
+    }
+  }
+
+  refresh(n);
+}
+
+/*************************
+ * autocomplete::refresh *
+ *************************/
+
+void autocomplete::refresh(node &n) {
+  // Recount the subtree and find its best completion again.
+  n.count = (n.refs ? 1 : 0);
+  n.best = (n.refs ? &n : nullptr);
+
+  for (auto &child: n.children) {
+    n.count += child.second->count;
+    if (better(child.second->best, n.best)) n.best = child.second->best;
+  }
+}
+
+/************************
+ * autocomplete::better *
+ ************************/
+
+bool autocomplete::better(const node *a, const node *b) {
+  if (not a) return false;
+  if (not b) return true;
+  if (a->uses != b->uses) return a->uses > b->uses;
+  return a->when > b->when;
+}
+
+/******************************************************************************
+ * class autocomplete::search
+ */
+
+/********************************
+ * autocomplete::search::search *
+ ********************************/
+
+autocomplete::search::search(const autocomplete &ac)
+  : _ac(&ac), _generation(ac._generation) {
+  _steps.push_back({&ac._root, 0});
+}
+
+/*******************************
+ * autocomplete::search::reset *
+ *******************************/
+
+void autocomplete::search::reset(std::string_view prefix) {
+  _generation = _ac->_generation;
+  _prefix.clear();
+  _steps.clear();
+  _steps.push_back({&_ac->_root, 0});
+
+  for (auto ch: prefix) push(ch);
+}
+
+/******************************
+ * autocomplete::search::push *
+ ******************************/
+
+void autocomplete::search::push(char ch) {
+  if (_generation != _ac->_generation) {
+    // The tree changed under us, the old steps may be gone.
+    reset(_prefix + ch);
+    return;
+  }
+
+  step next = _steps.back();
+  _prefix += ch;
+
+  if (next.n) {
+    if (next.matched < next.n->label.size()) {
+      // Still part way along the label.
+      if (next.n->label[next.matched] == ch) next.matched++;
+      else next.n = nullptr;
+    } else {
+      auto child = next.n->children.find(ch);
+      if (child != next.n->children.end())
+        next = {child->second.get(), 1};
+      else
+        next.n = nullptr;
+    }
+  }
+
+  _steps.push_back(next);
+}
+
+/*****************************
+ * autocomplete::search::pop *
+ *****************************/
+
+void autocomplete::search::pop() {
+  if (_prefix.empty()) return;
+
+  _prefix.pop_back();
+  if (_generation != _ac->_generation) reset(std::string(_prefix));
+  else _steps.pop_back();
+}
+
+/************************************
+ * autocomplete::search::suggestion *
+ ************************************/
+
+std::string autocomplete::search::suggestion() const {
+  // The best completion that starts with the prefix, if there is one.
+  if (_generation != _ac->_generation) {
+    search fresh(*_ac);
+    fresh.reset(_prefix);
+    return fresh.suggestion();
+  }
+
+  const node *n = _steps.back().n;
+  if (not n or not n->best) return std::string();
+  return n->best->value;
 }
@@ -31,22 +31,90 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _LCHAT_AUTOCOMPLETE_H
+#define _LCHAT_AUTOCOMPLETE_H
+
 #include <string>
-#include <list>
+#include <string_view>
+#include <map>
+#include <memory>
+#include <vector>
 
+/* The completions are kept in a radix tree, every node holds the part of
+ * the text leading to it and caches how many completions are below it and
+ * which of them ranks the best. Finding the completions for a prefix is then
+ * a walk down the tree as long as the prefix.
+ *
+ * Completions are ranked by how often they have been used, the most recent
+ * one wins a tie.
+ */
 class autocomplete {
+  struct node;
+
 public:
+  /* A search follows a line as it's typed. Each character typed narrows
+   * the previous position in the tree by one step, deleting one goes back a
+   * step, so a suggestion doesn't search from the top on every keystroke.
+   * Changes to the completions only make the search start over.
+   */
+  class search {
+  public:
+    search(const autocomplete &ac);
+
+    void reset(std::string_view prefix);
+    void push(char ch);
+    void pop();
+
+    const std::string &prefix() const { return _prefix; }
+    std::string suggestion() const;
+
+  private:
+    struct step {
+      const node *n;   // nullptr once nothing matches.
+      size_t matched;  // Characters of the node's label matched.
+    };
+
+    const autocomplete *_ac;
+    unsigned long _generation;
+    std::string _prefix;
+    std::vector<step> _steps; // A step for the root and each character.
+  };
+
   autocomplete();
   virtual ~autocomplete() noexcept;
 
   void add(const std::string &val);
-  void add(std::list<std::string> &list);
+  void remove(const std::string &val);
+  void use(const std::string &line);
 
   std::string operator() (const std::string &prefix,
                           std::string &suggest,
                           bool &is_more);
 
 private:
-  std::list<std::string> _list;
-  std::list<std::list<std::string> *> _lists;
+  struct node {
+    std::string label;  // Text from the parent node to this one.
+    std::map<char, std::unique_ptr<node>> children;
+
+    unsigned int refs;  // Times the completion was added, 0 if not one.
+    unsigned int uses;  // Times the completion was used.
+    unsigned long when; // Clock of the last add or use.
+    std::string value;  // The completion ending at this node.
+
+    size_t count;       // Completions in this subtree.
+    const node *best;   // Best ranked completion in this subtree.
+  };
+
+  node _root;
+  unsigned long _clock;
+  unsigned long _generation; // Changes when nodes are added or removed.
+
+  void insert(node &n, std::string_view key, const std::string &val);
+  bool erase(node &n, std::string_view key);
+  void touch(node &n, std::string_view key);
+
+  static void refresh(node &n);
+  static bool better(const node *a, const node *b);
 };
+
+#endif /* _LCHAT_AUTOCOMPLETE_H */
@@ -0,0 +1,108 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "backlog.h"
+#include <algorithm>
+#include <utility>
+
+/******************************************************************************
+ * class backlog
+ */
+
+/********************
+ * backlog::backlog *
+ ********************/
+
+backlog::backlog(size_t capacity)
+  : _lines(capacity ? capacity : 1), _count(0), _last(0) {
+}
+
+/*********************
+ * backlog::~backlog *
+ *********************/
+
+backlog::~backlog() noexcept {}
+
+/*****************
+ * backlog::push *
+ *****************/
+
+const backlog::line &backlog::push(const std::string &text,
+                                   const std::string &to) {
+  line &entry = _lines[++_last % _lines.size()];
+  entry.seq = _last;
+  entry.to = to;
+  entry.text = text;
+
+  if (_count < _lines.size()) _count++;
+  return entry;
+}
+
+/********************
+ * backlog::restore *
+ ********************/
+
+void backlog::restore(uint64_t seq, const std::string &to,
+                      const std::string &text) {
+  if (seq <= _last) return;
+  if (seq != _last + 1) _count = 0;
+
+  _last = seq - 1;
+  push(text, to);
+}
+
+/*******************
+ * backlog::resize *
+ *******************/
+
+void backlog::resize(size_t capacity) {
+  if (capacity == 0) capacity = 1;
+  if (capacity == _lines.size()) return;
+
+  std::vector<line> lines(capacity);
+  const size_t keep = std::min(_count, capacity);
+  for (uint64_t seq = _last - keep + 1; seq <= _last; seq++)
+    std::swap(lines[seq % capacity], _lines[seq % _lines.size()]);
+
+  _lines.swap(lines);
+  _count = keep;
+}
+
+/*****************
+ * backlog::find *
+ *****************/
+
+const backlog::line *backlog::find(uint64_t seq) const {
+  if (seq == 0 or seq > _last or seq < first()) return nullptr;
+  return &_lines[seq % _lines.size()];
+}
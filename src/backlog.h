@@ -0,0 +1,89 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#ifndef _LCHAT_BACKLOG_H
+#define _LCHAT_BACKLOG_H
+
+/** The latest chat lines sent by the server, by number.
+ *
+ *  Every line is given a 64 bit number one more than the line before it
+ * and kept in a fixed size ring, so the oldest line is replaced by the
+ * newest and any line still held is found directly from its number.
+ */
+class backlog {
+public:
+  struct line {
+    uint64_t seq;
+    std::string to; // Only this user may see it, empty for everyone.
+    std::string text;
+  };
+
+  explicit backlog(size_t capacity = 1000);
+  virtual ~backlog() noexcept;
+
+  /** Number and keep a new line, returning it. */
+  const line &push(const std::string &text, const std::string &to = "");
+
+  /** Put back a line numbered by an earlier server. Lines must be restored
+   * in order, a gap in the numbers drops the lines before it.
+   */
+  void restore(uint64_t seq, const std::string &to, const std::string &text);
+
+  /** Change the number of lines kept, only the newest lines are kept if
+   * it shrinks.
+   */
+  void resize(size_t capacity);
+
+  /** The number of the newest line, 0 before there are any. */
+  uint64_t last() const { return _last; }
+
+  /** The number of the oldest line held, last() + 1 when there are none. */
+  uint64_t first() const { return _last - _count + 1; }
+
+  /** The line with the number or nullptr if it isn't held. */
+  const line *find(uint64_t seq) const;
+
+  size_t size() const { return _count; }
+  size_t capacity() const { return _lines.size(); }
+
+private:
+  std::vector<line> _lines; // Ring of lines, each at its number's slot.
+  size_t _count;            // Number of lines held.
+  uint64_t _last;           // Number of the newest line.
+};
+
+#endif // _LCHAT_BACKLOG_H
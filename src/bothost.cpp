@@ -0,0 +1,560 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bothost.h"
+#include <iostream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/******************************************************************************
+ * class bothost
+ */
+
+/********************
+ * bothost::bothost *
+ ********************/
+
+bothost::bothost() : _sockfd(-1), _seq(0), _skip_help(false) {
+}
+
+/*********************
+ * bothost::~bothost *
+ *********************/
+
+bothost::~bothost() noexcept {
+  for (auto &b: _bots) {
+    for (auto &filter: b->filters) regfree(&filter);
+    if (b->in != -1) ::close(b->in);
+    if (b->out != -1) ::close(b->out);
+  }
+}
+
+/****************
+ * bothost::add *
+ ****************/
+
+void bothost::add(const std::string &command,
+                  const std::vector<std::string> &filters) {
+  auto b = std::make_unique<bot>();
+  b->command = command;
+  b->pid = -1;
+  b->in = b->out = -1;
+  b->dropping = false;
+  b->helper = false;
+
+  for (auto &pattern: filters) {
+    regex_t filter;
+    const int err = regcomp(&filter, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (err != 0) {
+      char message[256];
+      regerror(err, &filter, message, sizeof(message));
+      for (auto &compiled: b->filters) regfree(&compiled);
+      throw std::runtime_error("Invalid bot filter '" + pattern + "': " +
+                               message);
+    }
+    b->filters.push_back(filter);
+  }
+
+  _bots.push_back(std::move(b));
+}
+
+/*****************
+ * bothost::load *
+ *****************/
+
+void bothost::load(const std::string &path) {
+  _rules.load(path);
+
+  // Rules piping to the same command share a helper.
+  _helpers.resize(_rules.size(), nullptr);
+  for (size_t index = 0; index < _rules.size(); index++) {
+    const auto &r = _rules[index];
+    if (r.action != rules::A_PIPE or _helpers[index]) continue;
+
+    add(r.argument, {});
+    _bots.back()->helper = true;
+    for (size_t other = index; other < _rules.size(); other++) {
+      if (_rules[other].action == rules::A_PIPE and
+          _rules[other].argument == r.argument)
+        _helpers[other] = _bots.back().get();
+    }
+  }
+}
+
+/***********************
+ * bothost::operator() *
+ ***********************/
+
+int bothost::operator()(int sockfd) {
+  using namespace std::chrono;
+
+  _sockfd = sockfd;
+
+  // The bots talk to us, not the chat.
+  fcntl(_sockfd, F_SETFD, FD_CLOEXEC);
+  fcntl(_sockfd, F_SETFL, fcntl(_sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+  // A bot that exits shouldn't take us with it.
+  auto old_pipe = signal(SIGPIPE, SIG_IGN);
+
+  // Number the chat lines so we can pick up where we left off.
+  if (not _path.empty()) _out = "/session\n";
+
+  for (auto &b: _bots) start(*b);
+
+  bool connected = true;
+  size_t running = _bots.size();
+  int result = 0;
+
+  // Waiting to reconnect, longer after every attempt that fails.
+  bool waiting = false;
+  milliseconds backoff(500);
+  steady_clock::time_point retry;
+  std::minstd_rand random(getpid());
+
+  std::vector<struct pollfd> fds(1 + _bots.size() * 2);
+
+  /* Keep going while there are bots, or while connected with rules to
+   * answer or replies to send.
+   */
+  while (running > 0 or
+         ((connected or waiting) and
+          (not _rules.empty() or not _out.empty()))) {
+    if (waiting and steady_clock::now() >= retry) {
+      if (connect()) {
+        waiting = false;
+        connected = true;
+        backoff = milliseconds(500);
+      } else {
+        // Spread out the attempts of everyone that lost the server.
+        retry = steady_clock::now() + backoff / 2 +
+          milliseconds(random() % (backoff.count() / 2 + 1));
+        backoff = std::min(backoff * 2, milliseconds(30000));
+      }
+    }
+
+    fds[0] = {(connected ? _sockfd : -1),
+              static_cast<short>(POLLIN | (_out.empty() ? 0 : POLLOUT)), 0};
+    for (size_t i = 0; i < _bots.size(); i++) {
+      const auto &b = *_bots[i];
+      fds[1 + i * 2] = {b.out, POLLIN, 0};
+      fds[2 + i * 2] = {(b.pending.empty() ? -1 : b.in), POLLOUT, 0};
+    }
+
+    int timeout = -1;
+    if (waiting) {
+      timeout = static_cast<int>(std::max<long>(
+        0, duration_cast<milliseconds>(retry - steady_clock::now()).count()));
+    }
+
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR) continue;
+      signal(SIGPIPE, old_pipe);
+      throw std::runtime_error(std::string("poll: ") + strerror(errno));
+    }
+
+    if (fds[0].revents) {
+      if ((fds[0].revents & POLLOUT) and not send()) connected = false;
+      if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) and not receive())
+        connected = false;
+
+      if (not connected and not _token.empty()) {
+        /* We have a session to resume, the bots carry on and what they
+         * say waits for the chat to come back.
+         */
+        ::close(_sockfd);
+        _sockfd = -1;
+        _in.clear();
+        waiting = true;
+        retry = steady_clock::now();
+
+      } else if (not connected) {
+        // The chat has gone, let the bots know there's nothing more.
+        _out.clear();
+        for (auto &b: _bots) {
+          b->pending.clear();
+          if (b->in != -1) ::close(b->in);
+          b->in = -1;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < _bots.size(); i++) {
+      auto &b = *_bots[i];
+
+      if (fds[2 + i * 2].revents and not send(b)) {
+        // The bot stopped reading altogether.
+        ::close(b.in);
+        b.in = -1;
+        b.pending.clear();
+      }
+
+      if (fds[1 + i * 2].revents and not receive(b)) {
+        // The bot closed its output, it's done.
+        const int status = reap(b);
+        if (result == 0) result = status;
+        running--;
+      }
+    }
+
+    if (waiting and _out.size() > max_pending) {
+      std::cerr << "The chat is still away, dropping what the bots said"
+                << std::endl;
+      _out.clear();
+    }
+  }
+
+  signal(SIGPIPE, old_pipe);
+  return result;
+}
+
+/********************
+ * bothost::connect *
+ ********************/
+
+bool bothost::connect() {
+  /* Connect to the chat again and resume our session, ahead of anything
+   * the bots said while we were away.
+   */
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, _path.c_str(), sizeof(addr.sun_path) - 1);
+
+  _sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_sockfd < 0) return false;
+
+  if (::connect(_sockfd, reinterpret_cast<const sockaddr *>(&addr),
+                sizeof(addr)) == -1) {
+    ::close(_sockfd);
+    _sockfd = -1;
+    return false;
+  }
+
+  _out.insert(0, "/resume " + _token + ' ' + std::to_string(_seq) + '\n');
+  return true;
+}
+
+/******************
+ * bothost::start *
+ ******************/
+
+void bothost::start(bot &b) {
+  int in[2], out[2];
+
+  if (pipe2(in, O_CLOEXEC) == -1)
+    throw std::runtime_error(std::string("Unable to create bot pipe: ") +
+                             strerror(errno));
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    ::close(in[0]);
+    ::close(in[1]);
+    throw std::runtime_error(std::string("Unable to create bot pipe: ") +
+                             strerror(errno));
+  }
+
+  b.pid = fork();
+  switch (b.pid) {
+  case 0: // Child Process
+    // The bot talks to us through its standard input and output.
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    signal(SIGPIPE, SIG_DFL);
+
+    execlp("sh", "sh", "-c", b.command.c_str(), NULL);
+    _exit(127);
+
+  case -1:
+    for (auto fd: {in[0], in[1], out[0], out[1]}) ::close(fd);
+    throw std::runtime_error("Bot command failed\n - " +
+                             std::string(strerror(errno)));
+
+  default:
+    ::close(in[0]);
+    ::close(out[1]);
+    b.in = in[1];
+    b.out = out[0];
+    fcntl(b.in, F_SETFL, fcntl(b.in, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(b.out, F_SETFL, fcntl(b.out, F_GETFL, 0) | O_NONBLOCK);
+    break;
+  }
+}
+
+/*****************
+ * bothost::reap *
+ *****************/
+
+int bothost::reap(bot &b) {
+  if (b.in != -1) ::close(b.in);
+  if (b.out != -1) ::close(b.out);
+  b.in = b.out = -1;
+  b.pending.clear();
+
+  int status;
+  while (waitpid(b.pid, &status, 0) == -1)
+    if (errno != EINTR) return EXIT_FAILURE;
+
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  return EXIT_FAILURE;
+}
+
+/******************
+ * bothost::route *
+ ******************/
+
+void bothost::route(const std::string &line) {
+  for (auto &b: _bots)
+    if (not b->helper and b->wants(line)) queue(*b, line);
+
+  if (not _rules.empty()) apply(line);
+}
+
+/******************
+ * bothost::queue *
+ ******************/
+
+void bothost::queue(bot &b, const std::string &line) {
+  if (b.in == -1) return;
+
+  // Once lines are dropped the bot has to catch up before it gets more.
+  if (b.dropping and not b.pending.empty()) return;
+
+  if (b.pending.size() + line.size() >= max_pending) {
+    std::cerr << "Bot '" << b.command
+              << "' isn't keeping up, dropping chat lines" << std::endl;
+    b.dropping = true;
+    return;
+  }
+
+  b.dropping = false;
+  b.pending += line;
+  b.pending += '\n';
+}
+
+/******************
+ * bothost::apply *
+ ******************/
+
+void bothost::apply(const std::string &line) {
+  /* Our own replies and those of the helpers come back from the chat,
+   * they're not run through the rules again or a reply could set itself
+   * off forever.
+   */
+  const auto now = std::chrono::steady_clock::now();
+  while (not _echoes.empty() and
+         now - _echoes.front().sent > std::chrono::seconds(echo_wait))
+    _echoes.pop_front();
+
+  const auto prefix = _name + ": ";
+  if (line.size() > prefix.size() and
+      line.compare(0, prefix.size(), prefix) == 0) {
+    // A reply too long for the server comes back in pieces.
+    const auto size = line.size() - prefix.size();
+    for (auto echo = _echoes.begin(); echo != _echoes.end(); ++echo) {
+      if (echo->text.compare(0, size, line, prefix.size(), size) == 0) {
+        echo->text.erase(0, size);
+        if (echo->text.empty()) _echoes.erase(echo);
+        return;
+      }
+    }
+  }
+
+  _rules.match(line, _matched);
+  for (auto index: _matched) {
+    const auto &r = _rules[index];
+    if (r.action == rules::A_SAY) {
+      auto text = rules::expand(r.argument, line);
+      reply(text.substr(0, text.find('\n')));
+    } else {
+      queue(*_helpers[index], line);
+    }
+  }
+}
+
+/******************
+ * bothost::reply *
+ ******************/
+
+void bothost::reply(const std::string &line) {
+  _out += line;
+  _out += '\n';
+
+  // Commands aren't repeated back to us, anything else will be.
+  if (line.empty() or line[0] != '/')
+    _echoes.push_back({line, std::chrono::steady_clock::now()});
+}
+
+/*****************
+ * bothost::send *
+ *****************/
+
+bool bothost::send(bot &b) {
+  const auto wrote = write(b.in, b.pending.data(), b.pending.size());
+  if (wrote < 0) return (errno == EAGAIN or errno == EINTR);
+
+  b.pending.erase(0, wrote);
+  return true;
+}
+
+bool bothost::send() {
+  const auto wrote = ::send(_sockfd, _out.data(), _out.size(), MSG_NOSIGNAL);
+  if (wrote < 0) return (errno == EAGAIN or errno == EINTR);
+
+  _out.erase(0, wrote);
+  return true;
+}
+
+/********************
+ * bothost::receive *
+ ********************/
+
+bool bothost::receive(bot &b) {
+  char buffer[16384];
+
+  const auto got = read(b.out, buffer, sizeof(buffer));
+  if (got < 0) return (errno == EAGAIN or errno == EINTR);
+
+  if (got == 0) {
+    // Pass on whatever the bot left unfinished.
+    if (not b.partial.empty()) {
+      if (b.helper) reply(b.partial);
+      else _out += b.partial + '\n';
+      b.partial.clear();
+    }
+    return false;
+  }
+
+  // Only whole lines go to the chat so the bots can't garble each other.
+  b.partial.append(buffer, got);
+  const auto end = b.partial.rfind('\n');
+  if (end == b.partial.npos) return true;
+
+  if (b.helper) {
+    size_t start = 0, next;
+    while ((next = b.partial.find('\n', start)) <= end) {
+      reply(b.partial.substr(start, next - start));
+      start = next + 1;
+    }
+  } else {
+    _out.append(b.partial, 0, end + 1);
+  }
+  b.partial.erase(0, end + 1);
+  return true;
+}
+
+bool bothost::receive() {
+  char buffer[65536];
+
+  const auto got = recv(_sockfd, buffer, sizeof(buffer), 0);
+  if (got < 0) return (errno == EAGAIN or errno == EINTR);
+  if (got == 0) return false;
+
+  _in.append(buffer, got);
+
+  size_t start = 0, end;
+  while ((end = _in.find('\n', start)) != _in.npos) {
+    auto line = _in.substr(start, end - start);
+    if (take(line)) route(line);
+    start = end + 1;
+  }
+  _in.erase(0, start);
+  return true;
+}
+
+/*****************
+ * bothost::take *
+ *****************/
+
+bool bothost::take(std::string &line) {
+  /* Sort out the lines that are about our session, returns false for
+   * those and for lines that were already routed.
+   */
+  if (_path.empty()) return true;
+
+  if (line.empty()) return true;
+
+  if (line[0] == '#' and not _token.empty()) {
+    // A numbered line, drop it if it's been seen before.
+    const auto pos = line.find(' ');
+    if (pos != line.npos) {
+      const auto seq = std::strtoull(line.c_str() + 1, nullptr, 10);
+      if (seq <= _seq) return false;
+      _seq = seq;
+      line.erase(0, pos + 1);
+    }
+
+  } else if (line.compare(0, 2, "% ") == 0) {
+    // Our session, the number is where the server is up to.
+    const auto pos = line.find(' ', 2);
+    _token = line.substr(2, pos - 2);
+    if (pos != line.npos)
+      _seq = std::strtoull(line.c_str() + pos + 1, nullptr, 10);
+    return false;
+
+  } else if (line == "? Unknown chat command '/session'") {
+    // Older servers don't have sessions, skip the help after this too.
+    _skip_help = true;
+    return false;
+
+  } else if (_skip_help) {
+    _skip_help = false;
+    if (line.compare(0, 9, "? Type '/") == 0) return false;
+  }
+
+  return true;
+}
+
+/***********************
+ * bothost::bot::wants *
+ ***********************/
+
+bool bothost::bot::wants(const std::string &line) const {
+  if (filters.empty()) return true;
+
+  for (auto &filter: filters)
+    if (regexec(&filter, line.c_str(), 0, nullptr, 0) == 0) return true;
+  return false;
+}
@@ -0,0 +1,158 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+#include <regex.h>
+#include <sys/types.h>
+#include "rules.h"
+
+#ifndef _LCHAT_BOTHOST_H
+#define _LCHAT_BOTHOST_H
+
+/** Runs a number of bots over a single chat connection.
+ *
+ *  Each bot is a shell command talking over a pair of pipes. Lines from the
+ * chat are routed to every bot subscribed to them and the lines the bots
+ * write are passed back to the chat whole, so the bots never interleave
+ * each other's messages. A bot that stops reading has its lines dropped
+ * instead of holding up the chat.
+ *
+ *  Simple bots can be replaced with rules, answered in process or passed
+ * to a helper process that's started once and kept running.
+ */
+class bothost {
+public:
+  bothost();
+  bothost(const bothost &other) = delete;
+  virtual ~bothost() noexcept;
+
+  bothost &operator=(const bothost &other) = delete;
+
+  /** Add a bot command. Only chat lines matching one of the filters, POSIX
+   * extended regular expressions, are sent to it. Without any filters it
+   * gets every line.
+   */
+  void add(const std::string &command,
+           const std::vector<std::string> &filters);
+
+  /** Load bot rules from a file. The helper processes for the rules are
+   * started with the bots.
+   */
+  void load(const std::string &path);
+
+  bool empty() const { return _bots.empty() and _rules.empty(); }
+
+  /** Reconnect to the chat at path when the connection is lost. With a
+   * server that has sessions the bots keep running through it and get
+   * every chat line once, the lines missed are sent again and the lines
+   * seen twice are dropped.
+   */
+  void reconnect(const std::string &path) { _path = path; }
+
+  /** Our name in the chat, the replies that come back under it aren't run
+   * through the rules again.
+   */
+  void name(const std::string &name) { _name = name; }
+
+  /** Start the bots and run them over the connected socket until they have
+   * all exited. Returns the exit status of the first bot that failed, or 0.
+   */
+  int operator()(int sockfd);
+
+  // Lines held for a bot that isn't reading before they're dropped.
+  static const size_t max_pending = 1024 * 1024;
+
+private:
+  struct bot {
+    std::string command;
+    std::vector<regex_t> filters;
+
+    pid_t pid;
+    int in, out; // Our ends of the bot's standard input and output.
+
+    std::string pending; // Lines waiting to be written to the bot.
+    std::string partial; // Output that isn't a complete line yet.
+    bool dropping;
+    bool helper; // Only gets the lines its rules send it.
+
+    bool wants(const std::string &line) const;
+  };
+
+  std::vector<std::unique_ptr<bot>> _bots;
+
+  ::rules _rules;
+  std::vector<bot *> _helpers; // The helper for each rule that pipes.
+  std::vector<size_t> _matched;
+
+  /* Replies we're waiting to see again. One that doesn't come back in
+   * echo_wait seconds, refused or lost, is forgotten.
+   */
+  struct echo {
+    std::string text;
+    std::chrono::steady_clock::time_point sent;
+  };
+  std::deque<echo> _echoes;
+  std::string _name;
+  static const int echo_wait = 10;
+
+  int _sockfd;
+  std::string _out; // Waiting to be written to the chat.
+  std::string _in; // Chat input that isn't a complete line yet.
+
+  // Our session, to resume after the last line numbered _seq.
+  std::string _path;
+  std::string _token;
+  uint64_t _seq;
+  bool _skip_help; // Skip the help for a command older servers lack.
+
+  void start(bot &b);
+  int reap(bot &b);
+  bool connect();
+  bool take(std::string &line);
+
+  void route(const std::string &line);
+  void queue(bot &b, const std::string &line);
+  void apply(const std::string &line);
+  void reply(const std::string &line);
+  bool send(bot &b);
+  bool receive(bot &b);
+  bool send();
+  bool receive();
+};
+
+#endif /* _LCHAT_BOTHOST_H */
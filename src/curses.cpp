@@ -33,9 +33,15 @@
 
 #include "curses"
 #include <term.h>
+#include <algorithm>
 #include <cstring>
+#include <cerrno>
 #include <stdarg.h>
 #include <clocale>
+#include <map>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
 #ifdef HAVE_STDBOOL_H
 # include <stdbool.h>
@@ -59,6 +65,22 @@ typedef bool _Bool;
 static std::ofstream debug_log;
 #endif
 
+// The file descriptor keyboard input is read from for the event loop.
+static int _input_fd = STDIN_FILENO;
+
+/* The window buffer behind a stream if it's in batch mode, manipulators
+ * record their changes with it rather than flushing.
+ */
+static curs::windowbuf *batching(std::ostream &os) {
+  auto buf = dynamic_cast<curs::windowbuf *>(os.rdbuf());
+  return (buf != nullptr and buf->batching() ? buf : nullptr);
+}
+
+// Refresh a window, unless it's left to an explicit refresh.
+static void refresh_window(std::ostream &os, WINDOW *win) {
+  if (not batching(os)) ::wnoutrefresh(win);
+}
+
 /*****************************************************************************
  * class curs::terminal
  */
@@ -149,7 +171,7 @@ void curs::terminal::cursor(bool show) {
  * curs::terminal::terminal *
  ****************************/
 
-curs::terminal::terminal() : screen(nullptr) {
+curs::terminal::terminal() : screen(nullptr), infd(STDIN_FILENO) {
 #ifdef DEBUG
   if (not debug_log.is_open())
       debug_log.open("curses.log");
@@ -162,9 +184,12 @@ curs::terminal::terminal() : screen(nullptr) {
 
   ::use_default_colors();
   ::assume_default_colors(-1, -1);
+
+  _input_fd = infd;
 }
 
-curs::terminal::terminal(int outfd, int infd) : screen(nullptr) {
+curs::terminal::terminal(int outfd, int infd)
+  : screen(nullptr), infd(infd) {
 #ifdef DEBUG
   if (not debug_log.is_open())
       debug_log.open("curses.log");
@@ -177,9 +202,12 @@ curs::terminal::terminal(int outfd, int infd) : screen(nullptr) {
 
   ::use_default_colors();
   ::assume_default_colors(-1, -1);
+
+  _input_fd = infd;
 }
 
-curs::terminal::terminal(FILE *outfile, FILE *infile) : screen(nullptr) {
+curs::terminal::terminal(FILE *outfile, FILE *infile)
+  : screen(nullptr), infd(fileno(infile)) {
 #ifdef DEBUG
   if (not debug_log.is_open())
       debug_log.open("curses.log");
@@ -192,9 +220,12 @@ curs::terminal::terminal(FILE *outfile, FILE *infile) : screen(nullptr) {
 
   ::use_default_colors();
   ::assume_default_colors(-1, -1);
+
+  _input_fd = infd;
 }
 
-curs::terminal::terminal(const std::string &term, int outfd, int infd) {
+curs::terminal::terminal(const std::string &term, int outfd, int infd)
+  : infd(infd) {
 #ifdef DEBUG
   if (not debug_log.is_open())
       debug_log.open("curses.log");
@@ -207,9 +238,12 @@ curs::terminal::terminal(const std::string &term, int outfd, int infd) {
 
   ::use_default_colors();
   ::assume_default_colors(-1, -1);
+
+  _input_fd = infd;
 }
 
-curs::terminal::terminal(const std::string &term, FILE *outfile, FILE *infile) {
+curs::terminal::terminal(const std::string &term, FILE *outfile, FILE *infile)
+  : infd(fileno(infile)) {
 #ifdef DEBUG
   if (not debug_log.is_open())
       debug_log.open("curses.log");
@@ -222,6 +256,8 @@ curs::terminal::terminal(const std::string &term, FILE *outfile, FILE *infile) {
 
   ::use_default_colors();
   ::assume_default_colors(-1, -1);
+
+  _input_fd = infd;
 }
 
 /*****************************
@@ -240,6 +276,7 @@ curs::terminal::~terminal() noexcept {
 
 void curs::terminal::set() const {
   set_term(screen);
+  _input_fd = infd;
 }
 
 /*****************************************************************************
@@ -252,7 +289,7 @@ void curs::terminal::set() const {
 
 curs::windowbuf::windowbuf(WINDOW *win, bool free_window , size_t buffer)
   : _window(win), _free_window(free_window), _use_stdscr(false),
-    _obuf(buffer) {
+    _obuf(buffer), _batch(false), _first_attr(0), _attr(0) {
   if (win == nullptr) {
     throw std::runtime_error("Null curses window");
   }
@@ -313,8 +350,12 @@ int curs::windowbuf::sync() {
 bool curs::windowbuf::oflush() {
   auto wlen = pptr() - pbase();
   char *buf = pbase();
+  bool result = true;
 
-  if (wlen > 0) {
+  if (_batch) {
+    result = apply();
+
+  } else if (wlen > 0) {
     if (_use_stdscr) {
       int result = ::waddnstr(::stdscr, buf, static_cast<int>(wlen));
       if (result == ERR) return false;
@@ -332,7 +373,118 @@ bool curs::windowbuf::oflush() {
   char *base = &_obuf.front();
   setp(base, base + _obuf.size() - 1);
 
-  return true;
+  return result;
+}
+
+/**************************
+ * curs::windowbuf::batch *
+ **************************/
+
+void curs::windowbuf::batch(bool value) {
+  oflush();
+  _batch = value;
+
+  // Start tracking the attributes from what the window has now.
+  if (_batch) {
+    _first_attr = _attr = getattrs(_use_stdscr ? ::stdscr : _window);
+    _runs.clear();
+  }
+}
+
+/*******************************
+ * curs::windowbuf::attributes *
+ *******************************/
+
+void curs::windowbuf::attributes(int on, int off) {
+  const int attr = (_attr & ~off) | on;
+  if (attr == _attr) return;
+
+  // A change with no text since the last one replaces it.
+  const size_t at = pptr() - pbase();
+  if (not _runs.empty() and _runs.back().first == at)
+    _runs.back().second = attr;
+  else
+    _runs.emplace_back(at, attr);
+
+  _attr = attr;
+}
+
+/**************************
+ * curs::windowbuf::apply *
+ **************************/
+
+bool curs::windowbuf::apply() {
+  // Write the collected text to the window, a run at a time.
+  WINDOW *win = (_use_stdscr ? ::stdscr : _window);
+  const char *text = pbase();
+  const size_t len = pptr() - pbase();
+  bool result = true;
+
+  size_t at = 0;
+  ::wattrset(win, _first_attr);
+  for (auto &run: _runs) {
+    if (not write(win, text + at, run.first - at)) result = false;
+    ::wattrset(win, run.second);
+    at = run.first;
+  }
+  if (not write(win, text + at, len - at)) result = false;
+
+  _runs.clear();
+  _first_attr = _attr;
+
+  return result;
+}
+
+/**************************
+ * curs::windowbuf::write *
+ **************************/
+
+bool curs::windowbuf::write(WINDOW *win, const char *text, size_t len) {
+  bool result = true;
+
+#ifdef HAVE_NCURSESW_H
+  /* Plain ASCII that ends before the edge of the window is copied straight
+   * into it as a run of cells. Everything else, control characters,
+   * multibyte characters and text that wraps, goes through waddnstr so curses
+   * handles it as usual.
+   */
+  auto plain = [](char ch) { return ch >= ' ' and ch < 0x7f; };
+
+  size_t at = 0;
+  while (at < len) {
+    size_t end = at;
+    while (end < len and plain(text[end])) end++;
+
+    int y, x;
+    getyx(win, y, x);
+    const int room = getmaxx(win) - x - 1;
+    const size_t count = std::min(end - at, (size_t)std::max(room, 0));
+
+    if (count > 0) {
+      _cells.resize(count);
+      for (size_t c = 0; c < count; c++) {
+        const wchar_t wc[2] = {(wchar_t)text[at + c], L'\0'};
+        ::setcchar(&_cells[c], wc, A_NORMAL, 0, nullptr);
+      }
+      ::wadd_wchnstr(win, _cells.data(), count);
+      ::wmove(win, y, x + count);
+      at += count;
+    }
+
+    if (at < len) {
+      size_t next = std::max(at, end);
+      while (next < len and not plain(text[next])) next++;
+      if (next == at) next = end;
+
+      if (::waddnstr(win, text + at, next - at) == ERR) result = false;
+      at = next;
+    }
+  }
+#else
+  if (len > 0 and ::waddnstr(win, text, len) == ERR) result = false;
+#endif
+
+  return result;
 }
 
 /*****************************************************************************
@@ -704,6 +856,12 @@ std::ostream &curs::noutrefresh(std::ostream &os) {
   return os;
 }
 
+std::ostream &curs::batch::operator()(std::ostream &os) const {
+  auto buf = dynamic_cast<windowbuf *>(os.rdbuf());
+  if (buf != nullptr) buf->batch(_value);
+  return os;
+}
+
 std::ostream &curs::keypad::operator()(std::ostream &os) const {
   base_ostream *osptr = dynamic_cast<base_ostream *>(&os);
   if (osptr != NULL)
@@ -756,6 +914,11 @@ std::ostream &curs::setscrreg::operator()(std::ostream &os) const {
 std::ostream &curs::attron::operator()(std::ostream &os) const {
   base_ostream *osptr = dynamic_cast<base_ostream *>(&os);
   if (osptr != NULL) {
+    if (auto buf = batching(os)) {
+      buf->attributes(_attr, 0);
+      return os;
+    }
+
     os << std::flush;
     ::wattron(*osptr, _attr);
   }
@@ -765,6 +928,11 @@ std::ostream &curs::attron::operator()(std::ostream &os) const {
 std::ostream &curs::attroff::operator()(std::ostream &os) const {
   base_ostream *osptr = dynamic_cast<base_ostream *>(&os);
   if (osptr != NULL) {
+    if (auto buf = batching(os)) {
+      buf->attributes(0, _attr);
+      return os;
+    }
+
     os << std::flush;
     ::wattroff(*osptr, _attr);
   }
@@ -774,6 +942,11 @@ std::ostream &curs::attroff::operator()(std::ostream &os) const {
 std::ostream &curs::attrset::operator()(std::ostream &os) const {
   base_ostream *osptr = dynamic_cast<base_ostream *>(&os);
   if (osptr != NULL) {
+    if (auto buf = batching(os)) {
+      buf->attributes(_attr, ~0);
+      return os;
+    }
+
     os << std::flush;
     ::wattrset(*osptr, _attr);
   }
@@ -783,6 +956,11 @@ std::ostream &curs::attrset::operator()(std::ostream &os) const {
 std::ostream &curs::pairon::operator()(std::ostream &os) const {
   base_ostream *osptr = dynamic_cast<base_ostream *>(&os);
   if (osptr != NULL) {
+    if (auto buf = batching(os)) {
+      buf->attributes(colors::pair(_color_pair), 0);
+      return os;
+    }
+
     os << std::flush;
     ::wattron(*osptr, colors::pair(_color_pair));
   }
@@ -792,6 +970,11 @@ std::ostream &curs::pairon::operator()(std::ostream &os) const {
 std::ostream &curs::pairoff::operator()(std::ostream &os) const {
   base_ostream *osptr = dynamic_cast<base_ostream *>(&os);
   if (osptr != NULL) {
+    if (auto buf = batching(os)) {
+      buf->attributes(0, colors::pair(_color_pair));
+      return os;
+    }
+
     os << std::flush;
     ::wattroff(*osptr, colors::pair(_color_pair));
   }
@@ -808,7 +991,7 @@ std::ostream &curs::bkgrnd::operator()(std::ostream &os) const {
 #else
     ::wbkgd(*osptr, _character);
 #endif
-    ::wnoutrefresh(*osptr);
+    refresh_window(os, *osptr);
   }
   return os;
 }
@@ -823,7 +1006,7 @@ std::ostream &curs::bkgrndset::operator()(std::ostream &os) const {
 #else
     ::wbkgdset(*osptr, _character);
 #endif
-    ::wnoutrefresh(*osptr);
+    refresh_window(os, *osptr);
   }
   return os;
 }
@@ -834,7 +1017,7 @@ std::ostream &curs::cursor::operator()(std::ostream &os) const {
     os << std::flush;
     if (_op == POSITION) {
       ::wmove(*osptr, _y, _x);
-      ::wrefresh(*osptr);
+      refresh_window(os, *osptr);
     }
     if (_op == VISIBLITY) {
       if (_show) ::curs_set(1);
@@ -852,7 +1035,7 @@ std::ostream &curs::hline::operator()(std::ostream &os) const {
       ::mvwhline_set(*osptr, _y, _x, _character, _length);
     else
       ::whline_set(*osptr, _character, _length);
-    ::wnoutrefresh(*osptr);
+    refresh_window(os, *osptr);
   }
   return os;
 }
@@ -865,7 +1048,7 @@ std::ostream &curs::vline::operator()(std::ostream &os) const {
       ::mvwvline_set(*osptr, _y, _x, _character, _length);
     else
       ::wvline_set(*osptr, _character, _length);
-    ::wnoutrefresh(*osptr);
+    refresh_window(os, *osptr);
   }
   return os;
 }
@@ -875,7 +1058,7 @@ std::ostream &curs::box::operator()(std::ostream &os) const {
   if (osptr != NULL) {
     os << std::flush;
     ::box_set(*osptr, _verch, _horch);
-    ::wnoutrefresh(*osptr);
+    refresh_window(os, *osptr);
   }
   return os;
 }
@@ -920,8 +1103,18 @@ std::ostream &operator <<(std::ostream &ios, const curs::osmanip &manip) {
  * class curs::resize_event_hander
  */
 
-curs::resize_event_handler::resize_event_handler()
-  : _orig_handler(signal(SIGWINCH, curs::resize_event_handler::_callback)) {
+curs::resize_event_handler::resize_event_handler() {
+  /* The signal handler only writes to a pipe, the resize itself is done
+   * from the event loop where it's safe to use curses.
+   */
+  if (_pipe[0] == -1 and pipe(_pipe) == 0) {
+    for (auto fd: _pipe) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+
+  _orig_handler = signal(SIGWINCH, curs::resize_event_handler::_callback);
   _handler = this;
 }
 
@@ -932,9 +1125,23 @@ void curs::resize_event_handler::resize_event() {
 }
 
 curs::resize_event_handler *curs::resize_event_handler::_handler;
+int curs::resize_event_handler::_pipe[2] = {-1, -1};
 
 void curs::resize_event_handler::_callback(int signal) {
-  if (signal == SIGWINCH and _handler) {
+  if (signal == SIGWINCH and _pipe[1] != -1) {
+    const auto err = errno;
+    const char ch = 'r';
+    if (write(_pipe[1], &ch, 1) < 0) {} // A full pipe is already signalled.
+    errno = err;
+  }
+}
+
+void curs::resize_event_handler::_resize() {
+  // Drain the pipe, any number of signals is a single resize.
+  char buf[64];
+  while (read(_pipe[0], buf, sizeof(buf)) > 0);
+
+  if (_handler) {
     ::endwin();  // Recreate stdscr
     ::refresh();
 
@@ -978,6 +1185,14 @@ bool curs::keyboard_event_handler::has_focus() const {
   return (_focused == this);
 }
 
+/********************************************
+ * curs::keyboard_event_handler::char_event *
+ ********************************************/
+
+void curs::keyboard_event_handler::char_event(wint_t ch) {
+  key_event(ch);
+}
+
 /********************************************
  * curs::keyboard_event_handler::lose_focus *
  ********************************************/
@@ -1013,24 +1228,136 @@ curs::mouse_event_handler::~mouse_event_handler() noexcept {
 
 static bool _do_events = true;
 
+static std::map<int, std::function<void()>> _watched;
+static std::map<int, std::function<void()>> _watched_output;
+
+/***********************
+ * curs::events::watch *
+ ***********************/
+
+void curs::events::watch(int fd, std::function<void()> callback) {
+  _watched[fd] = callback;
+}
+
+/*************************
+ * curs::events::unwatch *
+ *************************/
+
+void curs::events::unwatch(int fd) {
+  _watched.erase(fd);
+}
+
+/******************************
+ * curs::events::watch_output *
+ ******************************/
+
+void curs::events::watch_output(int fd, std::function<void()> callback) {
+  _watched_output[fd] = callback;
+}
+
+/********************************
+ * curs::events::unwatch_output *
+ ********************************/
+
+void curs::events::unwatch_output(int fd) {
+  _watched_output.erase(fd);
+}
+
 /*************************
  * curs::events::process *
  *************************/
 
-void curs::events::process() {
+void curs::events::process(int timeout) {
   int c;
   MEVENT event;
 
-  c = ::getch();
-  if (c == KEY_MOUSE) {
-    // Dispatch mouse events.
-    if (getmouse(&event) == OK) {
-      for (auto &evt: mouse_handlers)
-        evt->event(event.id, event.x, event.y, event.bstate);
+  // Wait on the terminal, the resize pipe and everything being watched.
+  std::vector<struct pollfd> fds;
+  fds.push_back({_input_fd, POLLIN, 0});
+  if (resize_event_handler::_pipe[0] != -1)
+    fds.push_back({resize_event_handler::_pipe[0], POLLIN, 0});
+  for (auto &watch: _watched) {
+    const short events = POLLIN | (_watched_output.count(watch.first) ?
+                                   POLLOUT : 0);
+    fds.push_back({watch.first, events, 0});
+  }
+  for (auto &watch: _watched_output)
+    if (not _watched.count(watch.first))
+      fds.push_back({watch.first, POLLOUT, 0});
+
+  if (poll(fds.data(), fds.size(), timeout) <= 0) {
+    // Timed out or interrupted by a signal, which lands in the pipe.
+    return;
+  }
+
+  for (auto &pfd: fds) {
+    if (pfd.revents == 0) continue;
+
+    if (pfd.fd == _input_fd) {
+      /* Take every key that's ready, curses may have read ahead of what
+       * poll can see.
+       */
+      bool got_input = false;
+      ::nodelay(::stdscr, TRUE);
+#ifdef HAVE_NCURSESW_H
+      /* Characters are read whole so multibyte text arrives as one
+       * character, function keys still come through as key codes.
+       */
+      wint_t wc;
+      while ((c = ::get_wch(&wc)) != ERR) {
+        got_input = true;
+        if (c == KEY_CODE_YES and wc == KEY_MOUSE) {
+          // Dispatch mouse events.
+          if (getmouse(&event) == OK) {
+            for (auto &evt: mouse_handlers)
+              evt->event(event.id, event.x, event.y, event.bstate);
+          }
+        } else if (_focused != nullptr) {
+          // Dispatch the key or character event.
+          if (c == KEY_CODE_YES) _focused->key_event(wc);
+          else _focused->char_event(wc);
+        }
+      }
+#else
+      while ((c = ::getch()) != ERR) {
+        got_input = true;
+        if (c == KEY_MOUSE) {
+          // Dispatch mouse events.
+          if (getmouse(&event) == OK) {
+            for (auto &evt: mouse_handlers)
+              evt->event(event.id, event.x, event.y, event.bstate);
+          }
+        } else if (_focused != nullptr) {
+          // Dispatch the key event.
+          if (c < KEY_MIN) _focused->char_event(c);
+          else _focused->key_event(c);
+        }
+      }
+#endif
+
+      if (not got_input and (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+        // The terminal has gone away, there will be no more input.
+        _do_events = false;
+      }
+
+    } else if (pfd.fd == resize_event_handler::_pipe[0]) {
+      resize_event_handler::_resize();
+
+    } else {
+      // The callbacks may unwatch the descriptor, so hold on to a copy.
+      auto output = _watched_output.find(pfd.fd);
+      if (output != _watched_output.end() and
+          (pfd.revents & (POLLOUT | POLLERR | POLLHUP))) {
+        auto callback = output->second;
+        callback();
+      }
+
+      auto watch = _watched.find(pfd.fd);
+      if (watch != _watched.end() and (pfd.revents & ~POLLOUT)) {
+        auto callback = watch->second;
+        callback();
+      }
     }
-  } else if (_focused != nullptr) {
-    // Dispatch the key event.
-    _focused->key_event(c);
   }
 }
 
@@ -1049,3 +1376,11 @@ void curs::events::main() {
 void curs::events::quit() {
   _do_events = false;
 }
+
+/*************************
+ * curs::events::running *
+ *************************/
+
+bool curs::events::running() {
+  return _do_events;
+}
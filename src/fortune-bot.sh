@@ -14,7 +14,7 @@ while read LINE; do
             fortune -u -s
             ;;
         *\ has\ joined\ the\ chat.)
-            WHO=$(echo "$LINE" | cut -f1 -d' ')
+            WHO="${LINE%% *}"
             echo "/msg ${WHO} Type !fortune if you want hear a fortune"
             ;;
     esac
@@ -0,0 +1,272 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "gapbuffer.h"
+#include <climits>
+#include <cstring>
+
+/******************************************************************************
+ * class gapbuffer
+ */
+
+/************************
+ * gapbuffer::gapbuffer *
+ ************************/
+
+gapbuffer::gapbuffer(size_t capacity)
+  : _cells(capacity ? capacity : 1), _gap(0), _gap_end(_cells.size()),
+    _bytes(0), _column(0), _columns(0) {
+}
+
+/*********************
+ * gapbuffer::insert *
+ *********************/
+
+void gapbuffer::insert(wchar_t ch) {
+  if (_gap == _gap_end) grow();
+
+  const int width = char_width(ch);
+
+  _cells[_gap++] = {ch, static_cast<uint8_t>(width),
+                    static_cast<uint8_t>(encoded_length(ch))};
+  _bytes += _cells[_gap - 1].bytes;
+  _column += width;
+  _columns += width;
+}
+
+/**********************
+ * gapbuffer::replace *
+ **********************/
+
+void gapbuffer::replace(wchar_t ch) {
+  // Overwrite the character after the cursor, at the end just add it.
+  if (not at_end()) {
+    _bytes -= _cells[_gap_end].bytes;
+    _columns -= _cells[_gap_end].width;
+    _gap_end++;
+  }
+  insert(ch);
+}
+
+/***************************
+ * gapbuffer::erase_before *
+ ***************************/
+
+wchar_t gapbuffer::erase_before() {
+  if (_gap == 0) return L'\0';
+
+  const entry &removed = _cells[--_gap];
+  _bytes -= removed.bytes;
+  _column -= removed.width;
+  _columns -= removed.width;
+  return removed.ch;
+}
+
+/**************************
+ * gapbuffer::erase_after *
+ **************************/
+
+bool gapbuffer::erase_after() {
+  if (at_end()) return false;
+
+  _bytes -= _cells[_gap_end].bytes;
+  _columns -= _cells[_gap_end++].width;
+  return true;
+}
+
+/***************************
+ * gapbuffer::erase_to_end *
+ ***************************/
+
+bool gapbuffer::erase_to_end() {
+  if (at_end()) return false;
+
+  while (_gap_end < _cells.size()) _bytes -= _cells[_gap_end++].bytes;
+  _columns = _column;
+  return true;
+}
+
+/********************
+ * gapbuffer::clear *
+ ********************/
+
+void gapbuffer::clear() {
+  _gap = 0;
+  _gap_end = _cells.size();
+  _bytes = 0;
+  _column = 0;
+  _columns = 0;
+}
+
+/*******************
+ * gapbuffer::left *
+ *******************/
+
+bool gapbuffer::left() {
+  if (_gap == 0) return false;
+
+  _cells[--_gap_end] = _cells[--_gap];
+  _column -= _cells[_gap_end].width;
+  return true;
+}
+
+/********************
+ * gapbuffer::right *
+ ********************/
+
+bool gapbuffer::right() {
+  if (at_end()) return false;
+
+  _column += _cells[_gap_end].width;
+  _cells[_gap++] = _cells[_gap_end++];
+  return true;
+}
+
+/*******************
+ * gapbuffer::home *
+ *******************/
+
+void gapbuffer::home() {
+  while (left());
+}
+
+/******************
+ * gapbuffer::end *
+ ******************/
+
+void gapbuffer::end() {
+  while (right());
+}
+
+/*********************
+ * gapbuffer::assign *
+ *********************/
+
+void gapbuffer::assign(std::string_view text) {
+  clear();
+
+  std::mbstate_t state{};
+  size_t at = 0;
+  while (at < text.size()) {
+    wchar_t ch;
+    const size_t len = std::mbrtowc(&ch, text.data() + at, text.size() - at,
+                                    &state);
+    if (len == (size_t)-1 or len == (size_t)-2) {
+      // Bytes that aren't valid text are replaced.
+      insert(L'\xfffd');
+      state = std::mbstate_t{};
+      at++;
+    } else {
+      insert(ch);
+      at += (len ? len : 1);
+    }
+  }
+}
+
+/******************
+ * gapbuffer::str *
+ ******************/
+
+std::string gapbuffer::str(size_t from, size_t to) const {
+  std::string result;
+  result.reserve(_bytes);
+
+  char buffer[MB_LEN_MAX];
+  std::mbstate_t state{};
+  for (size_t index = from; index < to and index < size(); index++) {
+    const size_t len = std::wcrtomb(buffer, cell(index).ch, &state);
+    if (len != (size_t)-1) result.append(buffer, len);
+  }
+
+  return result;
+}
+
+/*****************************
+ * gapbuffer::encoded_length *
+ *****************************/
+
+size_t gapbuffer::encoded_length(wchar_t ch) {
+  char buffer[MB_LEN_MAX];
+  std::mbstate_t state{};
+  const size_t len = std::wcrtomb(buffer, ch, &state);
+  return (len == (size_t)-1 ? 0 : len);
+}
+
+/*************************
+ * gapbuffer::char_width *
+ *************************/
+
+int gapbuffer::char_width(wchar_t ch) {
+  // Control characters are shown by curses as ^X.
+  const int width = wcwidth(ch);
+  return (width < 0 ? 2 : width);
+}
+
+/*************************
+ * gapbuffer::text_width *
+ *************************/
+
+int gapbuffer::text_width(std::string_view text) {
+  int width = 0;
+
+  std::mbstate_t state{};
+  size_t at = 0;
+  while (at < text.size()) {
+    wchar_t ch;
+    const size_t len = std::mbrtowc(&ch, text.data() + at, text.size() - at,
+                                    &state);
+    if (len == (size_t)-1 or len == (size_t)-2) {
+      width++;
+      state = std::mbstate_t{};
+      at++;
+    } else {
+      width += char_width(ch);
+      at += (len ? len : 1);
+    }
+  }
+
+  return width;
+}
+
+/*******************
+ * gapbuffer::grow *
+ *******************/
+
+void gapbuffer::grow() {
+  // Double the buffer, moving the text after the gap to the new end.
+  const size_t tail = _cells.size() - _gap_end;
+  _cells.resize(_cells.size() * 2);
+  std::memmove(&_cells[_cells.size() - tail], &_cells[_gap_end],
+               tail * sizeof(entry));
+  _gap_end = _cells.size() - tail;
+}
@@ -0,0 +1,119 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cwchar>
+
+#ifndef _LCHAT_GAPBUFFER_H
+#define _LCHAT_GAPBUFFER_H
+
+/** An editable line of characters.
+ *
+ *  The characters are kept as code points in a gap buffer, the gap sits at
+ * the cursor so typing, deleting and moving the cursor one character are
+ * constant time however long the line is. Each character keeps its display
+ * width and encoded length, so the cursor's column and the length of the
+ * encoded line are always known.
+ */
+class gapbuffer {
+public:
+  explicit gapbuffer(size_t capacity = 128);
+
+  void insert(wchar_t ch);
+  void replace(wchar_t ch);
+  wchar_t erase_before();
+  bool erase_after();
+  bool erase_to_end();
+  void clear();
+
+  bool left();
+  bool right();
+  void home();
+  void end();
+
+  /** Replace the line with multibyte text, the cursor goes to the end. */
+  void assign(std::string_view text);
+
+  /** The number of characters in the line. */
+  size_t size() const { return _cells.size() - (_gap_end - _gap); }
+  bool empty() const { return size() == 0; }
+
+  /** The index of the character after the cursor. */
+  size_t cursor() const { return _gap; }
+  bool at_end() const { return _gap_end == _cells.size(); }
+
+  /** The length of the line encoded as multibyte text. */
+  size_t bytes() const { return _bytes; }
+
+  /** The display column of the cursor. */
+  int column() const { return _column; }
+
+  /** The display width of the whole line. */
+  int columns() const { return _columns; }
+
+  /** The display width of a character. */
+  int width(size_t index) const { return cell(index).width; }
+
+  /** The line, or part of it, as multibyte text. */
+  std::string str() const { return str(0, size()); }
+  std::string str(size_t from, size_t to) const;
+
+  static size_t encoded_length(wchar_t ch);
+  static int char_width(wchar_t ch);
+
+  /** The display width of multibyte text. */
+  static int text_width(std::string_view text);
+
+private:
+  struct entry {
+    wchar_t ch;
+    uint8_t width;  // Columns it takes on the screen.
+    uint8_t bytes;  // Length of it as multibyte text.
+  };
+
+  std::vector<entry> _cells;
+  size_t _gap, _gap_end; // The gap is _cells[_gap, _gap_end).
+  size_t _bytes;
+  int _column, _columns;
+
+  const entry &cell(size_t index) const {
+    return _cells[index < _gap ? index : index + (_gap_end - _gap)];
+  }
+
+  void grow();
+};
+
+#endif /* _LCHAT_GAPBUFFER_H */
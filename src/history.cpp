@@ -0,0 +1,268 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "history.h"
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/******************************************************************************
+ * class history
+ */
+
+/********************
+ * history::history *
+ ********************/
+
+history::history() : _fd(-1), _map(nullptr), _map_size(0), _unread(0) {}
+
+/*********************
+ * history::~history *
+ *********************/
+
+history::~history() noexcept {
+  close();
+}
+
+/*****************
+ * history::open *
+ *****************/
+
+void history::open(const std::string &path) {
+  /* The history still works without a file, it just isn't kept. So any
+   * problem with the file leaves it that way.
+   */
+  close();
+  if (path.empty()) return;
+
+  struct stat st;
+  if (::stat(path.c_str(), &st) == 0 and (size_t)st.st_size > max_size)
+    trim(path);
+
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (_fd < 0) return;
+
+  if (fstat(_fd, &st) == 0 and st.st_size > 0) {
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (map != MAP_FAILED) {
+      _map = static_cast<const char *>(map);
+      _map_size = st.st_size;
+      _unread = _map_size;
+
+      // Make sure new entries don't run on from a broken last line.
+      if (_map[_map_size - 1] != '\n' and ::write(_fd, "\n", 1) < 0) {
+        ::close(_fd);
+        _fd = -1;
+      }
+    }
+  }
+}
+
+/******************
+ * history::close *
+ ******************/
+
+void history::close() {
+  if (_map) munmap(const_cast<char *>(_map), _map_size);
+  if (_fd >= 0) ::close(_fd);
+
+  _fd = -1;
+  _map = nullptr;
+  _map_size = 0;
+  _unread = 0;
+  _spans.clear();
+  _added.clear();
+}
+
+/****************
+ * history::add *
+ ****************/
+
+bool history::add(std::string_view line) {
+  // Empty lines and repeats of the last entry aren't kept.
+  if (line.empty() or line.find('\n') != line.npos) return false;
+  if (has(0) and (*this)[0] == line) return false;
+
+  _added.emplace_back(line);
+
+  if (_fd >= 0) {
+    std::string entry(line);
+    entry += '\n';
+
+    // The file is opened to append, so the entry goes on in one write.
+    ssize_t result;
+    do {
+      result = ::write(_fd, entry.data(), entry.size());
+    } while (result < 0 and errno == EINTR);
+  }
+
+  return true;
+}
+
+/****************
+ * history::has *
+ ****************/
+
+bool history::has(size_t age) {
+  if (age < _added.size()) return true;
+  age -= _added.size();
+
+  while (age >= _spans.size())
+    if (not index()) return false;
+  return true;
+}
+
+/***********************
+ * history::operator[] *
+ ***********************/
+
+std::string_view history::operator[](size_t age) {
+  if (not has(age)) return std::string_view();
+  if (age < _added.size()) return _added[_added.size() - 1 - age];
+
+  const auto &entry = _spans[age - _added.size()];
+  return std::string_view(_map + entry.start, entry.end - entry.start);
+}
+
+/*****************
+ * history::find *
+ *****************/
+
+size_t history::find(std::string_view text, size_t from) {
+  // The entries are looked at in place, none of them are copied.
+  for (size_t age = from; has(age); age++)
+    if ((*this)[age].find(text) != std::string_view::npos) return age;
+  return npos;
+}
+
+/*************************
+ * history::default_path *
+ *************************/
+
+std::string history::default_path() {
+  /* The history goes in $XDG_STATE_HOME/lchat/history, which defaults to
+   * ~/.local/state. Any missing directories are made along the way.
+   */
+  std::string path;
+
+  const char *state = std::getenv("XDG_STATE_HOME");
+  if (state and state[0] == '/') {
+    path = state;
+  } else {
+    const char *home = std::getenv("HOME");
+    if (not home or home[0] != '/') return std::string();
+    path = std::string(home) + "/.local/state";
+  }
+  path += "/lchat";
+
+  for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+    if (mkdir(path.substr(0, pos).c_str(), 0700) < 0 and errno != EEXIST)
+      return std::string();
+    if (pos == path.npos) break;
+  }
+
+  return path + "/history";
+}
+
+/******************
+ * history::index *
+ ******************/
+
+bool history::index() {
+  // Find the next entry back from what has been searched so far.
+  while (_unread > 0) {
+    size_t end = _unread;
+    if (_map[end - 1] == '\n') end--;
+
+    const auto nl = std::string_view(_map, end).rfind('\n');
+    const size_t start = (nl == std::string_view::npos ? 0 : nl + 1);
+
+    _unread = start;
+    if (end > start) {
+      _spans.push_back({start, end});
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*****************
+ * history::trim *
+ *****************/
+
+void history::trim(const std::string &path) {
+  /* Only the newest keep_size bytes of a file grown past max_size are kept,
+   * starting from the first whole entry. They're written to a new file that
+   * then replaces the old one.
+   */
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 and (size_t)st.st_size > keep_size)
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) return;
+
+  const std::string_view text(static_cast<const char *>(map), st.st_size);
+  const auto nl = text.find('\n', text.size() - keep_size);
+
+  if (nl != text.npos) {
+    const std::string temp = path + ".new";
+    const auto keep = text.substr(nl + 1);
+
+    fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      size_t done = 0;
+      while (done < keep.size()) {
+        const auto result = ::write(fd, keep.data() + done,
+                                    keep.size() - done);
+        if (result < 0 and errno == EINTR) continue;
+        if (result <= 0) break;
+        done += result;
+      }
+
+      if (::close(fd) == 0 and done == keep.size())
+        rename(temp.c_str(), path.c_str());
+      else
+        unlink(temp.c_str());
+    }
+  }
+
+  munmap(map, st.st_size);
+}
@@ -0,0 +1,102 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _LCHAT_HISTORY_H
+#define _LCHAT_HISTORY_H
+
+/** The input history, kept in a file between sessions.
+ *
+ *  The file holds one entry per line and is mapped into memory when it's
+ * opened. Nothing is parsed up front, the entries are found by walking back
+ * from the end of the file only as far as they are asked for, so a large
+ * history costs nothing to open. Entries added during the session are
+ * appended to the file as they are made.
+ */
+class history {
+public:
+  history();
+  history(const history &other) = delete;
+  virtual ~history() noexcept;
+
+  history &operator=(const history &other) = delete;
+
+  void open(const std::string &path);
+  void close();
+
+  bool add(std::string_view line);
+
+  /** Whether there is an entry age entries back, 0 is the newest entry. */
+  bool has(size_t age);
+
+  /** An entry by how far back it is, 0 is the newest entry. The view is
+   * only good until the history is closed.
+   */
+  std::string_view operator[](size_t age);
+
+  /** Search back for an entry containing the text, starting at the entry
+   * from. Returns the age of the entry found or npos.
+   */
+  size_t find(std::string_view text, size_t from = 0);
+
+  static std::string default_path();
+
+  static const size_t npos = static_cast<size_t>(-1);
+
+  static const size_t max_size = 4 << 20;  // Largest file kept on open.
+  static const size_t keep_size = 2 << 20; // How much of it is kept.
+
+private:
+  struct span {
+    size_t start; // Offset of the entry in the file.
+    size_t end;   // Offset of the newline ending it.
+  };
+
+  int _fd;
+
+  const char *_map;  // The file as it was when opened.
+  size_t _map_size;
+
+  std::vector<span> _spans; // Entries found so far, newest first.
+  size_t _unread;           // Bytes at the start of the map not searched.
+
+  std::vector<std::string> _added; // Entries added since opening.
+
+  bool index();
+  void trim(const std::string &path);
+};
+
+#endif /* _LCHAT_HISTORY_H */
@@ -38,20 +38,33 @@
 #include "nstream"
 #include "curses"
 #include "autocomplete.h"
+#include "bothost.h"
+#include "gapbuffer.h"
+#include "history.h"
+#include "scrollback.h"
+#include "wrap.h"
+#ifdef HAVE_SHMRING
+#include "shmring.h"
+#endif // HAVE_SHMRING
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <list>
+#include <random>
+#include <set>
 #include <cctype>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <climits>
+#include <cwctype>
+#include <chrono>
 #include <clocale>
-#include <mutex>
 #include <pwd.h>
-#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/wait.h>
 #include <getopt.h>
 
 #ifdef DEBUG
@@ -81,10 +94,20 @@ namespace {
   std::string sock_path = STATEDIR "/sock";
   std::string my_name;
 
+  // How long a one shot message waits for the server to confirm it.
+  std::chrono::milliseconds ack_wait(5000);
+
   curs::cchar bgstatus(C_STATUS, U' ');
 
-  // Mutex to synchronize all curses drawing operations.
-  std::mutex curs_mtx;
+  // The shortest time between two screen updates, about 60 frames a second.
+  const std::chrono::milliseconds frame_time(16);
+
+  // How many of the latest history entries are used to complete with.
+  const size_t history_completions = 100;
+
+  // Limits to how long to wait between attempts to reconnect to the server.
+  const std::chrono::milliseconds min_backoff(500);
+  const std::chrono::milliseconds max_backoff(30000);
 
   autocomplete completion;
 
@@ -100,31 +123,94 @@ namespace {
     typedef enum {SCROLL_UP, SCROLL_DOWN, PAGE_UP, PAGE_DOWN} scroll_t;
 
     chat(lchat &chatw, int x, int y, int width, int height);
+    virtual ~chat() noexcept override;
 
     void scroll(scroll_t value);
-    static void thread_loop(chat *obj);
+    void start();
+    bool reconnect();
+    void send(const std::string &line);
+    void receive();
     void redraw();
+    void invalidate() { _full = true; }
+    bool dirty() const { return _full or _pending > 0; }
     bool connected() const { return _connected; }
+    void quit() { _quitting = true; }
+    bool quitting() const { return _quitting; }
+
+    uint64_t find(const std::string &text, uint64_t before = npos) const;
+    void show(uint64_t id);
+    void scroll_bottom();
+    void highlight(const std::string &text);
 
     static bool auto_scroll;
+    static bool compress;
     static unsigned int scrollback;
 
+    static const uint64_t npos = UINT64_MAX;
+
     friend class status;
 
   protected:
 
-    void read_server();
-
-    void draw(const std::string &line);
+    void draw(size_t index, size_t first = 0, size_t last = SIZE_MAX);
+    void draw(std::string_view line, uint32_t tag, size_t from, size_t to);
+    void draw(std::string_view line, size_t start, size_t end, int attr);
 
   private:
     lchat *_lchat; // Reference to the chat interface.
 
-    std::list<std::string> _scroll_buffer; // Scrollback buffer.
-    unsigned int _buffer_size;             // Scrollback buffer size.
-    unsigned int _buffer_location;         // Scrollback buffer location.
+    ::scrollback _scroll_buffer;   // Scrollback buffer.
+    unsigned int _buffer_location; // Scrollback buffer location.
+    unsigned int _row_offset;      // Rows of that line below the window.
+    wrap_cache _wraps;             // Where the lines wrap.
+
+    bool _full;            // The whole window needs to be redrawn.
+    unsigned int _pending; // New lines not drawn yet.
+
+    std::string _partial; // Start of a line still being received.
+    std::string _highlight; // Text marked wherever it's shown.
 
     bool _connected;
+    bool _quitting; // Asked the server to let us go.
+
+    /* The session lets us pick up where we left off, with only the lines
+     * numbered after _seq sent to us again.
+     */
+    std::string _token;
+    uint64_t _seq;
+    bool _skip_help; // Skip the help for a command older servers lack.
+    std::vector<std::string> _outbox; // Waiting for the connection.
+
+#ifdef HAVE_SHMRING
+    /* The lines for everyone may be read from shared memory the server
+     * writes them to, rather than being sent to us.
+     */
+    shmring *_ring;
+    uint64_t _ring_seq; // The last line read from the ring.
+
+    void take_ring(const std::string &position);
+    void read_ring();
+    void drop_ring();
+#endif // HAVE_SHMRING
+
+    void add(const std::string &line);
+    void post(const std::string &line);
+    void drain();
+    void lost();
+
+    const std::vector<uint32_t> &rows(size_t index);
+    int rows_shown(int limit);
+    void scroll_up(int count);
+    void scroll_down(int count);
+
+    std::string_view text(size_t index) const;
+
+    /* Lines are sorted out as they arrive and tagged with their kind in the
+     * low byte and where the sender's name ends, in the text shown, above
+     * it.
+     */
+    typedef enum {K_SYSTEM, K_MESSAGE, K_MINE, K_PRIVATE, K_HELP} kind_t;
+    static uint32_t classify(std::string_view line);
   };
 
   class userlist : public curs::window {
@@ -134,12 +220,15 @@ namespace {
     void update(const std::string &list);
 
     void redraw();
+    void invalidate() { _dirty = true; }
+    bool dirty() const { return _dirty; }
 
     friend class status;
 
   private:
+    bool _dirty;
+
     std::list<std::string> _users;
-    std::list<std::string> _autocomp;
   };
 
   class status : public curs::window {
@@ -147,8 +236,12 @@ namespace {
     status(chat &ch, userlist &ul, int x, int y, int width, int height);
 
     void redraw();
+    void invalidate() { _dirty = true; }
+    bool dirty() const { return _dirty; }
 
   private:
+    bool _dirty;
+
     chat *_chat; // Reference to the chat window.
     userlist *_userlist; // Reference to the user list window.
   };
@@ -158,22 +251,45 @@ namespace {
     input(lchat &chat, int x, int y, int width, int height);
 
     void redraw();
+    void invalidate() { _dirty = true; }
+    bool dirty() const { return _dirty; }
 
   protected:
     virtual void key_event(int ch) override;
+    virtual void char_event(wint_t ch) override;
 
   private:
     lchat *_lchat; // Reference to the chat interface.
 
-    std::string _line; // Input string.
-    size_t _insert; // Cursor location.
+    bool _dirty;
+
+    gapbuffer _line; // Input line, the cursor is in the line.
+    size_t _view; // First character of the line on the screen.
 
     std::string _suggest;
+    autocomplete::search _search; // Follows the line as it's typed.
 
     // Message history support.
-    std::list<std::string> _history;
+    ::history _history;
     bool _history_scan;
-    std::list<std::string>::iterator _history_iter;
+    size_t _history_at; // Entries back while scanning, 0 is a new line.
+
+    // Reverse history search.
+    bool _history_search;
+    std::string _query;
+    size_t _found; // Age of the entry found or history::npos.
+
+    // Scrollback search, sharing the query.
+    bool _chat_search;
+    uint64_t _match; // Id of the chat line found or chat::npos.
+
+    uint64_t find(uint64_t before);
+
+    typedef enum {C_NONE, C_PUSHED, C_POPPED, C_CHANGED} change_t;
+
+    void typed(wchar_t ch);
+    void suggest(change_t change, wchar_t ch = L'\0');
+    int draw_line();
   };
 
   class lchat : protected curs::window, protected curs::resize_event_handler {
@@ -191,6 +307,8 @@ namespace {
     void operator()();
 
     void update();
+    void render();
+    void retry_later();
 
     friend class input;
 
@@ -206,6 +324,14 @@ namespace {
 
     status _status;
 
+    bool _dirty; // The frame around the windows needs to be redrawn.
+    std::chrono::steady_clock::time_point _next_frame;
+
+    // When to try the server again, waiting longer after each failure.
+    std::chrono::steady_clock::time_point _retry;
+    std::chrono::milliseconds _backoff;
+
+    bool dirty() const;
     void _draw();
   };
 
@@ -227,6 +353,7 @@ namespace {
    */
 
   bool chat::auto_scroll = false;
+  bool chat::compress = false;
   unsigned int chat::scrollback = 500;
   static bool insert_mode = true;
 
@@ -237,14 +364,35 @@ namespace {
   chat::chat(lchat &chatw, int x, int y, int width, int height)
     : curs::window(x, y, width, height),
       _lchat(&chatw),
-      _buffer_size(scrollback),
-      _buffer_location(0), _connected(true) {
-
-    *this << curs::scrollok(true)
+      _scroll_buffer(scrollback),
+      _buffer_location(0), _row_offset(0), _wraps(scrollback),
+      _full(true), _pending(0), _connected(true), _quitting(false),
+      _seq(0), _skip_help(false)
+#ifdef HAVE_SHMRING
+    , _ring(nullptr), _ring_seq(0)
+#endif // HAVE_SHMRING
+  {
+
+    /* New lines are written at the bottom of the window and scroll the rest
+     * up, idlok lets curses use the terminal's own scrolling to do it.
+     */
+    *this << curs::batch(true)
+          << curs::scrollok(true)
+          << curs::idlok(true)
           << curs::cursor(0, height - 1)
           << std::flush;
   }
 
+  /***************
+   * chat::~chat *
+   ***************/
+
+  chat::~chat() noexcept {
+#ifdef HAVE_SHMRING
+    drop_ring();
+#endif // HAVE_SHMRING
+  }
+
   /****************
    * chat::scroll *
    ****************/
@@ -253,7 +401,7 @@ namespace {
     // Get the chat window size.
     const auto h = height();
 
-    // Set offset to the amount to shift the window by.
+    // Set offset to the number of rows to shift the window by.
     int offset = 0;
     switch (value) {
     case SCROLL_UP:
@@ -270,92 +418,538 @@ namespace {
       break;
     }
 
-    // Adjust the buffer location if it goes beyond the window or buffer sizes.
-    if ((int)_buffer_location + offset < 0) {
-      _buffer_location = 0;
-    } else {
-      _buffer_location += offset;
+    const auto location = _buffer_location;
+    const auto row_offset = _row_offset;
 
-      if (_buffer_location > _scroll_buffer.size())
-        _buffer_location = _scroll_buffer.size();
+    if (offset > 0) {
+      scroll_up(offset);
 
-      if (h > (int)_scroll_buffer.size())
-        _buffer_location = 0;
+      // Don't leave empty rows above the oldest line.
+      const int shown = rows_shown(h);
+      if (shown < h) scroll_down(h - shown);
+    } else {
+      scroll_down(-offset);
     }
 
-    // Redraw the chat window.
-    redraw();
+    // Redraw the chat window, if the view has actually moved.
+    if (_buffer_location != location or _row_offset != row_offset) {
+      invalidate();
+      _lchat->update_status();
+    }
   }
 
-  /*********************
-   * chat::thread_loop *
-   *********************/
+  /**************
+   * chat::find *
+   **************/
+
+  uint64_t chat::find(const std::string &text, uint64_t before) const {
+    /* Lines are found by their id, the scrollback index plus the lines
+     * evicted before it, so they stay put as new lines come in.
+     */
+    const uint64_t first = _scroll_buffer.first();
+    if (before <= first) return npos;
+
+    const size_t found = _scroll_buffer.find(
+      text, std::min<uint64_t>(before - first, _scroll_buffer.size()));
+    return (found == ::scrollback::npos ? npos : first + found);
+  }
+
+  /**************
+   * chat::show *
+   **************/
+
+  void chat::show(uint64_t id) {
+    // Scroll the line to the middle of the window.
+    const uint64_t first = _scroll_buffer.first();
+    if (id < first or id - first >= _scroll_buffer.size()) return;
+
+    const auto h = height();
+    _buffer_location = _scroll_buffer.size() - 1 - (id - first);
+    _row_offset = 0;
+    scroll_down(h / 2);
+
+    const int shown = rows_shown(h);
+    if (shown < h) scroll_down(h - shown);
+
+    invalidate();
+    _lchat->update_status();
+  }
+
+  /***********************
+   * chat::scroll_bottom *
+   ***********************/
+
+  void chat::scroll_bottom() {
+    if (_buffer_location == 0 and _row_offset == 0) return;
+
+    _buffer_location = 0;
+    _row_offset = 0;
+    invalidate();
+    _lchat->update_status();
+  }
+
+  /*******************
+   * chat::highlight *
+   *******************/
+
+  void chat::highlight(const std::string &text) {
+    if (text == _highlight) return;
+    _highlight = text;
+    invalidate();
+  }
+
+  /*******************
+   * chat::scroll_up *
+   *******************/
 
-  void chat::thread_loop(chat *obj) {
-    obj->read_server();
+  void chat::scroll_up(int count) {
+    /* The bottom of the window is _row_offset rows up from the end of the
+     * line _buffer_location lines from the newest, move it up count rows.
+     */
+    const size_t size = _scroll_buffer.size();
+
+    while (count > 0 and _buffer_location < size) {
+      const size_t index = size - 1 - _buffer_location;
+      const size_t line_rows = rows(index).size();
+
+      if (_row_offset + 1 < line_rows) {
+        const auto step = std::min<size_t>(count, line_rows - 1 - _row_offset);
+        _row_offset += step;
+        count -= step;
+      } else if (index > 0) {
+        _buffer_location++;
+        _row_offset = 0;
+        count--;
+      } else {
+        break;
+      }
+    }
   }
 
   /*********************
-   * chat::read_server *
+   * chat::scroll_down *
    *********************/
 
-  void chat::read_server() {
-    std::string line;
-    while (chatio) {
-      // Attempt to read a line from the server.
-      getline(chatio, line);
-      if (line.empty()) {
-        continue; // Nothing returned so return.
+  void chat::scroll_down(int count) {
+    const size_t size = _scroll_buffer.size();
+
+    while (count > 0) {
+      if (_row_offset > 0) {
+        const auto step = std::min<unsigned int>(count, _row_offset);
+        _row_offset -= step;
+        count -= step;
+      } else if (_buffer_location > 0) {
+        _buffer_location--;
+        _row_offset = rows(size - 1 - _buffer_location).size() - 1;
+        count--;
+      } else {
+        break;
       }
+    }
+  }
+
+  /********************
+   * chat::rows_shown *
+   ********************/
+
+  int chat::rows_shown(int limit) {
+    // Count the rows from the bottom of the window up, to at most limit.
+    const size_t size = _scroll_buffer.size();
+    if (_buffer_location >= size) return 0;
+
+    size_t index = size - 1 - _buffer_location;
+    int shown = rows(index).size() - _row_offset;
+    while (shown < limit and index > 0)
+      shown += rows(--index).size();
+
+    return std::min(shown, limit);
+  }
+
+  /**************
+   * chat::rows *
+   **************/
+
+  const std::vector<uint32_t> &chat::rows(size_t index) {
+    /* Lines are wrapped one column short of the window. Writing a full row
+     * makes curses wrap the cursor, and at the bottom that scrolls in a
+     * blank row, so every row is instead started with an explicit newline.
+     */
+    return _wraps.rows(_scroll_buffer.first() + index, text(index),
+                       width() - 1);
+  }
+
+  /**************
+   * chat::text *
+   **************/
+
+  std::string_view chat::text(size_t index) const {
+    // The text shown for a line, help and private messages lose their tag.
+    const auto line = _scroll_buffer[index];
+    const auto kind = _scroll_buffer.tag(index) & 0xff;
+    if (kind == K_HELP or kind == K_PRIVATE) return line.substr(2);
+    return line;
+  }
+
+  /******************
+   * chat::classify *
+   ******************/
+
+  uint32_t chat::classify(std::string_view line) {
+    const auto pos = line.find(": ");
+    uint32_t kind, name;
+
+    if (line.compare(0, 2, "? ") == 0) {
+      // Help message.
+      kind = K_HELP;
+      name = 0;
+
+    } else if (line.compare(0, 2, "! ") == 0) {
+      // Private message, the name is counted without the tag.
+      kind = K_PRIVATE;
+      name = (pos != line.npos ? pos - 1 : line.size() - 2);
+
+    } else if (line.size() > my_name.size() and
+               line.compare(0, my_name.size(), my_name) == 0 and
+               line[my_name.size()] == ':') {
+      // A message that was sent by this user.
+      kind = K_MINE;
+      name = (pos != line.npos ? pos + 1 : 0);
+
+    } else if (pos != line.npos) {
+      kind = K_MESSAGE;
+      name = pos + 1;
+
+    } else {
+      // System message.
+      kind = K_SYSTEM;
+      name = 0;
+    }
+
+    // Names too long to keep just aren't colored.
+    if (name > 0xffffff) name = 0;
+    return kind | (name << 8);
+  }
+
+  /***************
+   * chat::start *
+   ***************/
+
+  void chat::start() {
+    /* Start reading from the server. Our session is resumed if we have
+     * one, then whatever was typed while we were away is sent.
+     */
+    curs::events::watch(chatio.socket(), [this]() { receive(); });
+
+    if (_token.empty()) send("/session");
+    else send("/resume " + _token + ' ' + std::to_string(_seq));
+    if (compress) send("/compress lz");
+#ifdef HAVE_SHMRING
+    send("/ring");
+#endif // HAVE_SHMRING
+    send("/who");
+
+    std::vector<std::string> waiting;
+    waiting.swap(_outbox);
+    for (auto &line: waiting) send(line);
+  }
+
+  /*******************
+   * chat::reconnect *
+   *******************/
+
+  bool chat::reconnect() {
+    // Try to get back to the server, false if it isn't there yet.
+    try {
+      chatio.close();
+      chatio.clear();
+      chatio.open(sock_path);
+      chatio >> sockets::nonblock;
+    } catch (sockets::exception &err) {
+#ifdef DEBUG
+      debug << "Reconnect failed: " << err.what() << std::endl;
+#endif // DEBUG
+      return false;
+    }
+
+    _connected = true;
+    add("Reconnected to the chat server.");
+    start();
+    return true;
+  }
+
+  /**************
+   * chat::send *
+   **************/
+
+  void chat::send(const std::string &line) {
+    /* Lines are held while there's no server, a line the server didn't
+     * take is sent again once we're back.
+     */
+    if (not _connected) {
+      _outbox.push_back(line);
+      return;
+    }
+
+    try {
+      chatio << line << std::endl;
+    } catch (std::exception &err) {
+      // The hangup will be seen when the socket is read.
+      chatio.clear();
+      _outbox.push_back(line);
+    }
+
+    // Whatever the socket couldn't take yet goes out once it can.
+    if (chatio.queued())
+      curs::events::watch_output(chatio.socket(), [this]() { drain(); });
+  }
 
-      if (line.compare(0, 2, "~ ") == 0) {
-        // User list update
-        _lchat->refresh_users(line.substr(2, line.length() - 2));
-        continue;
+  /***************
+   * chat::drain *
+   ***************/
+
+  void chat::drain() {
+    /* Send more of the output waiting on the socket. If it failed the
+     * hangup will be seen when the socket is read.
+     */
+    if (not chatio.drain() or not chatio.queued())
+      curs::events::unwatch_output(chatio.socket());
+  }
+
+  /*************
+   * chat::add *
+   *************/
+
+  void chat::add(const std::string &line) {
+    // Add the new line to the scroll buffer.
+    _scroll_buffer.push(line, classify(line));
+
+    // Handle message scrolling in the chat window.
+    if (_buffer_location == 0) {
+      // At the bottom of the buffer, just scroll the new line in.
+      _pending++;
+    } else if (auto_scroll) {
+      // If auto scroll the reposition buffer to the new line.
+      _buffer_location = 0;
+      _row_offset = 0;
+      invalidate();
+    } else {
+      /* Keep the view on the same lines. They haven't moved on the
+       * screen so only the status needs updating.
+       */
+      if (_buffer_location < _scroll_buffer.size()) _buffer_location++;
+    }
+    _lchat->update_status();
+  }
+
+  /**************
+   * chat::post *
+   **************/
+
+  void chat::post(const std::string &line) {
+    // A chat line to show, the users are listed again when they change.
+    if (line.length() > 21) {
+      if (line.compare(line.length() - 21, 21,
+                       " has joined the chat.") == 0) {
+        send("/who");
+      }
+    }
+    if (line.length() > 19) {
+      if (line.compare(line.length() - 19, 19,
+                       " has left the chat.") == 0) {
+        send("/who");
       }
+    }
+
+    add(line);
+  }
+
+#ifdef HAVE_SHMRING
+  /*******************
+   * chat::take_ring *
+   *******************/
+
+  void chat::take_ring(const std::string &position) {
+    /* The server passed us the ring it writes the chat to along with where
+     * it was up to. Whatever's left in the one we had is read first.
+     */
+    const int fd = chatio.take_fd();
+    read_ring();
+    drop_ring();
+    if (fd < 0) return;
+    _ring_seq = _seq;
+
+    try {
+      _ring = new shmring(fd, std::strtoull(position.c_str(), nullptr, 10));
+      curs::events::watch(_ring->watch(), [this]() { read_ring(); });
+    } catch (std::exception &err) {
+      delete _ring;
+      _ring = nullptr;
+      add(std::string("Unable to read the chat from shared memory: ") +
+          err.what());
+      send("/ring off");
+    }
+  }
+
+  /*******************
+   * chat::read_ring *
+   *******************/
 
-      // User join message.
-      if (line.length() > 21) {
-        if (line.compare(line.length() - 21, 21,
-                         " has joined the chat.") == 0) {
-          chatio << "/who" << std::endl;
+  void chat::read_ring() {
+    if (_ring == nullptr) return;
+    _ring->clear();
+
+    uint64_t seq;
+    std::string line;
+    for (;;) {
+      switch (_ring->next(seq, line)) {
+      case shmring::EMPTY:
+        return;
+
+      case shmring::LOST:
+        // Ask the server for the lines we missed.
+        if (seq > _ring_seq) {
+          send("/replay " + std::to_string(_ring_seq + 1) + ' ' +
+               std::to_string(seq));
+          _ring_seq = seq;
         }
+        break;
+
+      case shmring::LINE:
+        // Skip the lines we asked for again.
+        if (seq <= _ring_seq) break;
+        _ring_seq = seq;
+        _seq = std::max(_seq, seq);
+        post(line);
+        break;
       }
+    }
+  }
+
+  /*******************
+   * chat::drop_ring *
+   *******************/
+
+  void chat::drop_ring() {
+    if (_ring == nullptr) return;
+
+    curs::events::unwatch(_ring->watch());
+    delete _ring;
+    _ring = nullptr;
+  }
+#endif // HAVE_SHMRING
+
+  /**************
+   * chat::lost *
+   **************/
+
+  void chat::lost() {
+    // The server has gone, keep everything as it is until it's back.
+#ifdef HAVE_SHMRING
+    drop_ring();
+#endif // HAVE_SHMRING
+    curs::events::unwatch(chatio.socket());
+    curs::events::unwatch_output(chatio.socket());
+    chatio.close();
+    chatio.clear();
+    _partial.clear();
+    _connected = false;
+
+    if (not _quitting) {
+      add("Lost the connection to the chat server, reconnecting.");
+      _lchat->retry_later();
+    }
+  }
+
+  /*****************
+   * chat::receive *
+   *****************/
 
-      // User left message.
-      if (line.length() > 19) {
-        if (line.compare(line.length() - 19, 19,
-                         " has left the chat.") == 0) {
-          chatio << "/who" << std::endl;
+  void chat::receive() {
+    /* Called whenever the server socket is readable. Every complete line
+     * that has arrived is taken before returning, so a burst of lines is
+     * drawn as a single frame.
+     */
+    std::string line;
+    try {
+      while (getline(chatio, line)) {
+        if (not _partial.empty()) {
+          line.insert(0, _partial);
+          _partial.clear();
+        }
+        if (line.empty()) {
+          continue; // Nothing returned so return.
         }
-      }
 
-      // Add the new line to the scroll buffer.
-      _scroll_buffer.push_front(line);
-      while (_scroll_buffer.size() > _buffer_size) {
-        _scroll_buffer.pop_back();
-      }
+        if (line[0] == '#' and not _token.empty()) {
+          /* A numbered line, remember how far we've got. Lines asked for
+           * again with /replay don't take us back.
+           */
+          const auto pos = line.find(' ');
+          if (pos != line.npos) {
+            _seq = std::max<uint64_t>(
+              _seq, std::strtoull(line.c_str() + 1, nullptr, 10));
+            line.erase(0, pos + 1);
+          }
+
+        } else if (line.compare(0, 2, "% ") == 0) {
+          // Our session, the number is where the server is up to.
+          std::istringstream session(line.substr(2));
+          session >> _token >> _seq;
+          continue;
+
+        } else if (line == "? Unknown chat command '/session'" or
+                   line == "? Unknown chat command '/compress lz'") {
+          // Older servers don't have these, skip the help after this too.
+          _skip_help = true;
+          continue;
+
+        } else if (line.compare(0, 2, "$ ") == 0) {
+          // How bulk transfers are packed, they're unpacked as they arrive.
+          continue;
+
+#ifdef HAVE_SHMRING
+        } else if (line.compare(0, 2, "& ") == 0) {
+          // Shared memory to read the chat from.
+          take_ring(line.substr(2));
+          continue;
+
+        } else if (line == "? Unknown chat command '/ring'") {
+          // Older servers don't share their memory, skip the help too.
+          _skip_help = true;
+          continue;
+
+        } else if (line == "? Shared memory is not enabled on this server.") {
+          // Nor is it any more if we were handed to another server.
+          read_ring();
+          drop_ring();
+          continue;
+#endif // HAVE_SHMRING
+
+        } else if (_skip_help) {
+          _skip_help = false;
+          if (line.compare(0, 9, "? Type '/") == 0) continue;
+        }
 
-      // Handle message scrolling in the chat window.
-      if (auto_scroll) {
-        // If auto scroll the reposition buffer to the new line.
-        _buffer_location = 0;
-        redraw();
-      } else if (_buffer_location > 0) {
-        // Update the screen.
-        scroll(SCROLL_UP);
-      } else
-        redraw();
+        if (line.compare(0, 2, "~ ") == 0) {
+          // User list update
+          _lchat->refresh_users(line.substr(2, line.length() - 2));
+          continue;
+        }
 
-      if (not chatio and not chatio.eof()) {
-        chatio.clear();
+        post(line);
       }
+
+    } catch (sockets::ionotready &err) {
+      // Nothing more from the server for now, keep what we've got.
+      _partial += line;
+      chatio.clear();
+      return;
     }
 
 #ifdef DEBUG
     debug << "Server closed the connection" << std::endl;
 #endif // DEBUG
-    _connected = false;
+    lost();
   }
 
   /****************
@@ -363,99 +957,129 @@ namespace {
    ****************/
 
   void chat::redraw() {
-    //const auto w = width();
     const auto h = height();
+    const size_t size = _scroll_buffer.size();
 
-    curs_mtx.lock();
-
-    // Clear the chat window.
-    *this << curs::erase << curs::cursor(0, h - 1) << curs::cursor(false);
+    if (not _full and _pending < (unsigned int)h) {
+      /* The cursor is left at the end of the last line drawn, so drawing
+       * the new lines scrolls the window up and only they are painted.
+       */
+      for (size_t c = size - std::min<size_t>(_pending, size); c < size; c++)
+        this->draw(c);
 
-    if (not _scroll_buffer.empty()) {
-      auto it = _scroll_buffer.crend();
-
-      // Find the starting point.
-      for (int c = 0;
-           c < h + (int)_buffer_location and it != _scroll_buffer.crbegin();
-           c++, it--) {
-        /*const std::string &line = *it;
-        auto len = line.length();
-        if (line.compare(0, 2, "? ") == 0 or line.compare(0, 2, "! ") == 0)
-          len -= 2;
-          c += (len / w) + (len % w ? 1 : 0) - 1;*/
-      }
-
-      // Draw the lines.
-      for (int c = 0; c < h and it != _scroll_buffer.crend(); c++, it++) {
-        this->draw(*it);
+    } else {
+      // Clear the chat window.
+      *this << curs::erase << curs::cursor(0, h - 1) << curs::cursor(false);
+
+      if (_buffer_location < size) {
+        // The line at the bottom of the window and its rows that are shown.
+        const size_t last = size - 1 - _buffer_location;
+        const auto &last_rows = rows(last);
+        if (_row_offset >= last_rows.size())
+          _row_offset = last_rows.size() - 1;
+        const size_t end = last_rows.size() - _row_offset;
+
+        // Walk back until the window is full, the top line may be cut.
+        size_t first = last;
+        int need = h;
+        int avail = end;
+        while (avail < need and first > 0) {
+          need -= avail;
+          avail = rows(--first).size();
+        }
+        const size_t skip = (avail > need ? avail - need : 0);
 
-        /*const std::string &line = *it;
-        auto len = line.length();
-        if (line.compare(0, 2, "? ") == 0 or line.compare(0, 2, "! ") == 0)
-          len -= 2;
-          c += (len / w) + (len % w ? 1 : 0) - 1;*/
+        for (size_t c = first; c <= last; c++)
+          this->draw(c, (c == first ? skip : 0), (c == last ? end : SIZE_MAX));
       }
     }
 
     *this << std::flush;
 
-    curs::terminal::update();
-    curs_mtx.unlock();
-
-    _lchat->update();
+    _full = false;
+    _pending = 0;
   }
 
   /**************
    * chat::draw *
    **************/
 
-  void chat::draw(const std::string &line) {
-    /* This just adds visual formatting to the lines.
+  void chat::draw(size_t index, size_t first, size_t last) {
+    // Draw the rows first up to last of a line, each on a new row.
+    const auto line = text(index);
+    const auto tag = _scroll_buffer.tag(index);
+    const auto &starts = rows(index);
+
+    last = std::min(last, starts.size());
+    for (size_t row = first; row < last; row++)
+      this->draw(line, tag, starts[row],
+                 (row + 1 < starts.size() ? starts[row + 1]
+                                          : std::string_view::npos));
+  }
+
+  void chat::draw(std::string_view line, uint32_t tag, size_t from,
+                  size_t to) {
+    /* This just adds visual formatting to the lines. The line was sorted
+     * into the sender's name and the message when it arrived, so only the
+     * part of each shown from the offset from up to to is written.
      */
-    const auto pos = line.find(": ");
+    const size_t name = std::min<size_t>(tag >> 8, line.size());
+    int name_attr = 0, body_attr = 0;
 
-    if (line.compare(0, 2, "? ") == 0) {
-      // Help message.
-      *this << '\n'
-            << curs::attron(curs::colors::pair(C_HLPMSG) | A_BOLD)
-            << line.substr(2, line.length() - 2)
-            << curs::attroff(curs::colors::pair(C_HLPMSG) | A_BOLD);
+    switch (tag & 0xff) {
+    case K_HELP:
+      body_attr = curs::colors::pair(C_HLPMSG) | A_BOLD;
+      break;
+    case K_PRIVATE:
+      name_attr = curs::colors::pair(C_USERNAME);
+      body_attr = curs::colors::pair(C_PRVMSG) | A_BOLD;
+      break;
+    case K_MINE:
+      name_attr = curs::colors::pair(C_USERNAME);
+      body_attr = curs::colors::pair(C_MYMESSAGE);
+      break;
+    case K_MESSAGE:
+      name_attr = curs::colors::pair(C_USERNAME);
+      break;
+    default:
+      body_attr = curs::colors::pair(C_SYSMSG);
+    }
 
-    } else if (line.compare(0, 2, "! ") == 0) {
-      // Private message.
-      *this << '\n'
-            << curs::attron(curs::colors::pair(C_USERNAME))
-            << line.substr(2, pos - 1)
-            << curs::attroff(curs::colors::pair(C_USERNAME))
-            << curs::attron(curs::colors::pair(C_PRVMSG) | A_BOLD)
-            << line.substr(pos + 1, line.length() - pos - 1)
-            << curs::attroff(curs::colors::pair(C_PRVMSG) | A_BOLD);
-
-    } else if (line.compare(0, my_name.length() + 1, my_name + ":") == 0) {
-      // A message that was sent by this user.
-      *this << '\n'
-            << curs::attron(curs::colors::pair(C_USERNAME))
-            << line.substr(0, pos + 1)
-            << curs::attroff(curs::colors::pair(C_USERNAME))
-            << curs::attron(curs::colors::pair(C_MYMESSAGE))
-            << line.substr(pos + 1, line.length() - pos)
-            << curs::attroff(curs::colors::pair(C_MYMESSAGE));
+    to = std::min(to, line.size());
 
-    } else if (pos != line.npos) {
-      // Color the senders name.
-      *this << '\n'
-            << curs::attron(curs::colors::pair(C_USERNAME))
-            << line.substr(0, pos + 1)
-            << curs::attroff(curs::colors::pair(C_USERNAME))
-            << line.substr(pos + 1, line.length() - pos);
+    *this << '\n';
+    this->draw(line, from, std::min(name, to), name_attr);
+    this->draw(line, std::max(name, from), to, body_attr);
+  }
 
-    } else {
-      // System message.
-      *this << '\n'
-            << curs::attron(curs::colors::pair(C_SYSMSG))
-            << line
-            << curs::attroff(curs::colors::pair(C_SYSMSG));
+  void chat::draw(std::string_view line, size_t start, size_t end, int attr) {
+    // Write the text from start to end, reversing any highlighted text.
+    auto put = [this, line, attr](size_t first, size_t last, int extra) {
+      if (first >= last) return;
+      const auto part = line.substr(first, last - first);
+      if (attr | extra)
+        *this << curs::attron(attr | extra) << part
+              << curs::attroff(attr | extra);
+      else
+        *this << part;
+    };
+
+    if (start >= end) return;
+
+    if (not _highlight.empty()) {
+      const size_t len = _highlight.size();
+      for (auto mark = line.find(_highlight, start >= len ? start - len + 1
+                                                          : 0);
+           mark < end; mark = line.find(_highlight, mark + len)) {
+        if (mark + len <= start) continue;
+        put(start, std::max(start, mark), 0);
+        start = std::max(start, mark);
+        put(start, std::min(end, mark + len), A_REVERSE);
+        start = std::min(end, mark + len);
+      }
     }
+
+    put(start, end, 0);
   }
 
   /****************************************************************************
@@ -467,8 +1091,8 @@ namespace {
    **********************/
 
   userlist::userlist(int x, int y, int width, int height)
-    : curs::window(x, y, width, height) {
-    completion.add(_autocomp);
+    : curs::window(x, y, width, height), _dirty(true) {
+    *this << curs::batch(true);
   }
 
   /********************
@@ -476,29 +1100,44 @@ namespace {
    ********************/
 
   void userlist::update(const std::string &list) {
-    // Clear the old user list.
-    _users.clear();
-    _autocomp.clear();
+    std::list<std::string> users;
 
 #ifdef DEBUG
     debug << "Parsing user list: " << list << std::endl;
 #endif
 
-    // Repopulate the user list with the servers response.
+    // Parse the new user list from the servers response.
     size_t last = 0, pos;
     while ((pos = list.find(" ", last)) != list.npos) {
       std::string user = list.substr(last, pos - last);
 #ifdef DEBUG
       debug << " " << last << ":" << pos << " " << user << std::endl;
 #endif
-      _users.push_back(user);
-      _autocomp.push_back("/msg " + user);
-      _autocomp.push_back("/priv " + user);
+      users.push_back(user);
       last = pos += 1;
     }
 
+    /* Only the users that came or went change the completions, so the ranks
+     * of everyone else are kept.
+     */
+    const std::set<std::string> before(_users.begin(), _users.end());
+    const std::set<std::string> after(users.begin(), users.end());
+
+    for (auto &user: before) {
+      if (after.count(user)) continue;
+      completion.remove("/msg " + user);
+      completion.remove("/priv " + user);
+    }
+    for (auto &user: after) {
+      if (before.count(user)) continue;
+      completion.add("/msg " + user);
+      completion.add("/priv " + user);
+    }
+
+    _users.swap(users);
+
     // Redraw the list.
-    redraw();
+    invalidate();
   }
 
   /********************
@@ -506,8 +1145,6 @@ namespace {
    ********************/
 
   void userlist::redraw() {
-    curs_mtx.lock();
-
     // Reset the window.
     *this << curs::erase << curs::cursor(0, 0) << curs::cursor(false);
 
@@ -523,9 +1160,7 @@ namespace {
 
     // Flush it to the screen.
     *this << std::flush;
-
-    curs::terminal::update();
-    curs_mtx.unlock();
+    _dirty = false;
   }
 
   /****************************************************************************
@@ -537,8 +1172,9 @@ namespace {
    ******************/
 
   status::status(chat &ch, userlist &ul, int x, int y, int width, int height)
-    : curs::window(x, y, width, height), _chat(&ch), _userlist(&ul) {
-    *this << curs::scrollok(false);
+    : curs::window(x, y, width, height), _dirty(true), _chat(&ch),
+      _userlist(&ul) {
+    *this << curs::batch(true) << curs::scrollok(false);
   }
 
   /******************
@@ -546,16 +1182,16 @@ namespace {
    ******************/
 
   void status::redraw() {
-    curs_mtx.lock();
-
     *this << curs::attron(curs::colors::pair(C_STATUS))
           << curs::bkgrnd(bgstatus)
           << curs::cursor(0, 0) << curs::erase;
 
     std::ostringstream msg;
 
-    // User count.
-    if (_userlist->_users.size() == 1)
+    // User count, or that we're waiting for the server.
+    if (not _chat->connected())
+      msg << "reconnecting";
+    else if (_userlist->_users.size() == 1)
       msg << _userlist->_users.size() << " user";
     else
       msg << _userlist->_users.size() << " users";
@@ -586,8 +1222,7 @@ namespace {
       *this << curs::cursor(width() - 2, 0) << "o";
 
     *this << std::flush;
-    curs::terminal::update();
-    curs_mtx.unlock();
+    _dirty = false;
   }
 
   /****************************************************************************
@@ -599,9 +1234,11 @@ namespace {
    ****************/
 
   input::input(lchat &chat, int x, int y, int width, int height)
-    : curs::window(x, y, width, height), _lchat(&chat), _line(), _insert(0),
-      _history_scan(false) {
-    *this << curs::leaveok(false);
+    : curs::window(x, y, width, height), _lchat(&chat), _dirty(true),
+      _line(), _view(0), _search(completion), _history_scan(false),
+      _history_at(0), _history_search(false), _found(history::npos),
+      _chat_search(false), _match(chat::npos) {
+    *this << curs::batch(true) << curs::leaveok(false);
 
     completion.add("/exit");
     completion.add("/quit");
@@ -610,7 +1247,12 @@ namespace {
     completion.add("/about");
     completion.add("/who");
 
-    completion.add(_history);
+    // The most recent history is used to complete with, oldest first.
+    _history.open(history::default_path());
+
+    size_t recent = 0;
+    while (recent < history_completions and _history.has(recent)) recent++;
+    while (recent-- > 0) completion.add(std::string(_history[recent]));
   }
 
   /*****************
@@ -618,28 +1260,50 @@ namespace {
    *****************/
 
   void input::redraw() {
-    curs_mtx.lock();
+    if (_chat_search) {
+      const auto prompt = (_match == chat::npos ? "(failed find)'"
+                                                 : "(find)'");
+      *this << curs::erase
+            << curs::cursor(0, 0) << prompt << _query << "'"
+            << curs::cursor(std::strlen(prompt) +
+                            gapbuffer::text_width(_query), 0)
+            << curs::cursor(true);
+
+    } else if (_history_search) {
+      const auto prompt = (_found == history::npos ? "(failed search)'"
+                                                    : "(search)'");
+      *this << curs::erase
+            << curs::cursor(0, 0) << prompt << _query << "': ";
+      if (_found != history::npos)
+        *this << curs::pairon(C_HISTORY) << _history[_found]
+              << curs::pairoff(C_HISTORY);
+      *this << curs::cursor(std::strlen(prompt) +
+                            gapbuffer::text_width(_query), 0)
+            << curs::cursor(true);
 
-    if (_history_scan) {
+    } else if (_history_scan) {
       *this << curs::erase
-            << curs::cursor(0, 0) << "? "
-            << curs::pairon(C_HISTORY) << _line
-            << curs::cursor(_insert + 2, 0) << curs::cursor(true)
+            << curs::cursor(0, 0) << "? " << curs::pairon(C_HISTORY);
+      const int column = draw_line();
+      *this << curs::cursor(column, 0) << curs::cursor(true)
             << curs::pairoff(C_HISTORY);
     } else {
       *this << curs::erase
             << curs::cursor(0, 0) << "> ";
 
-      if (not _suggest.empty())
-        *this << curs::pairon(C_HISTORY) << _suggest
+      const int column = draw_line();
+
+      // The suggestion only lines up with the line when it isn't scrolled.
+      if (not _suggest.empty() and _view == 0)
+        *this << curs::cursor(2 + _line.columns(), 0)
+              << curs::pairon(C_HISTORY)
+              << std::string_view(_suggest).substr(_line.bytes())
               << curs::pairoff(C_HISTORY);
 
-      *this << curs::cursor(2, 0) << _line;
-      *this << curs::cursor(_insert + 2, 0) << curs::cursor(true);
+      *this << curs::cursor(column, 0) << curs::cursor(true);
     }
 
-    curs::terminal::update();
-    curs_mtx.unlock();
+    _dirty = false;
   }
 
   /********************
@@ -648,56 +1312,152 @@ namespace {
 
 #define CTRL(c) ((c) & 0x1f)
 
+  // Drop the last whole character from multibyte text.
+  static void pop_char(std::string &text) {
+    while (not text.empty() and (text.back() & 0xc0) == 0x80) text.pop_back();
+    if (not text.empty()) text.pop_back();
+  }
+
   void input::key_event(int ch) {
-    if (_history_scan) {
+    if (_chat_search) {
+      // Searching back through the scrollback.
+      switch (ch) {
+      case ERR: // Keyboard input timeout
+        return;
+
+      case CTRL('o'): // The next older match.
+        if (_match != chat::npos) {
+          const auto older = find(_match);
+          if (older != chat::npos) _match = older;
+        }
+        break;
+
+      case KEY_BACKSPACE:
+      case '\b':
+      case '\x7f':
+        if (not _query.empty()) {
+          pop_char(_query);
+          _match = find(chat::npos);
+        }
+        break;
+
+      case CTRL('g'): // Go back to the newest lines.
+        _chat_search = false;
+        _lchat->_chat.highlight(std::string());
+        _lchat->_chat.scroll_bottom();
+        break;
+
+      case KEY_ENTER:
+      case '\n': // Stay where the search went.
+        _chat_search = false;
+        _lchat->_chat.highlight(std::string());
+        break;
+
+      default:
+        if (ch < 0x80 and isprint(ch)) typed(ch);
+        break;
+      }
+
+    } else if (_history_search) {
+      // Searching back through the history.
+      switch (ch) {
+      case ERR: // Keyboard input timeout
+        return;
+
+      case CTRL('r'): // The next older match.
+        if (_found != history::npos) {
+          const auto older = _history.find(_query, _found + 1);
+          if (older != history::npos) _found = older;
+        }
+        break;
+
+      case KEY_BACKSPACE:
+      case '\b':
+      case '\x7f':
+        if (not _query.empty()) {
+          pop_char(_query);
+          _found = _history.find(_query);
+        }
+        break;
+
+      case CTRL('g'): // Leave the line as it was.
+        _history_search = false;
+        break;
+
+      case KEY_ENTER:
+      case '\n':
+        if (_found != history::npos) {
+          _line.assign(_history[_found]);
+          suggest(C_CHANGED);
+        }
+        _history_search = false;
+        break;
+
+      default:
+        if (ch < 0x80 and isprint(ch)) typed(ch);
+        break;
+      }
+
+    } else if (_history_scan) {
       // We're in history input mode here.
       switch (ch) {
       case ERR: // Keyboard input timeout
         return;
 
       case KEY_UP:
-        if (_history_iter != _history.begin()) --_history_iter;
-        _line = *_history_iter;
-        _insert = _line.length();
+        if (_history.has(_history_at))
+          _line.assign(_history[_history_at++]);
         break;
 
       case KEY_DOWN:
-        if (_history_iter != _history.end()) ++_history_iter;
-        if (_history_iter != _history.end()) {
-          _line = *_history_iter;
+        if (_history_at > 1) {
+          _history_at--;
+          _line.assign(_history[_history_at - 1]);
         } else {
-          _line = "";
+          _history_at = 0;
+          _line.clear();
         }
-        _insert = _line.length();
         break;
 
       case CTRL('g'):
         _history_scan = false;
-        _line = "";
-        _insert = 0;
-        _suggest = "";
+        _line.clear();
+        suggest(C_CHANGED);
         break;
 
       case '\n':
         _history_scan = false;
+        suggest(C_CHANGED);
         break;
       }
 
     } else {
       // Normal input mode.
+      change_t change = C_NONE;
+      wchar_t removed = L'\0';
+
       switch (ch) {
       case ERR: // Keyboard input timeout
         return;
 
       case KEY_ENTER:
-      case '\n': // Send the line to the server and reset the input.
-        chatio << _line << std::endl;
-        _history.push_back(_line);
-        while (_history.size() > 100) _history.pop_front();
-        _line = "";
-        _insert = 0;
-        _suggest = "";
+      case '\n': { // Send the line to the server and reset the input.
+        const std::string line = _line.str();
+        if (line == "/quit" or line == "/exit" or
+            line.compare(0, 6, "/quit ") == 0 or
+            line.compare(0, 6, "/exit ") == 0)
+          _lchat->_chat.quit();
+        _lchat->_chat.send(line);
+        if (_history.add(line)) {
+          completion.add(line);
+          if (_history.has(history_completions))
+            completion.remove(std::string(_history[history_completions]));
+        }
+        completion.use(line);
+        _line.clear();
+        change = C_CHANGED;
         break;
+      }
 
       case CTRL('u'): // Toggle auto scroll.
         chat::auto_scroll = not chat::auto_scroll;
@@ -706,9 +1466,21 @@ namespace {
 
       case CTRL('p'): // Enter into history mode.
         _history_scan = true;
-        _history_iter = _history.end();
-        _line = "";
-        _insert = 0;
+        _history_at = 0;
+        _line.clear();
+        change = C_CHANGED;
+        break;
+
+      case CTRL('r'): // Search back through the history.
+        _history_search = true;
+        _query.clear();
+        _found = _history.find(_query);
+        break;
+
+      case CTRL('o'): // Search back through the scrollback.
+        _chat_search = true;
+        _query.clear();
+        _match = _lchat->_chat.find(_query);
         break;
 
       case CTRL('l'): // Force a redraw of the client.
@@ -718,34 +1490,30 @@ namespace {
 
       case '\x9': { // Tab key
         bool is_more;
-        _line = completion(_line, _suggest, is_more);
-        if (not _suggest.empty() and not is_more) {
-          _line = _suggest;
-          _insert = _line.size();
-        }
-        _insert = _line.size();
+        const auto common = completion(_line.str(), _suggest, is_more);
+        if (not _suggest.empty() and not is_more) _line.assign(_suggest);
+        else _line.assign(common);
+        change = C_CHANGED;
         break;
       }
 
       case KEY_BACKSPACE: // Backspace key and variants.
       case '\b':
-      case '\x7f':
-        if (not _line.empty() and _insert > 0) {
-          _line.erase(_insert - 1, 1);
-          _insert--;
-          _suggest = "";
-        }
+      case '\x7f': {
+        // Deleting the last character only takes one step back.
+        const bool last = _line.at_end();
+        removed = _line.erase_before();
+        if (removed) change = (last ? C_POPPED : C_CHANGED);
         break;
+      }
 
       case CTRL('k'):
-        _line.erase(_insert);
-        _suggest = "";
+        if (_line.erase_to_end()) change = C_CHANGED;
         break;
 
       case CTRL('g'):
-        _line = "";
-        _insert = 0;
-        _suggest = "";
+        _line.clear();
+        change = C_CHANGED;
         break;
 
       case CTRL('['):
@@ -760,10 +1528,7 @@ namespace {
 
       case KEY_DC: // Delete key.
       case CTRL('d'):
-        if (not _line.empty() and _insert < _line.size()) {
-          _line.erase(_insert, 1);
-          _suggest = "";
-        }
+        if (_line.erase_after()) change = C_CHANGED;
         break;
 
       case KEY_IC: // Insert key, toggles insert/overwrite mode
@@ -781,12 +1546,16 @@ namespace {
 
       case KEY_LEFT:
       case CTRL('b'):
-        if (_insert > 0) _insert--;
+        _line.left();
         break;
 
       case KEY_RIGHT:
       case CTRL('f'):
-        if (_insert < _line.size()) _insert++;
+        if (not _line.right() and not _suggest.empty()) {
+          // Take the suggestion at the end of the line.
+          _line.assign(_suggest);
+          change = C_CHANGED;
+        }
         break;
 
       case KEY_PPAGE: // Page up key
@@ -799,34 +1568,150 @@ namespace {
 
       case KEY_HOME:
       case CTRL('a'):
-        _insert = 0;
+        _line.home();
         break;
 
       case KEY_END:
       case CTRL('e'):
-        _insert = _line.size();
+        _line.end();
         break;
 
       default:
-        /* XXX Current isprint doesn't work with multibyte unicode
-         * characters, but for the moment our _insert pointers is smart
-         * enough to manage multibyte characters.
+        // Without wide character curses this is all that gets typed.
+        if (ch < 0x80 and isprint(ch)) typed(ch);
+        return;
+      }
+
+      suggest(change, removed);
+    }
+
+    invalidate();
+  }
+
+  /*********************
+   * input::char_event *
+   *********************/
+
+  void input::char_event(wint_t ch) {
+    // Control characters are still keys, anything printable is typed.
+    if (ch < 0x80) key_event(ch);
+    else if (iswprint(ch)) typed(ch);
+  }
+
+  /****************
+   * input::typed *
+   ****************/
+
+  void input::typed(wchar_t ch) {
+    if (_chat_search or _history_search) {
+      char buffer[MB_LEN_MAX];
+      std::mbstate_t state{};
+      const size_t len = std::wcrtomb(buffer, ch, &state);
+      if (len == (size_t)-1) return;
+      _query.append(buffer, len);
+
+      if (_chat_search) {
+        // As with the history, a longer query carries on from the match.
+        if (_match != chat::npos) _match = find(_match + 1);
+        else _lchat->_chat.highlight(_query);
+      } else {
+        /* A longer query can only match the entry already found or older
+         * ones, so the search carries on from there.
          */
-        if (isprint(ch)) {
-          std::string in;
-          in += ch; // This is sillyness, but it's what C++ wants.
-
-          if (insert_mode or _insert >= _line.size())
-            _line.insert(_insert, in);
-          else
-            _line.replace(_insert, 1, in);
-          _insert++;
-        }
-        break;
+        if (_found != history::npos) _found = _history.find(_query, _found);
       }
+
+    } else if (not _history_scan) {
+      // Typing at the end of the line only moves the search one step.
+      const bool last = _line.at_end();
+      if (insert_mode) _line.insert(ch);
+      else _line.replace(ch);
+      suggest(last ? C_PUSHED : C_CHANGED, ch);
     }
 
-    redraw();
+    invalidate();
+  }
+
+  /***************
+   * input::find *
+   ***************/
+
+  uint64_t input::find(uint64_t before) {
+    // Find the query in a line older than before and bring it into view.
+    auto &view = _lchat->_chat;
+    const auto found = view.find(_query, before);
+
+    view.highlight(_query);
+    if (found != chat::npos) view.show(found);
+    return found;
+  }
+
+  /******************
+   * input::suggest *
+   ******************/
+
+  void input::suggest(change_t change, wchar_t ch) {
+    /* The search follows the line a byte at a time, typing or deleting at
+     * the end of the line only moves it that far. Anything else has it
+     * follow the line from the start.
+     */
+    switch (change) {
+    case C_NONE:
+      return;
+
+    case C_PUSHED: {
+      char buffer[MB_LEN_MAX];
+      std::mbstate_t state{};
+      const size_t len = std::wcrtomb(buffer, ch, &state);
+      if (len == (size_t)-1) _search.reset(_line.str());
+      else for (size_t at = 0; at < len; at++) _search.push(buffer[at]);
+      break;
+    }
+
+    case C_POPPED:
+      for (auto len = gapbuffer::encoded_length(ch); len > 0; len--)
+        _search.pop();
+      break;
+
+    case C_CHANGED:
+      _search.reset(_line.str());
+      break;
+    }
+
+    // Only show a suggestion for what's been typed.
+    _suggest.clear();
+    if (not _line.empty()) {
+      auto best = _search.suggestion();
+      if (best.size() > _line.bytes()) _suggest = std::move(best);
+    }
+  }
+
+  /********************
+   * input::draw_line *
+   ********************/
+
+  int input::draw_line() {
+    /* Only the part of the line around the cursor fits on the screen. The
+     * view stays put while the cursor is in it, otherwise it slides just
+     * far enough to bring the cursor back.
+     */
+    const int room = width() - 3;
+    if (_line.columns() <= room) _view = 0;
+
+    size_t first = _line.cursor();
+    int column = 0;
+    while (first > _view and column + _line.width(first - 1) <= room)
+      column += _line.width(--first);
+    _view = first;
+
+    size_t last = _view;
+    for (int shown = 0; last < _line.size(); last++) {
+      shown += _line.width(last);
+      if (shown > room) break;
+    }
+
+    *this << curs::cursor(2, 0) << _line.str(_view, last);
+    return column + 2;
   }
 
   /****************************************************************************
@@ -843,11 +1728,15 @@ namespace {
       _input(*this, 0, height() - 1, width(), 1),
       _userlist_width(11),
       _userlist(width() - 11, 1, 11, height() - 3),
-      _status(_chat, _userlist, 0, height() - 2, width(), 1) {
+      _status(_chat, _userlist, 0, height() - 2, width(), 1),
+      _dirty(true), _backoff(min_backoff) {
 
     // Enable keypad translation.
     *this << curs::keypad(true);
 
+    // All the windows are drawn in batches and put on the screen by render.
+    *this << curs::batch(true);
+
     // Configure the color theme.
     curs::colors::start();
     if (curs::colors::have()) {
@@ -867,8 +1756,6 @@ namespace {
       curs::colors::pair(C_DIVIDER, curs::colors::BLUE, -1);
       curs::colors::pair(C_HISTORY, curs::colors::CYAN, -1);
     }
-
-    _draw();
   }
 
   /**********************
@@ -907,6 +1794,7 @@ namespace {
 
   void lchat::refresh_users(const std::string &list) {
     _userlist.update(list);
+    _status.invalidate();
   }
 
   /*********************
@@ -928,7 +1816,7 @@ namespace {
    *************************/
 
   void lchat::update_status() {
-    _status.redraw();
+    _status.invalidate();
   }
 
   /***********************
@@ -936,23 +1824,67 @@ namespace {
    ***********************/
 
   void lchat::operator()() {
+    using namespace std::chrono;
 
-    // Create the chat window thread.
-    std::thread chat_view(&chat::thread_loop, &_chat);
+    // Read from the server along with the keyboard.
+    _chat.start();
 
     update();
 
-    // Our main application loop.
-    while (_chat.connected()) {
-      curs::events::process();
+    // Our main application loop, until we've quit and the server let us go.
+    while (curs::events::running()) {
+      if (not _chat.connected()) {
+        if (_chat.quitting()) break;
+        if (steady_clock::now() >= _retry) {
+          if (_chat.reconnect()) _backoff = min_backoff;
+          else retry_later();
+        }
+      }
+
+      /* Only wake up early when there's a frame waiting to be drawn or
+       * it's time to try the server again.
+       */
+      auto wake = steady_clock::time_point::max();
+      if (dirty()) wake = _next_frame;
+      if (not _chat.connected()) wake = std::min(wake, _retry);
+
+      int timeout = -1;
+      if (wake != steady_clock::time_point::max()) {
+        timeout = static_cast<int>(
+          duration_cast<milliseconds>(wake - steady_clock::now()).count());
+        if (timeout < 0) timeout = 0;
+      }
+
+      curs::events::process(timeout);
+      render();
     }
 
 #ifdef DEBUG
     debug << "The chat has been disconnected" << std::endl;
 #endif // DEBUG
 
-    // Clean up the chat window thread.
-    chat_view.join();
+    if (_chat.connected()) {
+      curs::events::unwatch(chatio.socket());
+      curs::events::unwatch_output(chatio.socket());
+    }
+  }
+
+  /**********************
+   * lchat::retry_later *
+   **********************/
+
+  void lchat::retry_later() {
+    /* Wait before trying the server again, twice as long as last time.
+     * Everyone lost the server at the same moment, so the wait is spread
+     * out to keep them from all coming back at once.
+     */
+    using namespace std::chrono;
+    static std::minstd_rand random(getpid());
+
+    const auto spread = milliseconds(random() % (_backoff.count() / 2 + 1));
+    _retry = steady_clock::now() + _backoff / 2 + spread;
+    _backoff = std::min(_backoff * 2, max_backoff);
+    update_status();
   }
 
   /******************
@@ -960,8 +1892,50 @@ namespace {
    ******************/
 
   void lchat::update() {
-    _status.redraw();
-    _input.redraw();
+    _dirty = true;
+    _chat.invalidate();
+    _userlist.invalidate();
+    _status.invalidate();
+    _input.invalidate();
+  }
+
+  /*****************
+   * lchat::render *
+   *****************/
+
+  void lchat::render() {
+    /* Everything that changed since the last frame is drawn into the curses
+     * windows and then sent to the terminal with a single update. Frames
+     * closer together than frame_time are put off, so the changes in
+     * between are drawn together.
+     */
+    if (not dirty()) return;
+    if (std::chrono::steady_clock::now() < _next_frame) return;
+
+    if (_dirty) _draw();
+    if (_chat.dirty()) _chat.redraw();
+    if (_userlist.dirty()) _userlist.redraw();
+    if (_status.dirty()) _status.redraw();
+    if (_input.dirty()) _input.redraw();
+
+    // The input window goes last so the terminal's cursor ends up there.
+    *this << curs::noutrefresh;
+    _chat << curs::noutrefresh;
+    _userlist << curs::noutrefresh;
+    _status << curs::noutrefresh;
+    _input << curs::noutrefresh;
+
+    curs::terminal::update();
+    _next_frame = std::chrono::steady_clock::now() + frame_time;
+  }
+
+  /****************
+   * lchat::dirty *
+   ****************/
+
+  bool lchat::dirty() const {
+    return (_dirty or _chat.dirty() or _userlist.dirty() or _status.dirty() or
+            _input.dirty());
   }
 
   /************************
@@ -969,7 +1943,6 @@ namespace {
    ************************/
 
   void lchat::resize_event() {
-    curs_mtx.lock();
     // Get the new window size.
     const auto w = width();
     const auto h = height();
@@ -991,18 +1964,13 @@ namespace {
     _input << curs::move(0, h - 1)
            << curs::resize(w, 1);
 
-    curs_mtx.unlock();
+    curs::terminal::clear();
 
 #ifdef DEBUG
     debug << " redrawing the terminal" << std::endl;
 #endif // DEBUG
 
-    curs::terminal::clear();
-    _draw(); // Redraw ourself.
-    _chat.redraw();
-    _userlist.redraw();
-    _status.redraw();
-    _input.redraw();
+    update();
   }
 
   /****************
@@ -1010,8 +1978,6 @@ namespace {
    ****************/
 
   void lchat::_draw() {
-    curs_mtx.lock();
-
     const auto w = width();
     const auto h = height();
 
@@ -1030,9 +1996,7 @@ namespace {
           << curs::attroff(curs::colors::pair(C_DIVIDER))
           << std::flush;
 
-    // Update the terminal.
-    curs::terminal::update();
-    curs_mtx.unlock();
+    _dirty = false;
   }
 
   /***********
@@ -1055,9 +2019,14 @@ namespace {
   static void help() {
     std::cout << "Local Chat v" VERSION << "\n"
               << "  lchat [-s|--socket path] [-a|--auto-scroll]\n"
-              << "        [-l|--scrollback scrollback lines]\n"
-              << "  lchat [-s|--socket path] [-m|--message message]\n"
-              << "  lchat [-s|--socket path] [-b|--bot bot command]\n"
+              << "        [-l|--scrollback scrollback lines] [-z|--compress]\n"
+              << "  lchat [-s|--socket path] [-w|--wait seconds]\n"
+              << "        [-m|--message message]\n"
+              << "  lchat [-s|--socket path] [-w|--wait seconds]\n"
+              << "        [-W|--window lines] < messages\n"
+              << "  lchat [-s|--socket path]\n"
+              << "        [[-f|--filter pattern]... -b|--bot bot command]...\n"
+              << "        [-r|--rules rules file]\n"
               << "  lchat -V|--version\n"
               << "  lchat -h|--help\n\n"
               << "Copyright © 2018-2023 Ron R Wills <ron@digitalcombine.ca>.\n"
@@ -1078,91 +2047,226 @@ namespace {
     std::clog << "> " << line << std::endl;
 #endif // DEBUG
 
-    // Pass control to the kernel for a moment to actually deliver the
-    // message.
-    usleep(10);
-
+    // Read anything already waiting from the dispatcher, without waiting.
     std::string in;
-    for (;;) {
-      try {
-        // Read anything coming in from the dispatcher.
-        getline(chatio, in);
-
-        // If the line is empty, we're out of here.
-        if (in.empty()) break;
-
+    try {
+      while (getline(chatio, in)) {
 #ifdef DEBUG
         std::clog << "< " << in << std::endl;
 #endif // DEBUG
-      } catch (sockets::ionotready &err) {
-        // Nothing ready from the dispatcher, we're done here.
-        chatio.clear();
-        usleep(100);
-        break;
       }
+    } catch (sockets::ionotready &err) {
+      chatio.clear();
     }
   }
 
-  /*************
-   * quit_chat *
-   *************/
+  /***********
+   * confirm *
+   ***********/
 
-  /** The proper way to quit the chat session, usually used when lchat is being
-   * used in a script.
+  /** Wait for the dispatcher to confirm everything sent so far was delivered.
+   * Returns false if the dispatcher hung up or the wait timed out.
    */
-  static void quit_chat() {
-    // Send the quit command to the dispatcher.
-    send_message("/quit");
+  static bool confirm(std::chrono::milliseconds timeout) {
+    static unsigned long last_ack = 0;
+    const std::string id = std::to_string(++last_ack);
+    const std::string ack = "= " + id;
 
-    // Loop until the dispatcher disconnects the line.
-    std::string line;
-    while (chatio) {
-      try {
-        // Read anything coming in from the dispatcher.
-        getline(chatio, line);
+    chatio << "/ack " << id << std::endl;
 
-        // If the line is empty, we're out of here.
-        if (line.empty()) break;
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::string line, partial;
+    for (;;) {
+      try {
+        while (getline(chatio, line)) {
+          if (not partial.empty()) {
+            line.insert(0, partial);
+            partial.clear();
+          }
 #ifdef DEBUG
-        std::clog << "< " << line << std::endl;
-#endif
+          std::clog << "< " << line << std::endl;
+#endif // DEBUG
+
+          /* A server without /ack still answers it in order, so its
+           * complaint about the command does just as well.
+           */
+          if (line == ack or
+              line.compare(0, 29, "? Unknown chat command '/ack ") == 0)
+            return true;
+        }
+
+        // The dispatcher hung up on us.
+        return false;
 
       } catch (sockets::ionotready &err) {
-        // Nothing ready from the dispatcher.
+        // Nothing more for now, keep what we've got and wait for more.
+        partial += line;
         chatio.clear();
-        usleep(100);
       }
+
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) return false;
+
+      struct pollfd pfd = {chatio.socket(), POLLIN, 0};
+      if (poll(&pfd, 1, left.count()) < 0 and errno != EINTR) return false;
     }
   }
 
-  /*******
-   * bot *
-   *******/
+  /**********
+   * ingest *
+   **********/
 
-  static int bot(const std::string &command) {
-    /* Fork and execute a shell command piping its IO through the chat's unix
-     * socket.
-     */
-    auto pid = fork();
-    switch (pid) {
-    case 0: // Child Process
-      // Redirect the childs IO through the socket.
-      dup2(chatio.socket(), STDIN_FILENO);
-      dup2(chatio.socket(), STDOUT_FILENO);
-
-      // Execute the bot command.
-      execlp("sh", "sh", "-c", command.c_str(), NULL);
-      break; // Stops compiler warnings.
-    case -1:
-      std::cerr << "Bot command failed\n - " << strerror(errno) << std::endl;
-      return -1;
-    default: {
-      int status;
-      waitpid(pid, &status, 0);
-      return status;
-    }
+  /** Post every line read from fd to the chat. The lines are written to the
+   * dispatcher in large batches while its replies are drained. With a window
+   * an ack follows every window lines and reading stops while two of them
+   * are unanswered, otherwise only the final ack confirms everything was
+   * delivered. Returns false if the dispatcher hung up or stopped making
+   * progress for longer than the ack wait.
+   */
+  static bool ingest(int fd, size_t window) {
+    const int sock = chatio.socket();
+
+    std::string out; // Waiting to be written to the dispatcher.
+    size_t written = 0;
+    std::string in; // A reply that isn't a complete line yet.
+
+    unsigned long acks = 0, confirmed = 0;
+    size_t lines = 0; // Lines since the last ack.
+    bool eof = false, line_start = true;
+
+    auto ack = [&]() {
+      out += "/ack " + std::to_string(++acks) + "\n";
+      lines = 0;
+    };
+
+    std::vector<char> buffer(65536);
+    auto deadline = std::chrono::steady_clock::now() + ack_wait;
+
+    for (;;) {
+      if (eof and confirmed == acks and written == out.size()) return true;
+
+      const bool reading = (not eof and out.size() - written < buffer.size() and
+                            (window == 0 or acks - confirmed < 2));
+
+      struct pollfd fds[2] = {
+        {sock, static_cast<short>(POLLIN | (written < out.size() ? POLLOUT
+                                                                  : 0)), 0},
+        {(reading ? fd : -1), POLLIN, 0}
+      };
+
+      // Only waiting on the dispatcher has a deadline, input can take its time.
+      int timeout = -1;
+      if (not reading) {
+        const auto left =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) return false;
+        timeout = left.count();
+      }
+
+      const int ready = poll(fds, 2, timeout);
+      if (ready < 0) {
+        if (errno == EINTR) continue;
+        throw sockets::exception(std::string("poll: ") + strerror(errno));
+      }
+      if (ready == 0) continue;
+
+      bool progress = false;
+
+      if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        // Drain the replies, only the answers to our acks matter.
+        const auto res = recv(sock, buffer.data(), buffer.size(), 0);
+        if (res == 0) return false;
+        if (res < 0 and errno != EAGAIN and errno != EWOULDBLOCK and
+            errno != EINTR)
+          throw sockets::exception(std::string("Socket read error: ") +
+                                   strerror(errno));
+
+        if (res > 0) {
+          in.append(buffer.data(), res);
+
+          size_t start = 0, end;
+          while ((end = in.find('\n', start)) != in.npos) {
+            if (in.compare(start, 2, "= ") == 0) {
+              const auto id = strtoul(in.c_str() + start + 2, nullptr, 10);
+              if (id > confirmed and id <= acks) {
+                confirmed = id;
+                progress = true;
+              }
+            } else if (in.compare(start, 29,
+                                  "? Unknown chat command '/ack ") == 0) {
+              // A server without /ack still answers them in order.
+              if (confirmed < acks) confirmed++;
+              progress = true;
+            }
+            start = end + 1;
+          }
+          in.erase(0, start);
+        }
+      }
+
+      if (fds[0].revents & POLLOUT) {
+        const auto res = send(sock, out.data() + written, out.size() - written,
+                              MSG_NOSIGNAL);
+        if (res < 0 and errno != EAGAIN and errno != EWOULDBLOCK and
+            errno != EINTR)
+          throw sockets::exception(std::string("Socket write error: ") +
+                                   strerror(errno));
+
+        if (res > 0) {
+          written += res;
+          progress = true;
+          if (written == out.size()) {
+            out.clear();
+            written = 0;
+          }
+        }
+      }
+
+      if (fds[1].revents) {
+        const auto res = read(fd, buffer.data(), buffer.size());
+        if (res < 0 and errno != EAGAIN and errno != EINTR)
+          throw std::runtime_error(std::string("Unable to read messages: ") +
+                                   strerror(errno));
+
+        if (res == 0) {
+          // Finish off the last line and confirm everything.
+          eof = true;
+          if (not line_start) out += '\n';
+          ack();
+          progress = true;
+
+        } else if (res > 0) {
+          if (written > 0) {
+            out.erase(0, written);
+            written = 0;
+          }
+
+          const char *data = buffer.data(), *end = data + res;
+          if (window == 0) {
+            out.append(data, end);
+          } else {
+            // Follow every window lines with an ack.
+            while (data < end) {
+              const char *nl = static_cast<const char *>(
+                std::memchr(data, '\n', end - data));
+              if (not nl) {
+                out.append(data, end);
+                break;
+              }
+              out.append(data, nl + 1);
+              data = nl + 1;
+              if (++lines == window) ack();
+            }
+          }
+          line_start = (end[-1] == '\n');
+        }
+      }
+
+      if (progress)
+        deadline = std::chrono::steady_clock::now() + ack_wait;
     }
-    return 0; // Stops compiler warnings.
   }
 
   /************
@@ -1175,6 +2279,11 @@ namespace {
     {"scrollback",  required_argument, nullptr, 'l' },
     {"message",     required_argument, nullptr, 'm' },
     {"bot",         required_argument, nullptr, 'b' },
+    {"filter",      required_argument, nullptr, 'f' },
+    {"rules",       required_argument, nullptr, 'r' },
+    {"wait",        required_argument, nullptr, 'w' },
+    {"window",      required_argument, nullptr, 'W' },
+    {"compress",    no_argument,       nullptr, 'z' },
     {"version",     no_argument,       nullptr, 'V' },
     {"help",        no_argument,       nullptr, 'h' },
     {nullptr,       0,                 nullptr, 0}
@@ -1189,8 +2298,11 @@ namespace {
 int main(int argc, char *argv[]) {
   std::setlocale(LC_ALL, "");
 
-  std::string bot_command, message;
+  std::string message;
+  bothost bots;
+  std::vector<std::string> filters;
   bool mesg_stdin = false;
+  int window = 0;
 
 #ifdef DEBUG
   debug.open("lchat.log");
@@ -1198,14 +2310,32 @@ int main(int argc, char *argv[]) {
 
   // Get the command line arguments.
   int opt;
-  while ((opt = getopt_long(argc, argv, ":as:l:b:m:hV?", longopts,
+  while ((opt = getopt_long(argc, argv, ":as:l:b:f:r:m:w:W:zhV?", longopts,
                             nullptr)) != -1) {
     switch (opt) {
     case 'a':
       chat::auto_scroll = true;
       break;
     case 'b':
-      bot_command = optarg;
+      try {
+        bots.add(optarg, filters);
+      } catch (std::exception &err) {
+        std::cerr << "OPTIONS ERROR: " << err.what() << '\n';
+        return EXIT_FAILURE;
+      }
+      filters.clear();
+      break;
+    case 'r':
+      try {
+        bots.load(optarg);
+      } catch (std::exception &err) {
+        std::cerr << "OPTIONS ERROR: " << err.what() << '\n';
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'f':
+      // The filters belong to the bot that follows them.
+      filters.push_back(optarg);
       break;
     case '?':
     case 'h':
@@ -1226,6 +2356,28 @@ int main(int argc, char *argv[]) {
     case 's':
       sock_path = optarg;
       break;
+    case 'W':
+      window = atoi(optarg);
+      if (window <= 0) {
+        std::cerr << "OPTIONS ERROR: Invalid value \"" << optarg
+                  << "\" for the window of lines"
+                  << '\n';
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'w':
+      ack_wait = std::chrono::milliseconds(
+        static_cast<long>(atof(optarg) * 1000));
+      if (ack_wait.count() <= 0) {
+        std::cerr << "OPTIONS ERROR: Invalid value \"" << optarg
+                  << "\" for the seconds to wait"
+                  << '\n';
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'z':
+      chat::compress = true;
+      break;
     case 'V':
       version();
       return EXIT_SUCCESS;
@@ -1249,8 +2401,17 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  // Check if our input is from a tty.
-  if (not isatty(STDIN_FILENO)) {
+  /* Without a message or bot to run, input that isn't from a tty is sent
+   * as messages. A message given on the command line always wins, scripts
+   * and alerting jobs rarely have a tty.
+   */
+  if (not filters.empty()) {
+    std::cerr << "OPTIONS ERROR: Filters must be given before their bot"
+              << '\n';
+    return EXIT_FAILURE;
+  }
+
+  if (message.empty() and bots.empty() and not isatty(STDIN_FILENO)) {
     mesg_stdin = true;
   }
 
@@ -1273,26 +2434,54 @@ int main(int argc, char *argv[]) {
 
   if (mesg_stdin) {
     chatio >> sockets::nonblock;
-    std::string line;
-    while (getline(std::cin, line)) {
-      send_message(line);
+
+    try {
+      if (not ingest(STDIN_FILENO, window)) {
+        std::cerr << "The chat server didn't confirm the messages were sent"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    } catch (std::exception &err) {
+      std::cerr << err.what() << std::endl;
+      return EXIT_FAILURE;
     }
-    quit_chat();
 
   } else if (not message.empty()) {
-    // If the -m option was given then send the message.
+    /* If the -m option was given then send the message, the server's
+     * answer to the ack confirms it was delivered and we're done.
+     */
     chatio >> sockets::nonblock;
-    send_message(message);
-    quit_chat();
 
-  } else if (not bot_command.empty()) {
-    // If the -b option was given then run the bot.
-    chatio >> sockets::block;
-    return bot(bot_command);
+    try {
+      send_message(message);
+      if (not confirm(ack_wait)) {
+        std::cerr << "The chat server didn't confirm the message was sent"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    } catch (std::exception &err) {
+      std::cerr << err.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  } else if (not bots.empty()) {
+    // If the -b or -r options were given then host the bots.
+    try {
+      bots.reconnect(sock_path);
+      bots.name(my_name);
+      return bots(chatio.socket());
+    } catch (std::exception &err) {
+      std::cerr << err.what() << std::endl;
+      return EXIT_FAILURE;
+    }
 
   } else {
     // Interactive user interface.
-    chatio >> sockets::block;
+    chatio >> sockets::nonblock;
+#ifdef HAVE_SHMRING
+    chatio.keep_fds(); // The server may pass us the ring to read.
+#endif // HAVE_SHMRING
+    chatio.unpack_input();
 
     try {
       // Setup the terminal.
@@ -1300,11 +2489,8 @@ int main(int argc, char *argv[]) {
 
       terminal.cbreak(true);
       terminal.echo(false);
-      terminal.halfdelay(10);
 
       lchat chat_ui;
-      chatio << "/who" << std::endl;
-
       chat_ui();
     } catch (std::exception &err) {
       std::cerr << err.what() << std::endl;
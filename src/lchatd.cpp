@@ -36,10 +36,23 @@
 #endif // __cplusplus
 
 #include "nstream"
+#include "backlog.h"
+#ifdef HAVE_SHMRING
+#include "shmring.h"
+#endif // HAVE_SHMRING
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <set>
+#include <map>
+#include <deque>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 #include <cerrno>
+#include <ctime>
+#include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
 #include <pwd.h>
@@ -49,6 +62,9 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <netdb.h>
 #if defined(__FreeBSD__)
 #include <sys/types.h>
 #include <sys/un.h>
@@ -59,9 +75,6 @@
 #endif // LOG_ERROR
 
 #endif // __FreeBSD__
-#ifdef DEBUG
-#include <fcntl.h>
-#endif // DEBUG
 
 namespace {
   // Global settings.
@@ -71,12 +84,69 @@ namespace {
   std::string chat_user;
   bool running = true;
 
+  // Live restart support.
+  int takeover_fd = -1;
+  bool handed_off = false;
+
+  // The socket was passed to us by the service manager.
+  bool socket_activated = false;
+
+  /* Every chat line is numbered and the latest are kept, so a client that
+   * lost its connection can resume its session and be sent only what it
+   * missed, or ask for any of them again.
+   */
+  backlog recent;
+
+  /* A line longer than this is passed on in pieces as it arrives instead
+   * of being held until it ends, frames from other nodes get some room on
+   * top for a roster.
+   */
+  size_t max_line = 8192;
+  const size_t frame_slack = 64 * 1024;
+
+#ifdef HAVE_SHMRING
+  /* The lines for everyone are also written once to a ring in shared
+   * memory, the local clients that asked for it read them from there
+   * rather than being sent each one.
+   */
+  shmring *ring = nullptr;
+  size_t ring_size = 0; // In bytes, no ring if zero.
+  bool ring_waiting = false; // Clients are waiting to be passed the ring.
+#endif // HAVE_SHMRING
+
+  struct session {
+    std::string name;
+    bool left;              // Everyone was told the user left the chat.
+    sockets::codec_t codec; // Bulk transfers are packed with it.
+  };
+
+  std::map<std::string, session> sessions;
+  std::deque<std::string> session_order; // Oldest session first.
+  const size_t sessions_max = 4096;
+
+  // Long lines packed for each codec, numbered or not.
+  typedef std::map<std::pair<sockets::codec_t, bool>, std::string>
+    packed_lines;
+
   class chat_client : public sockets::connection {
   public:
-    chat_client(int sockfd) : sockets::connection(sockfd) {}
+    chat_client(int sockfd)
+      : sockets::connection(sockfd), _announced(false), _shared(false),
+        _sharing(false), _streaming(false), _skipping(false), _codec(sockets::CODEC_NONE) {}
     virtual ~chat_client() noexcept override;
 
     std::string name() const { return _name; }
+    std::string token() const { return _token; }
+    bool announced() const { return _announced; }
+    bool shared() const { return _shared; }
+    bool sharing() const { return _sharing; }
+
+    void send(const backlog::line &line, packed_lines &packed);
+    void send_bulk(const std::string &text);
+    void resumed();
+#ifdef HAVE_SHMRING
+    void share();
+#endif // HAVE_SHMRING
 
   protected:
     std::string _name;
@@ -84,25 +154,184 @@ namespace {
     virtual void connect(int sockfd) override;
     virtual void recv() override;
 
+    virtual std::string save() const override;
+    virtual void restore(const std::string &state) override;
+
   private:
+    std::string _partial; // A line that hasn't been completely received.
+
+    std::string _token; // Our session, our lines are numbered once we have one.
+    bool _announced;    // Everyone was told we joined the chat.
+    bool _shared;       // We read the lines for everyone from the ring.
+    bool _sharing;      // The ring goes out once our output has been sent.
+    bool _streaming;    // Passing on a long line, the rest is on its way.
+    bool _skipping;     // Dropping the rest of a line we refused.
+    sockets::codec_t _codec; // Packs bulk transfers for us.
+
+    void announce();
+    void piece(std::string &in, bool more);
+    void leave();
+    void resume(const std::string &token, uint64_t seq);
+    void replay(uint64_t from, uint64_t to);
+    std::string format(const backlog::line &line, bool numbered) const;
     void send_private(const std::string &who, const std::string &mesg);
   };
 
-  sockets::server<chat_client> chat_server;
+  /* Servers can be linked over TCP so users on different hosts share the
+   * chat. Each link carries one frame per line, every chat line tagged with
+   * the node it started on and numbered by it so a line that comes around
+   * a second time is dropped.
+   */
+  class peer_link : public sockets::connection {
+  public:
+    peer_link(int sockfd)
+      : sockets::connection(sockfd), _outgoing(false), _skipping(false),
+        _peer(-1), _connecting(false), _deadline(0) {}
+    virtual ~peer_link() noexcept override;
+
+    std::string node() const { return _node; }
+    bool linked() const { return not _node.empty(); }
+    int peer() const { return _peer; }
+    bool connecting() const { return _connecting; }
+    time_t deadline() const { return _deadline; }
+
+    void dialed(int peer);
+    void check_connect(time_t now);
+    void write(const std::string &frame);
+    void flush();
+    void query();
+    void drop();
 
-  /***************
-   * connections *
-   ***************/
+  protected:
+    virtual void connect(int sockfd) override;
+    virtual void recv() override;
+
+    virtual std::string save() const override;
+    virtual void restore(const std::string &state) override;
+
+  private:
+    std::string _node;    // The node on the other end, once it said hello.
+    std::string _partial; // A frame that hasn't been completely received.
+    bool _outgoing;       // We connected to it.
+    bool _skipping;       // Dropping the rest of a frame that's too long.
+    int _peer;            // The peer we were told to link to, or -1.
+    bool _connecting;     // Our connect to the peer hasn't finished.
+    time_t _deadline;     // When to give up on the connect.
+
+    void hello(const std::string &node);
+    void frame(const std::string &line);
+  };
+
+  class chat_dispatcher : public sockets::server_base {
+  public:
+    chat_dispatcher() : sockets::server_base() {}
+
+  protected:
+    virtual sockets::connection *new_connection(int sockfd) override;
+    virtual void event(int fd) override;
+
+    virtual std::string save() const override;
+    virtual void restore(const std::string &state) override;
+  };
+
+  chat_dispatcher chat_server;
+
+  // Linking with other servers.
+  std::string node_name;
+  uint64_t node_epoch = 0; // Tells our lines apart from a past run's.
+  uint64_t node_seq = 0;
+  int tick_pipe[2] = {-1, -1};
+
+  struct peer {
+    std::string host;
+    std::string service;
+    std::string node;  // Its name, once it has said hello.
+    time_t retry;      // When to connect again.
+    unsigned backoff;  // Seconds to wait after the next failure.
+
+    // Its addresses, found once at startup, tried in turn.
+    std::vector<std::pair<sockaddr_storage, socklen_t>> addrs;
+    size_t next_addr;
+  };
+
+  std::vector<peer> peers;
+  const time_t peer_timeout = 5; // Seconds to wait on a connect.
+  const unsigned peer_max_backoff = 60;
+
+  /* What we know of the other nodes, the last line we've seen from each
+   * and who is chatting there.
+   */
+  struct origin {
+    uint64_t epoch;
+    uint64_t seq;
+    std::set<std::string> users;
+    bool complete;             // We were told everyone chatting there.
+    time_t heard;              // When we last heard from it.
+    std::set<peer_link *> via; // The links its lines reach us through.
+  };
+
+  std::map<std::string, origin> origins;
 
-  unsigned int connections(const std::string &name) {
-    /* Count the number of connections a user has to the chat server.
+  /* Every node tells the others who is chatting there now and then, a node
+   * that hasn't been heard from in a while is forgotten.
+   */
+  const time_t heartbeat_interval = 60;
+  time_t next_heartbeat = 0;
+
+  /*****************
+   * takeover_path *
+   *****************/
+
+  std::string takeover_path() {
+    return sock_path + ".takeover";
+  }
+
+  /************
+   * peer_uid *
+   ************/
+
+  uid_t peer_uid(int sockfd) {
+    /* Get the user id of the process on the other end of a unix domain
+     * socket.
+     */
+#if defined(__FreeBSD__)
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(sockfd, &uid, &gid) == -1)
+      throw sockets::exception(
+        std::string("Unable to determine connected peer: ") +
+        strerror(errno));
+    return uid;
+#else // not defined __FreeBSD__
+    struct ucred ucred;
+    socklen_t len = sizeof(struct ucred);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &ucred, &len) == -1)
+      throw sockets::exception(
+        std::string("Unable to determine connected peer: ") +
+        strerror(errno));
+    return ucred.uid;
+#endif // __FreeBSD__
+  }
+
+  /*************************
+   * announced_connections *
+   *************************/
+
+  unsigned int announced_connections(const std::string &name) {
+    /* Count the number of connections a user has to the chat server that
+     * everyone has been told about, the ones that never said anything
+     * don't count.
      */
     unsigned int count = 0;
 
     // Count the connections.
-    for (auto &it: chat_server)
-      if ((dynamic_cast<chat_client *>(it.second))->name() == name)
+    for (auto &it: chat_server) {
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client and client->name() == name and client->announced())
         count++;
+    }
 
 #ifdef DEBUG
     std::clog << "User " << name << " has " << count << " connections."
@@ -112,6 +341,308 @@ namespace {
     return count;
   }
 
+  /*************
+   * broadcast *
+   *************/
+
+  void broadcast(const std::string &text, const std::string &to = "") {
+    /* Number a chat line, keep it with the recent lines and send it to
+     * everyone, or only to the connections of one user.
+     */
+    const auto &line = recent.push(text, to);
+
+#ifdef HAVE_SHMRING
+    // Lines too long for the ring are sent to everyone.
+    const bool shared = (ring and to.empty() and
+                         ring->push(line.seq, line.text));
+#else
+    const bool shared = false;
+#endif // HAVE_SHMRING
+
+    packed_lines packed;
+    for (auto &it: chat_server) {
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client and (to.empty() or client->name() == to) and
+          not (shared and client->shared()))
+        client->send(line, packed);
+    }
+  }
+
+  /***************
+   * local_users *
+   ***************/
+
+  std::set<std::string> local_users() {
+    // The users everyone has been told are in the chat here.
+    std::set<std::string> users;
+
+    for (auto &it: chat_server) {
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client and client->announced()) users.insert(client->name());
+    }
+    return users;
+  }
+
+  /*********
+   * relay *
+   *********/
+
+  void relay(const std::string &frame, const peer_link *except = nullptr) {
+    /* Pass a frame on to every linked node but the one it came from. It's
+     * only buffered, the links are flushed once we're done with the input
+     * that caused it so many frames go out together.
+     */
+    for (auto &it: chat_server) {
+      const auto link = dynamic_cast<peer_link *>(it.second);
+      if (link and link->linked() and link != except) link->write(frame);
+    }
+  }
+
+  /****************
+   * flush_output *
+   ****************/
+
+  void flush_output() {
+    /* Send what piled up while handling some input, the frames for the
+     * other nodes and a single wake for the clients reading the ring.
+     */
+    for (auto &it: chat_server) {
+      const auto link = dynamic_cast<peer_link *>(it.second);
+      if (link) link->flush();
+    }
+#ifdef HAVE_SHMRING
+    if (ring) ring->wake();
+#endif // HAVE_SHMRING
+  }
+
+  /************
+   * federate *
+   ************/
+
+  void federate(char kind, const std::string &args) {
+    // Number one of our own chat lines and send it to the linked nodes.
+    std::ostringstream frame;
+
+    frame << kind << ' ' << node_name << ' ' << node_epoch << ' '
+          << ++node_seq << ' ' << args;
+    relay(frame.str());
+  }
+
+  /************
+   * snapshot *
+   ************/
+
+  std::string snapshot(const std::string &node) {
+    /* Who is chatting on a node, stamped with the last line seen from it
+     * so a node that already knows as much ignores it.
+     */
+    std::ostringstream frame;
+
+    if (node == node_name) {
+      frame << "R " << node_name << ' ' << node_epoch << ' ' << node_seq;
+      for (auto &user: local_users()) frame << ' ' << user;
+    } else {
+      const auto &known = origins.at(node);
+      frame << "R " << node << ' ' << known.epoch << ' ' << known.seq;
+      for (auto &user: known.users) frame << ' ' << user;
+    }
+    return frame.str();
+  }
+
+  /**********
+   * forget *
+   **********/
+
+  void forget(const std::string &node) {
+    // We can no longer reach a node, its users have left as far as we know.
+    const auto known = origins.find(node);
+    if (known == origins.end()) return;
+
+    for (auto &user: known->second.users)
+      broadcast(user + '@' + node + " has left the chat.");
+    origins.erase(known);
+  }
+
+  /***************
+   * new_session *
+   ***************/
+
+  std::string new_session(const std::string &name) {
+    /* Start a session for a user, the token is all a client needs to
+     * resume it later so it's made hard to guess.
+     */
+    static std::random_device random;
+    std::ostringstream token;
+
+    token << std::hex;
+    for (int c = 0; c < 4; c++) token << random();
+
+    sessions[token.str()] = {name, false, sockets::CODEC_NONE};
+    session_order.push_back(token.str());
+    if (session_order.size() > sessions_max) {
+      sessions.erase(session_order.front());
+      session_order.pop_front();
+    }
+
+    return token.str();
+  }
+
+  /**************
+   * state_path *
+   **************/
+
+  std::string state_path() {
+    return sock_path + ".state";
+  }
+
+  /***************
+   * write_state *
+   ***************/
+
+  void write_state(std::ostream &out) {
+    /* The sessions, recent lines and what we know of other nodes, so
+     * clients can resume with the next server to run.
+     */
+    for (auto &token: session_order) {
+      // Sessions that ended are left in the order until they age out.
+      const auto sess = sessions.find(token);
+      if (sess == sessions.end()) continue;
+      out << "session " << token << ' ' << sess->second.name << ' '
+          << sess->second.left << ' '
+          << sockets::codec_name(sess->second.codec) << '\n';
+    }
+    for (auto &it: origins) {
+      out << "node " << it.first << ' ' << it.second.epoch << ' '
+          << it.second.seq << ' ' << it.second.complete << ' ';
+      for (auto link: it.second.via) {
+        if (link != *it.second.via.begin()) out << ',';
+        out << link->node();
+      }
+      for (auto &user: it.second.users) out << ' ' << user;
+      out << '\n';
+    }
+    for (auto &it: chat_server) {
+      // The next server offers its own ring to the clients reading ours.
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client and (client->shared() or client->sharing()) and
+          not client->token().empty())
+        out << "shared " << client->token() << '\n';
+    }
+    for (auto seq = recent.first(); seq <= recent.last(); seq++) {
+      const auto line = recent.find(seq);
+      out << "line " << seq << ' ' << (line->to.empty() ? "*" : line->to)
+          << ' ' << line->text << '\n';
+    }
+  }
+
+  /**************
+   * save_state *
+   **************/
+
+  void save_state() {
+    // Keep the state where the next server to run will find it.
+    const auto path = state_path();
+    std::ofstream out(path, std::ios::trunc);
+    if (not out) {
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
+             "Unable to save the chat state to %s", path.c_str());
+      return;
+    }
+    chmod(path.c_str(), S_IRUSR | S_IWUSR);
+    write_state(out);
+  }
+
+  /**************
+   * read_state *
+   **************/
+
+  void read_state(std::istream &in) {
+    // Pick up the state written by the last server.
+    std::string line;
+    while (getline(in, line)) {
+      std::istringstream fields(line);
+      std::string kind;
+      fields >> kind;
+
+      if (kind == "session") {
+        std::string token;
+        std::string codec;
+        session sess;
+        if (fields >> token >> sess.name >> sess.left) {
+          fields >> codec;
+          sess.codec = sockets::codec(codec);
+          sessions[token] = sess;
+          session_order.push_back(token);
+        }
+
+      } else if (kind == "node") {
+        // Only the nodes still reached through a link we were handed.
+        std::string node, via, user;
+        origin known = {0, 0, {}, false, time(nullptr), {}};
+        if (not (fields >> node >> known.epoch >> known.seq >> known.complete
+                 >> via))
+          continue;
+        while (fields >> user) known.users.insert(user);
+
+        via = ',' + via + ',';
+        for (auto &it: chat_server) {
+          const auto link = dynamic_cast<peer_link *>(it.second);
+          if (link and link->linked() and
+              via.find(',' + link->node() + ',') != via.npos)
+            known.via.insert(link);
+        }
+        if (not known.via.empty()) origins[node] = known;
+
+      } else if (kind == "shared") {
+#ifdef HAVE_SHMRING
+        std::string token;
+        fields >> token;
+        for (auto &it: chat_server) {
+          const auto client = dynamic_cast<chat_client *>(it.second);
+          if (client and not token.empty() and client->token() == token)
+            client->share();
+        }
+#endif // HAVE_SHMRING
+
+      } else if (kind == "line") {
+        uint64_t seq;
+        std::string to, text;
+        if (fields >> seq >> to and fields.get() == ' ') {
+          if (to == "*") to.clear();
+          getline(fields, text);
+          recent.restore(seq, to, text);
+        }
+      }
+    }
+
+    // The clients handed to us carry on packing as they were.
+    for (auto &it: chat_server) {
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client) client->resumed();
+    }
+
+    syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO),
+           "Restored %lu sessions and %lu recent lines",
+           static_cast<unsigned long>(sessions.size()),
+           static_cast<unsigned long>(recent.size()));
+  }
+
+  /**************
+   * load_state *
+   **************/
+
+  void load_state() {
+    /* Pick up the state saved by the last server. It's only good once, a
+     * server that crashes later mustn't bring back old sessions.
+     */
+    const auto path = state_path();
+    std::ifstream in(path);
+    if (not in) return;
+
+    read_state(in);
+    unlink(path.c_str());
+  }
+
   /****************************************************************************
    * class chat_client
    */
@@ -197,19 +728,159 @@ namespace {
     std::clog << _name << " has joined the chat." << std::endl;
 #endif // DEBUG
 
+    /* Everyone is told about us when we first say something, unless it's
+     * to resume a session and nobody saw us leave.
+     */
+  }
+
+  /*************************
+   * chat_client::announce *
+   *************************/
+
+  void chat_client::announce() {
     /* Send out notices about the new connection if it is the users first
      * connection to the server. If there is already another connection don't
      * send this message, it gets way to spammy.
      */
-    if (connections(_name) == 1) {
-      for (auto &it: chat_server) {
-        static_cast<sockets::iostream &>(*it.second)
-          << _name << " has joined the chat." << std::endl;
-      }
+    _announced = true;
+    if (announced_connections(_name) == 1) {
+      broadcast(_name + " has joined the chat.");
+      federate('J', _name);
       ios << "? Type '/help' to get a list of chat commands." << std::endl;
     }
   }
 
+  /**********************
+   * chat_client::leave *
+   **********************/
+
+  void chat_client::leave() {
+    // Let everyone know if this was the users last connection.
+    if (_announced and announced_connections(_name) < 2) {
+      broadcast(_name + " has left the chat.");
+      federate('L', _name);
+
+      auto sess = sessions.find(_token);
+      if (sess != sessions.end()) sess->second.left = true;
+    }
+    _announced = false;
+  }
+
+  /***********************
+   * chat_client::resume *
+   ***********************/
+
+  void chat_client::resume(const std::string &token, uint64_t seq) {
+    /* Pick a session back up and send the lines missed since seq, the
+     * client is quietly back in the chat if nobody saw it leave.
+     */
+    auto sess = sessions.find(token);
+    if (sess == sessions.end() or sess->second.name != _name) {
+      if (not _announced) announce();
+      ios << "? Your session could not be resumed, "
+          << "messages sent while you were away are lost." << std::endl;
+      _token = new_session(_name);
+      ios << "% " << _token << ' ' << recent.last() << std::endl;
+      return;
+    }
+
+    _token = token;
+    _codec = sess->second.codec;
+
+    replay(seq + 1, recent.last());
+
+    if (sess->second.left) {
+      sess->second.left = false;
+      announce();
+    } else {
+      _announced = true;
+    }
+    ios << "% " << _token << ' ' << recent.last() << std::endl;
+  }
+
+  /***********************
+   * chat_client::replay *
+   ***********************/
+
+  void chat_client::replay(uint64_t from, uint64_t to) {
+    /* Send the lines numbered from to to again, the ones we may see. Lines
+     * too old to be kept are reported so the client knows what it lost.
+     */
+    if (from == 0) from = 1;
+    to = std::min(to, recent.last());
+    if (from > to) return;
+
+    if (from < recent.first()) {
+      ios << "? Lines " << from << " to " << std::min(to, recent.first() - 1)
+          << " are no longer kept." << std::endl;
+      from = recent.first();
+    }
+
+    std::string lines;
+    for (auto seq = from; seq <= to; seq++) {
+      const auto line = recent.find(seq);
+      if (line->to.empty() or line->to == _name) lines += format(*line, true);
+    }
+    send_bulk(lines);
+  }
+
+  /*********************
+   * chat_client::send *
+   *********************/
+
+  void chat_client::send(const backlog::line &line, packed_lines &packed) {
+    const auto text = format(line, false);
+    if (_codec == sockets::CODEC_NONE or
+        text.size() < sockets::pack_threshold) {
+      ios << text << std::flush;
+      return;
+    }
+
+    // A long line is packed once for everyone taking it the same way.
+    const auto key = std::make_pair(_codec, not _token.empty());
+    auto block = packed.find(key);
+    if (block == packed.end()) {
+      std::string out;
+      if (not sockets::pack_block(_codec, text, out)) out.clear();
+      block = packed.emplace(key, out).first;
+    }
+    ios << (block->second.empty() ? text : block->second) << std::flush;
+  }
+
+  /**************************
+   * chat_client::send_bulk *
+   **************************/
+
+  void chat_client::send_bulk(const std::string &text) {
+    // Many lines at once, packed if they're worth it.
+    std::string block;
+    if (sockets::pack_block(_codec, text, block)) ios << block;
+    else ios << text;
+    ios.flush();
+  }
+
+  /***********************
+   * chat_client::format *
+   ***********************/
+
+  std::string chat_client::format(const backlog::line &line,
+                                  bool numbered) const {
+    // Clients with a session number the lines so they can resume.
+    if (numbered or not _token.empty())
+      return '#' + std::to_string(line.seq) + ' ' + line.text + '\n';
+    return line.text + '\n';
+  }
+
+  /************************
+   * chat_client::resumed *
+   ************************/
+
+  void chat_client::resumed() {
+    // Pick up what our session says after we were handed over.
+    const auto sess = sessions.find(_token);
+    if (sess != sessions.end()) _codec = sess->second.codec;
+  }
+
   /*********************
    * chat_client::recv *
    *********************/
@@ -220,48 +891,114 @@ namespace {
 #endif // DEBUG
 
     std::string in;
+    bool cut;
 
-    while (getline(ios, in, '\n')) {
+    while (sockets::getline(ios, in, max_line - _partial.size(), cut)) {
+      if (not _partial.empty()) {
+        in.insert(0, _partial);
+        _partial.clear();
+      }
 
 #ifdef DEBUG
       std::clog << "From " << _name << ": " << in << std::endl;
 #endif // DEBUG
 
-      if (in[0] == '/') {
+      if (cut or _streaming or _skipping) {
+        // Some of a line too long to take at once.
+        piece(in, cut);
+
+      } else if (in[0] == '/') {
         // Parse the command sent.
         size_t pos = in.find(' ');
         std::string cmd(in.substr(1, in.npos));
         if (pos != in.npos) cmd = in.substr(1, pos - 1);
 
+        if (not _announced and cmd != "resume") announce();
+
         // Server side commands.
 
         if (cmd == "quit" or cmd == "exit") {
-          // Close the connection.
-          if (connections(_name) < 2) {
-            for (auto &it: chat_server) {
-              (sockets::iostream &)(*it.second) << _name
-                                                << " has left the chat."
-                                                << std::endl;
-            }
-          }
+          // Close the connection, the session is over.
+          leave();
+          sessions.erase(_token);
+          flush_output();
           ios.clear();
           this->close();
           return;
 
+        } else if (cmd == "session") {
+          // Start numbering our lines so the session can be resumed.
+          if (_token.empty()) _token = new_session(_name);
+          ios << "% " << _token << ' ' << recent.last() << std::endl;
+
+        } else if (cmd == "resume") {
+          // Resume a session, sending the lines after the one given.
+          std::istringstream args(pos != in.npos ? in.substr(pos + 1) : "");
+          std::string token;
+          uint64_t seq;
+          if (args >> token >> seq) {
+            resume(token, seq);
+          } else {
+            if (not _announced) announce();
+            ios << "? Invalid resume, the command is:\n"
+                << "? /resume token number" << std::endl;
+          }
+
+        } else if (cmd == "replay") {
+          // Send a range of lines again, up to the latest by default.
+          std::istringstream args(pos != in.npos ? in.substr(pos + 1) : "");
+          uint64_t from, to = recent.last();
+          if (args >> from) {
+            args >> to;
+            replay(from, to);
+          } else {
+            ios << "? Invalid replay, the command is:\n"
+                << "? /replay first [last]" << std::endl;
+          }
+
+#ifdef HAVE_SHMRING
+        } else if (cmd == "ring") {
+          // Read the lines for everyone from shared memory, or stop to.
+          if (pos != in.npos and in.substr(pos + 1) == "off")
+            _shared = _sharing = false;
+          else share();
+
+#endif // HAVE_SHMRING
+        } else if (cmd == "compress") {
+          // Pack bulk transfers with the first of the codecs we have.
+          std::istringstream args(pos != in.npos ? in.substr(pos + 1) : "");
+          std::string name;
+          _codec = sockets::CODEC_NONE;
+          while (_codec == sockets::CODEC_NONE and args >> name)
+            _codec = sockets::codec(name);
+
+          const auto sess = sessions.find(_token);
+          if (sess != sessions.end()) sess->second.codec = _codec;
+          ios << "$ " << sockets::codec_name(_codec) << std::endl;
+
         } else if (cmd == "who") {
-          // Request a list of connected users.
+          /* Request a list of the users in the chat, the same ones the
+           * other nodes are told about.
+           */
           std::string result;
-          std::set<std::string> people;
+          std::set<std::string> people(local_users());
 
-          // Use a std::set to prevent duplicates.
-          for (auto &it: chat_server) {
-            people.insert((dynamic_cast<chat_client *>(it.second))->name());
+          for (auto &it: origins) {
+            for (auto &user: it.second.users)
+              people.insert(user + '@' + it.first);
           }
           for (auto &it: people) {
             result += it + " ";
           }
           ios << "~ " << result << std::endl;
 
+        } else if (cmd == "ack") {
+          /* Lines are dispatched in the order they arrive, so answering
+           * the ack confirms everything sent before it was delivered.
+           */
+          ios << "= " << (pos != in.npos ? in.substr(pos + 1) : "")
+              << std::endl;
+
         } else if (cmd == "help") {
           // Help requested.
           ios << "? All server commands start with the '/' character.\n"
@@ -269,6 +1006,20 @@ namespace {
               << "? /who                   - Displays a list of all the users in "
               << "the chat.\n"
               << "? /quit or /exit         - Leaves the chat.\n"
+              << "? /ack id                - Answers '= id' once everything "
+              << "sent before it is delivered.\n"
+              << "? /session               - Numbers the chat lines and "
+              << "answers '% token number'.\n"
+              << "? /resume token number   - Resumes a session, sending the "
+              << "lines after number.\n"
+              << "? /replay first [last]   - Sends the numbered lines first "
+              << "to last again.\n"
+              << "? /compress codec...     - Packs bulk transfers with the "
+              << "first codec known, '$ codec'.\n"
+#ifdef HAVE_SHMRING
+              << "? /ring [off]            - Passes the shared memory the "
+              << "chat is read from, '& position'.\n"
+#endif // HAVE_SHMRING
               << "? /version or /about     - Version information about this "
               << "server.\n"
               << "? /msg user message...\n"
@@ -276,101 +1027,756 @@ namespace {
               << "? /query user message... - Sends a private message to user.\n"
               << std::endl;
 
-        } else if (cmd == "version" or cmd == "about") {
-          // Server information.
-          ios << "Local Chat Server v" << VERSION << "\n"
-              << "Copyright (c) 2018-2023 Ron R Wills <ron.rwsoft@gmail.com>\n"
-              << "License BSD: 3-Clause BSD License "
-              << "<https://opensource.org/licenses/BSD-3-Clause>.\n"
-              << "This is free software, you are free to change and "
-              << "redistribute it.\n"
-              << "There is NO WARRANTY, to the extent permitted by law."
-              << std::endl;
+        } else if (cmd == "version" or cmd == "about") {
+          // Server information.
+          ios << "Local Chat Server v" << VERSION << "\n"
+              << "Copyright (c) 2018-2023 Ron R Wills <ron.rwsoft@gmail.com>\n"
+              << "License BSD: 3-Clause BSD License "
+              << "<https://opensource.org/licenses/BSD-3-Clause>.\n"
+              << "This is free software, you are free to change and "
+              << "redistribute it.\n"
+              << "There is NO WARRANTY, to the extent permitted by law."
+              << std::endl;
+
+        } else if (cmd == "msg" or cmd == "priv" or cmd == "query") {
+          // Private message.
+          std::string pmesg(in.substr(pos + 1, in.npos));
+          size_t piv = pmesg.find(' ');
+
+          if (piv != pmesg.npos) {
+            send_private(pmesg.substr(0, piv), pmesg.substr(piv + 1,
+                                                            pmesg.npos));
+          } else {
+            ios << "? Invalid private message, the command is:\n"
+                << "? /" << cmd << " user message..." << std::endl;
+          }
+
+        } else {
+          ios << "? Unknown chat command '" << in << "'\n"
+              << "? Type '/help' to get a list of chat commands." << std::endl;
+        }
+
+      } else {
+        // A message for everyone to see.
+        if (not _announced) announce();
+        broadcast(_name + ": " + in);
+        federate('S', _name + ' ' + in);
+      }
+    }
+
+    flush_output();
+
+    if (ios.eof()) {
+      /* If the socket closed from the client side. The session is kept in
+       * case the client comes back.
+       */
+#ifdef DEBUG
+      std::clog << "Client closed the socket" << std::endl;
+#endif // DEBUG
+      leave();
+      flush_output();
+      ios.clear();
+      this->close();
+      return;
+
+    } else {
+      // ionotready will be thrown, so clear it and keep what we've got.
+      _partial += in;
+      ios.clear();
+    }
+  }
+
+  /*********************
+   * chat_client::save *
+   *********************/
+
+  std::string chat_client::save() const {
+    return _name + '\n' + _partial + '\n' + (_announced ? '+' : '-') +
+      _token;
+  }
+
+  /************************
+   * chat_client::restore *
+   ************************/
+
+  void chat_client::restore(const std::string &state) {
+    // The name, partial line, whether we were announced and our session.
+    std::istringstream in(state);
+    std::string flags;
+    getline(in, _name);
+    getline(in, _partial);
+    getline(in, flags);
+    _announced = (not flags.empty() and flags[0] == '+');
+    _token = flags.empty() ? "" : flags.substr(1);
+  }
+
+  /**********************
+   * chat_client::piece *
+   **********************/
+
+  void chat_client::piece(std::string &in, bool more) {
+    /* A line longer than max_line is passed on to everyone a piece at a
+     * time as it arrives, so it's never held whole. A command that long is
+     * refused.
+     */
+    if (not _streaming and not _skipping and in[0] == '/') {
+      if (not _announced) announce();
+      ios << "? The command is too long, the limit is " << max_line
+          << " bytes." << std::endl;
+      _skipping = true;
+    }
+    if (_skipping) {
+      _skipping = more;
+      return;
+    }
+
+    if (more) {
+      // A character cut in two starts the next piece.
+      auto end = in.size();
+      while (end > 0 and in.size() - end < 4 and (in[end - 1] & 0xc0) == 0x80)
+        end--;
+      if (end > 0 and (in[end - 1] & 0x80)) {
+        const auto lead = static_cast<unsigned char>(in[end - 1]);
+        const size_t len = (lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2);
+        if (in.size() - end + 1 < len) {
+          _partial = in.substr(end - 1);
+          in.erase(end - 1);
+        }
+      }
+    }
+    _streaming = more;
+    if (in.empty()) return;
+
+    if (not _announced) announce();
+    broadcast(_name + ": " + in);
+    federate('S', _name + ' ' + in);
+  }
+
+#ifdef HAVE_SHMRING
+  /**********************
+   * chat_client::share *
+   **********************/
+
+  void chat_client::share() {
+    if (ring == nullptr) {
+      _shared = false;
+      ios << "? Shared memory is not enabled on this server." << std::endl;
+      return;
+    }
+
+    /* The ring is passed along with where the next line will be written,
+     * it goes out after everything already sent to us. Output still
+     * waiting on the socket would arrive after it, so the ring waits for
+     * that to be sent first.
+     */
+    ios.flush();
+    if (ios and ios.queued()) {
+      _shared = false;
+      _sharing = ring_waiting = true;
+      return;
+    }
+
+    _sharing = false;
+    try {
+      sockets::send_fd(ios.socket(), ring->shared(),
+                       "& " + std::to_string(ring->head()) + '\n');
+      _shared = true;
+    } catch (std::exception &err) {
+      _shared = false;
+      ios << "? Unable to share memory: " << err.what() << std::endl;
+    }
+  }
+#endif // HAVE_SHMRING
+
+  /*****************************
+   * chat_client::send_private *
+   *****************************/
+
+  void chat_client::send_private(const std::string &who,
+                                const std::string &mesg) {
+    bool has_user = false;
+
+    for (auto &it: chat_server) {
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client and client->name() == who) {
+        has_user = true;
+        break;
+      }
+    }
+
+    if (has_user) {
+      /* Send the private message to all the users connections and to all
+       * our connections as well.
+       */
+      broadcast("! " + _name + ": " + mesg, who);
+      broadcast("! ^" + who + ": " + mesg, _name);
+    } else {
+      // If a message wasn't sent, send an error message our connections.
+      for (auto &it: chat_server) {
+        const auto client = dynamic_cast<chat_client *>(it.second);
+        if (client and client->name() == _name) {
+          static_cast<sockets::iostream &>(*it.second)
+            << "User " << who << " is not available, "
+            << "private message not sent:\n " << mesg << std::endl;
+        }
+      }
+    }
+  }
+
+  /***************
+   * peer_linked *
+   ***************/
+
+  bool peer_linked(size_t index) {
+    // Whether we're linked, or trying to link, to a peer we were given.
+    for (auto &it: chat_server) {
+      const auto link = dynamic_cast<peer_link *>(it.second);
+      if (link == nullptr) continue;
+
+      if (link->peer() == static_cast<int>(index) or
+          (not peers[index].node.empty() and
+           link->node() == peers[index].node))
+        return true;
+    }
+    return false;
+  }
+
+  /************
+   * schedule *
+   ************/
+
+  void schedule() {
+    // Wake up for the next heartbeat or the next peer to link to again.
+    const auto now = time(nullptr);
+    auto next = next_heartbeat;
+
+    for (size_t index = 0; index < peers.size(); index++)
+      if (not peer_linked(index)) next = std::min(next, peers[index].retry);
+
+    // Or to give up on a connect that is taking too long.
+    for (auto &it: chat_server) {
+      const auto link = dynamic_cast<peer_link *>(it.second);
+      if (link and link->connecting()) next = std::min(next, link->deadline());
+    }
+
+    alarm(next > now ? next - now : 1);
+  }
+
+  /****************************************************************************
+   * class peer_link
+   */
+
+  /*************************
+   * peer_link::~peer_link *
+   *************************/
+
+  peer_link::~peer_link() noexcept {
+    // A link handed to a new server isn't lost.
+    if (handed_off) return;
+
+    if (linked()) {
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Lost the link to %s",
+             _node.c_str());
+    }
+
+    /* The nodes we only reached through this link are gone as far as we
+     * know, and the other links are told. For the others we ask the links
+     * left if they still reach them some other way than through us.
+     */
+    std::vector<std::string> lost;
+    for (auto &it: origins) {
+      if (it.second.via.erase(this) == 0) continue;
+
+      if (it.second.via.empty()) {
+        lost.push_back(it.first);
+      } else {
+        for (auto link: it.second.via) link->write("X " + it.first);
+      }
+    }
+
+    for (auto &node: lost) {
+      forget(node);
+      relay("X " + node, this);
+    }
+    flush_output();
+
+    if (_peer >= 0) {
+      auto &to = peers[_peer];
+      to.retry = time(nullptr) + to.backoff;
+
+      // Waiting longer each time it doesn't get as far as saying hello.
+      if (not linked())
+        to.backoff = std::min(to.backoff * 2, peer_max_backoff);
+    }
+    if (tick_pipe[0] >= 0) schedule();
+  }
+
+  /*********************
+   * peer_link::dialed *
+   *********************/
+
+  void peer_link::dialed(int peer) {
+    _outgoing = true;
+    _peer = peer;
+    _connecting = true;
+    _deadline = time(nullptr) + peer_timeout;
+  }
+
+  /****************************
+   * peer_link::check_connect *
+   ****************************/
+
+  void peer_link::check_connect(time_t now) {
+    /* See if the connect we started has finished. Our hello was queued
+     * when we were dialed and goes out once it has, if it failed or is
+     * taking too long the link is dropped.
+     */
+    if (not _connecting) return;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(ios.socket(), reinterpret_cast<sockaddr *>(&addr),
+                    &addr_len) == 0) {
+      _connecting = false;
+      return;
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(ios.socket(), SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err == 0 and now < _deadline) return;
+
+    syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Unable to link to %s:%s: %s",
+           peers[_peer].host.c_str(), peers[_peer].service.c_str(),
+           strerror(err ? err : ETIMEDOUT));
+    _connecting = false;
+    ios.setstate(std::ios::badbit);
+  }
+
+  /********************
+   * peer_link::write *
+   ********************/
+
+  void peer_link::write(const std::string &frame) {
+    ios << frame << '\n';
+  }
+
+  /********************
+   * peer_link::flush *
+   ********************/
+
+  void peer_link::flush() {
+    ios.flush();
+  }
+
+  /********************
+   * peer_link::query *
+   ********************/
+
+  void peer_link::query() {
+    // Ask the node on the other end who is chatting on the nodes it knows.
+    write("Q");
+  }
+
+  /*******************
+   * peer_link::drop *
+   *******************/
+
+  void peer_link::drop() {
+    /* Close a link from outside its own input handling. Shutting the socket
+     * down has the server read the end of it and remove us as usual.
+     */
+    _node.clear();
+    ::shutdown(ios.socket(), SHUT_RDWR);
+  }
+
+  /**********************
+   * peer_link::connect *
+   **********************/
+
+  void peer_link::connect(int sockfd) {
+    (void)sockfd;
+    ios << "LCHAT-PEER 1 " << node_name << std::endl;
+  }
+
+  /********************
+   * peer_link::hello *
+   ********************/
+
+  void peer_link::hello(const std::string &node) {
+    if (node == node_name) {
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
+             "Refusing to link to ourself");
+      close();
+      return;
+    }
+
+    if (_peer >= 0) {
+      peers[_peer].node = node;
+      peers[_peer].backoff = 1;
+    }
+
+    /* Nodes that connected to each other at the same time, or a node we
+     * connected to again, keep a single link between them. Both ends keep
+     * the link started by the node whose name sorts first, or the older one
+     * if they both were.
+     */
+    const auto &starter = _outgoing ? node_name : node;
+    for (auto &it: chat_server) {
+      const auto other = dynamic_cast<peer_link *>(it.second);
+      if (other == nullptr or other == this or other->_node != node)
+        continue;
+
+      const auto &other_starter = other->_outgoing ? node_name : node;
+      if (other_starter <= starter) {
+        close();
+        return;
+      }
+
+      for (auto &known: origins)
+        if (known.second.via.erase(other)) known.second.via.insert(this);
+      other->drop();
+    }
+
+    _node = node;
+    syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Linked to %s", _node.c_str());
+    query();
+  }
+
+  /********************
+   * peer_link::frame *
+   ********************/
+
+  void peer_link::frame(const std::string &line) {
+    /* Frames are a letter followed by their fields.
+     *   LCHAT-PEER version node - Says hello.
+     *   S node epoch seq user text - A user said something.
+     *   J node epoch seq user - A user joined the chat.
+     *   L node epoch seq user - A user left the chat.
+     *   R node epoch seq users... - Everyone chatting on a node.
+     *   Q - Asks for R frames for all the nodes known.
+     *   X node - A node can't be reached through the sender anymore.
+     */
+    std::istringstream fields(line);
+    std::string kind, node;
+    fields >> kind;
+
+    if (kind == "LCHAT-PEER") {
+      int version;
+      if (not _node.empty() or not (fields >> version >> node)) {
+        close();
+        return;
+      }
+      hello(node);
+      return;
+    }
+
+    // Nothing else is taken from a node before it says hello.
+    if (_node.empty()) {
+      close();
+      return;
+    }
+
+    if (kind == "Q") {
+      write(snapshot(node_name));
+      for (auto &it: origins) {
+        const auto &via = it.second.via;
+        if (via.size() > 1 or via.count(this) == 0)
+          write(snapshot(it.first));
+      }
+      return;
+    }
+
+    if (kind == "X") {
+      if (not (fields >> node)) return;
+      const auto known = origins.find(node);
+      if (known == origins.end()) return;
+
+      known->second.via.erase(this);
+      if (known->second.via.empty()) {
+        // The sender too, it may have been asking if we still reach it.
+        forget(node);
+        relay(line);
+      } else {
+        // We can still reach it, so can the sender through us.
+        write(snapshot(node));
+      }
+      return;
+    }
+
+    uint64_t epoch, seq;
+    if (not (fields >> node >> epoch >> seq) or node == node_name) return;
 
-        } else if (cmd == "msg" or cmd == "priv" or cmd == "query") {
-          // Private message.
-          std::string pmesg(in.substr(pos + 1, in.npos));
-          size_t piv = pmesg.find(' ');
+    /* Drop anything we've already seen from the node, a line can come
+     * around a second time when the nodes are linked in a loop. A node that
+     * restarted starts numbering over with a newer epoch.
+     */
+    auto known = origins.find(node);
+    if (known == origins.end()) {
+      known = origins.insert({node, {epoch, seq, {}, false, 0, {}}}).first;
+    } else if (epoch > known->second.epoch or
+               (epoch == known->second.epoch and seq > known->second.seq)) {
+      if (epoch > known->second.epoch) known->second.via.clear();
+      known->second.epoch = epoch;
+      known->second.seq = seq;
+    } else if (not (kind == "R" and not known->second.complete and
+                    epoch == known->second.epoch and
+                    seq == known->second.seq)) {
+      // Seen it, but it shows we can reach the node through this link too.
+      if (epoch == known->second.epoch) known->second.via.insert(this);
+      return;
+    }
+    known->second.heard = time(nullptr);
+    known->second.via.insert(this);
+    relay(line, this);
+
+    auto &users = known->second.users;
+    std::string user;
+
+    if (kind == "S") {
+      std::string text;
+      if (fields >> user and fields.get() == ' ' and getline(fields, text))
+        broadcast(user + '@' + node + ": " + text);
+
+    } else if (kind == "J") {
+      if (fields >> user and users.insert(user).second)
+        broadcast(user + '@' + node + " has joined the chat.");
+
+    } else if (kind == "L") {
+      if (fields >> user and users.erase(user))
+        broadcast(user + '@' + node + " has left the chat.");
+
+    } else if (kind == "R") {
+      std::set<std::string> now;
+      while (fields >> user) now.insert(user);
+
+      for (auto &it: users)
+        if (now.count(it) == 0)
+          broadcast(it + '@' + node + " has left the chat.");
+      for (auto &it: now)
+        if (users.count(it) == 0)
+          broadcast(it + '@' + node + " has joined the chat.");
+      users.swap(now);
+      known->second.complete = true;
+    }
+  }
 
-          if (piv != pmesg.npos) {
-            send_private(pmesg.substr(0, piv), pmesg.substr(piv + 1,
-                                                            pmesg.npos));
-          } else {
-            ios << "? Invalid private message, the command is:\n"
-                << "? /" << cmd << " user message..." << std::endl;
-          }
+  /*******************
+   * peer_link::recv *
+   *******************/
 
-        } else {
-          ios << "? Unknown chat command '" << in << "'\n"
-              << "? Type '/help' to get a list of chat commands." << std::endl;
-        }
+  void peer_link::recv() {
+    std::string in;
+    bool cut;
 
-      } else {
-        // A message for everyone to see.
-        for (auto &it: chat_server) {
-          static_cast<sockets::iostream &>(*it.second)
-            << _name << ": " << in << std::endl;
+    // A connect that failed is reported as input.
+    check_connect(time(nullptr));
+    if (not ios) return;
+
+    while (sockets::getline(ios, in, max_line + frame_slack - _partial.size(),
+                            cut)) {
+      if (not _partial.empty()) {
+        in.insert(0, _partial);
+        _partial.clear();
+      }
+
+      if (cut or _skipping) {
+        // The nodes should agree on how long a line can be.
+        if (not _skipping) {
+          syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
+                 "Dropped a frame too long from %s", _node.c_str());
         }
+        _skipping = cut;
+        continue;
       }
-    }
 
-    if (ios.eof()) {
-      // If the socket closed from the client side.
 #ifdef DEBUG
-      std::clog << "Client closed the socket" << std::endl;
+      std::clog << "From node " << _node << ": " << in << std::endl;
 #endif // DEBUG
-      if (connections(_name) < 2) {
-        for (auto &it: chat_server) {
-          static_cast<sockets::iostream &>(*it.second)
-            << _name << " has left the chat." << std::endl;
-        }
-      }
+
+      frame(in);
+      if (not ios.is_open()) break;
+    }
+
+    // Everything the input caused goes out to the other links together.
+    flush_output();
+
+    if (ios.eof() or not ios.is_open()) {
       ios.clear();
       this->close();
-      return;
-
     } else {
-      // ionotready will be thrown, so clear it.
+      // ionotready will be thrown, so clear it and keep what we've got.
+      _partial += in;
       ios.clear();
     }
   }
 
-  /*****************************
-   * chat_client::send_private *
-   *****************************/
+  /*******************
+   * peer_link::save *
+   *******************/
 
-  void chat_client::send_private(const std::string &who,
-                                const std::string &mesg) {
-    bool has_user = false;
+  std::string peer_link::save() const {
+    return _node + '\n' + (_outgoing ? '+' : '-') + _partial;
+  }
 
-    // Send the private message to all the users connections.
-    for (auto &it: chat_server) {
-      if ((dynamic_cast<chat_client *>(it.second))->name() == who) {
-        static_cast<sockets::iostream &>(*it.second)
-          << "! " << _name << ": " << mesg << std::endl;
-        has_user = true;
+  /**********************
+   * peer_link::restore *
+   **********************/
+
+  void peer_link::restore(const std::string &state) {
+    const auto pos = state.find('\n');
+    _node = state.substr(0, pos);
+    if (pos == state.npos or pos + 1 >= state.size()) return;
+
+    _outgoing = (state[pos + 1] == '+');
+    _partial = state.substr(pos + 2);
+  }
+
+  /*****************
+   * resolve_peers *
+   *****************/
+
+  void resolve_peers() {
+    /* Look up where the peers are once, before we start. Looking them up
+     * while we're running would hold up the chat.
+     */
+    struct addrinfo hints;
+    struct addrinfo *info;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    for (auto &to: peers) {
+      const int res = getaddrinfo(to.host.c_str(), to.service.c_str(), &hints,
+                                  &info);
+      if (res != 0) {
+        throw std::runtime_error("Unable to find " + to.host + ":" +
+                                 to.service + ": " + gai_strerror(res));
       }
-    }
 
-    if (has_user) {
-      // If a message was sent, send in to all our connections as well.
-      for (auto &it: chat_server) {
-        if ((dynamic_cast<chat_client *>(it.second))->name() == _name) {
-          static_cast<sockets::iostream &>(*it.second)
-            << "! ^" << who << ": " << mesg << std::endl;
-        }
+      for (auto iter = info; iter != nullptr; iter = iter->ai_next) {
+        std::pair<sockaddr_storage, socklen_t> addr;
+        memset(&addr.first, 0, sizeof(addr.first));
+        memcpy(&addr.first, iter->ai_addr, iter->ai_addrlen);
+        addr.second = iter->ai_addrlen;
+        to.addrs.push_back(addr);
       }
-    } else {
-      // If a message wasn't sent, send an error message our connections.
-      for (auto &it: chat_server) {
-        if ((dynamic_cast<chat_client *>(it.second))->name() == _name) {
-          static_cast<sockets::iostream &>(*it.second)
-            << "User " << who << " is not available, "
-            << "private message not sent:\n " << mesg << std::endl;
+      freeaddrinfo(info);
+    }
+  }
+
+  /*************
+   * dial_peer *
+   *************/
+
+  int dial_peer(peer &to) {
+    /* Start connecting to another server without waiting on it, the link
+     * checks on it later. Each try is to the next of its addresses. Returns
+     * the socket or -1.
+     */
+    if (to.addrs.empty()) return -1;
+    const auto &addr = to.addrs[to.next_addr++ % to.addrs.size()];
+
+    int fd = socket(addr.first.ss_family,
+                    SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd != -1 and
+        ::connect(fd, reinterpret_cast<const sockaddr *>(&addr.first),
+                  addr.second) == -1 and errno != EINPROGRESS) {
+      const int err = errno;
+      ::close(fd);
+      fd = -1;
+      errno = err;
+    }
+
+    if (fd == -1) {
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO),
+             "Unable to link to %s:%s: %s",
+             to.host.c_str(), to.service.c_str(), strerror(errno));
+    }
+    return fd;
+  }
+
+  /**************
+   * dial_peers *
+   **************/
+
+  void dial_peers() {
+    // Link to the peers we aren't linked to and are due to try again.
+    const auto now = time(nullptr);
+
+    for (size_t index = 0; index < peers.size(); index++) {
+      auto &to = peers[index];
+      if (peer_linked(index) or to.retry > now) continue;
+
+      const int fd = dial_peer(to);
+      if (fd >= 0) {
+        const auto link = dynamic_cast<peer_link *>(chat_server.add(fd));
+        if (link) {
+          link->dialed(index);
+          continue;
         }
       }
+
+      to.retry = now + to.backoff;
+      to.backoff = std::min(to.backoff * 2, peer_max_backoff);
+    }
+  }
+
+  /*************
+   * heartbeat *
+   *************/
+
+  void heartbeat() {
+    /* Tell the other nodes who is chatting here, which also keeps them from
+     * forgetting us, and forget the nodes we haven't heard from.
+     */
+    const auto now = time(nullptr);
+    if (now < next_heartbeat) return;
+    next_heartbeat = now + heartbeat_interval;
+
+    std::string users;
+    for (auto &user: local_users()) users += ' ' + user;
+    federate('R', users.empty() ? users : users.substr(1));
+
+    std::vector<std::string> silent;
+    for (auto &it: origins)
+      if (now - it.second.heard > 3 * heartbeat_interval)
+        silent.push_back(it.first);
+    for (auto &node: silent) forget(node);
+  }
+
+  /********
+   * tick *
+   ********/
+
+  void tick() {
+    const auto now = time(nullptr);
+    for (auto &it: chat_server) {
+      const auto link = dynamic_cast<peer_link *>(it.second);
+      if (link) link->check_connect(now);
+    }
+
+    dial_peers();
+    heartbeat();
+    flush_output();
+    schedule();
+  }
+
+#ifdef HAVE_SHMRING
+  /**************
+   * pass_rings *
+   **************/
+
+  void pass_rings() {
+    // Pass the ring to the clients that were waiting on their output.
+    ring_waiting = false;
+    for (auto &it: chat_server) {
+      const auto client = dynamic_cast<chat_client *>(it.second);
+      if (client and client->sharing()) client->share();
     }
   }
+#endif // HAVE_SHMRING
 
   /*******************
    * test_for_server *
@@ -457,6 +1863,251 @@ namespace {
     }
   }
 
+  /****************************************************************************
+   * class chat_dispatcher
+   */
+
+  /***********************************
+   * chat_dispatcher::new_connection *
+   ***********************************/
+
+  sockets::connection *chat_dispatcher::new_connection(int sockfd) {
+    // Users connect over the unix socket, anything else is another server.
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(sockfd, reinterpret_cast<sockaddr *>(&addr), &len) == 0
+        and addr.ss_family != AF_UNIX)
+      return new peer_link(sockfd);
+    return new chat_client(sockfd);
+  }
+
+  /**************************
+   * chat_dispatcher::event *
+   **************************/
+
+  void chat_dispatcher::event(int fd) {
+    if (fd == tick_pipe[0]) {
+      // Time for a heartbeat or to link to the peers that are missing.
+      char buffer[16];
+      while (read(tick_pipe[0], buffer, sizeof(buffer)) > 0) {}
+      tick();
+      return;
+    }
+
+    /* A new server is asking to take over the chat. Only root or the user
+     * we started as may do this.
+     */
+    if (fd != takeover_fd) return;
+
+    const int ctlfd = ::accept(takeover_fd, nullptr, nullptr);
+    if (ctlfd < 0) return;
+
+    try {
+      const auto uid = peer_uid(ctlfd);
+      if (uid != 0 and uid != getuid()) {
+        syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
+               "Takeover refused for uid %d", uid);
+        ::close(ctlfd);
+        return;
+      }
+
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO),
+             "Handing %lu connections over to the new server",
+             static_cast<unsigned long>(connections()));
+#ifdef DEBUG
+      std::clog << "Handing the chat over to the new server" << std::endl;
+#endif // DEBUG
+
+      /* Our control socket is kept until the handoff is done, in case it
+       * fails. The new server replaces it with its own afterwards.
+       */
+      unwatch(takeover_fd);
+
+      handed_off = true;
+      handoff(ctlfd);
+      running = false;
+
+      ::close(takeover_fd);
+      takeover_fd = -1;
+
+    } catch (std::exception &err) {
+      handed_off = false;
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_ERR), "Takeover failed: %s",
+             err.what());
+#ifdef DEBUG
+      std::cerr << "Takeover failed: " << err.what() << std::endl;
+#endif // DEBUG
+
+      // We still have the chat, so we can still be taken over.
+      watch(takeover_fd);
+    }
+
+    ::close(ctlfd);
+  }
+
+  /*************************
+   * chat_dispatcher::save *
+   *************************/
+
+  std::string chat_dispatcher::save() const {
+    // The new server picks up the sessions along with the clients.
+    std::ostringstream out;
+    write_state(out);
+    return out.str();
+  }
+
+  /****************************
+   * chat_dispatcher::restore *
+   ****************************/
+
+  void chat_dispatcher::restore(const std::string &state) {
+    std::istringstream in(state);
+    read_state(in);
+  }
+
+  /************************
+   * open_takeover_socket *
+   ************************/
+
+  void open_takeover_socket() {
+    /*  Create the control socket a new server connects to when it wants to
+     * take over the chat from us.
+     */
+    struct sockaddr_un addr;
+    const auto path = takeover_path();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    takeover_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (takeover_fd < 0) {
+      throw std::runtime_error(
+        std::string("Unable to create takeover socket: ") + strerror(errno));
+    }
+
+    // Any control socket left here is from a server that is long gone.
+    unlink(path.c_str());
+    if (bind(takeover_fd, reinterpret_cast<const sockaddr *>(&addr),
+             sizeof(addr)) == -1 or
+        chmod(path.c_str(), S_IRUSR | S_IWUSR) == -1 or
+        listen(takeover_fd, 1) == -1) {
+      close(takeover_fd);
+      takeover_fd = -1;
+      throw std::runtime_error(std::string("Unable to bind to ") + path +
+                               ": " + strerror(errno));
+    }
+
+    chat_server.watch(takeover_fd);
+  }
+
+  /********************
+   * request_takeover *
+   ********************/
+
+  bool request_takeover() {
+    /*  Connect to a running server and receive its listening socket and all
+     * its connected clients. Returns false if there is no server to take
+     * over from.
+     */
+    struct sockaddr_un addr;
+    const auto path = takeover_path();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    const int ctlfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (ctlfd < 0) {
+      throw std::runtime_error(
+        std::string("Unable to create takeover socket: ") + strerror(errno));
+    }
+
+    if (connect(ctlfd, reinterpret_cast<const sockaddr *>(&addr),
+                sizeof(addr)) == -1) {
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
+             "No server to take over from: %s", strerror(errno));
+#ifdef DEBUG
+      std::cerr << "No server to take over from: " << strerror(errno)
+                << std::endl;
+#endif // DEBUG
+      close(ctlfd);
+      return false;
+    }
+
+    try {
+      chat_server.takeover(ctlfd);
+    } catch (...) {
+      close(ctlfd);
+      throw;
+    }
+    close(ctlfd);
+
+    // We don't know what the old server knew of the other nodes, ask again.
+    for (auto &it: chat_server) {
+      const auto link = dynamic_cast<peer_link *>(it.second);
+      if (link and link->linked()) link->query();
+    }
+    flush_output();
+
+    syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO),
+           "Took over %lu connections",
+           static_cast<unsigned long>(chat_server.connections()));
+#ifdef DEBUG
+    std::clog << "Took over " << chat_server.connections() << " connections"
+              << std::endl;
+#endif // DEBUG
+
+    return true;
+  }
+
+  /**************
+   * listen_fds *
+   **************/
+
+  int listen_fds() {
+    /*  Check if a service manager, like systemd, has passed us an already
+     * listening socket. This follows the sd_listen_fds protocol, the
+     * descriptors start at 3 and the environment tells us how many there
+     * are and which process they are meant for. Returns the socket or -1 if
+     * there isn't one.
+     */
+    const int listen_fds_start = 3;
+
+    const char *pid_env = getenv("LISTEN_PID");
+    const char *fds_env = getenv("LISTEN_FDS");
+    if (pid_env == nullptr or fds_env == nullptr) return -1;
+
+    const auto pid = strtol(pid_env, nullptr, 10);
+    const auto fds = strtol(fds_env, nullptr, 10);
+
+    // Don't pass these on to anything we might start.
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    if (pid != getpid() or fds < 1) return -1;
+    if (fds > 1) {
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
+             "Received %ld sockets, only using the first", fds);
+    }
+
+    for (int fd = listen_fds_start; fd < listen_fds_start + fds; ++fd)
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Use the socket's real path so the takeover socket sits beside it.
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(listen_fds_start, reinterpret_cast<sockaddr *>(&addr),
+                    &len) == 0 and addr.sun_family == AF_UNIX and
+        addr.sun_path[0] != '\0') {
+      sock_path = addr.sun_path;
+    }
+
+    return listen_fds_start;
+  }
+
   /**********
    * daemon *
    **********/
@@ -533,7 +2184,8 @@ namespace {
            group_entry->gr_gid, group_name.c_str());
 
     // Change the group ownership of the Unix domain socket.
-    if (chown(sock_path.c_str(), -1, group_entry->gr_gid) == -1) {
+    if (not socket_activated and
+        chown(sock_path.c_str(), -1, group_entry->gr_gid) == -1) {
       throw std::runtime_error(
                                std::string("Failed to change socket group: ") +
                                strerror(errno));
@@ -571,7 +2223,8 @@ namespace {
            "Changing to user %d/%s", user_entry->pw_uid, user_name.c_str());
 
     // Change the ownership of the Unix domain socket.
-    if (chown(sock_path.c_str(), user_entry->pw_uid, -1) == -1) {
+    if (not socket_activated and
+        chown(sock_path.c_str(), user_entry->pw_uid, -1) == -1) {
       /* We don't consider a failure here unrecoverable but we do log the
        * fact we could change groups.
        */
@@ -613,7 +2266,34 @@ namespace {
 #endif
       running = false;
       break;
+    case SIGALRM:
+      // Wake the main loop for the linked servers.
+      if (write(tick_pipe[1], "", 1) == -1) {}
+      break;
+    }
+  }
+
+  /*****************
+   * split_address *
+   *****************/
+
+  bool split_address(const std::string &address, std::string &host,
+                     std::string &service) {
+    /* Split host:port, the host may be an IPv6 address in brackets. Returns
+     * false if there is no host.
+     */
+    const auto pos = address.rfind(':');
+    if (pos == address.npos) {
+      host.clear();
+      service = address;
+      return false;
     }
+
+    host = address.substr(0, pos);
+    service = address.substr(pos + 1);
+    if (host.size() > 1 and host.front() == '[' and host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+    return not host.empty();
   }
 
   /***********
@@ -635,9 +2315,12 @@ namespace {
 
   static void help() {
     std::cout << "Local Chat Dispatcher v" VERSION << "\n"
-              << "  lchatd [-d|--daemon] [-s|--socket path]\n"
+              << "  lchatd [-d|--daemon] [-t|--takeover] [-s|--socket path]\n"
               << "         [-u|--user user] [-g|--group group]\n"
-              << "         [-w|--working-directory path]\n"
+              << "         [-w|--working-directory path] [-k|--keep lines]\n"
+              << "         [-m|--max-line bytes]\n"
+              << "         [-n|--node name] [-l|--listen [host:]port]\n"
+              << "         [-p|--peer host:port]... [-r|--ring kilobytes]\n"
               << "  lchatd -V|--version\n"
               << "  lchatd -h|--help\n\n"
               << "Copyright © 2018-2019 Ron R Wills <ron@digitalcombine.ca>.\n"
@@ -653,10 +2336,17 @@ namespace {
 
   struct option longopts[] = {
     {"daemon",            no_argument,       nullptr, 'd' },
+    {"takeover",          no_argument,       nullptr, 't' },
     {"socket",            required_argument, nullptr, 's' },
     {"user",              required_argument, nullptr, 'u' },
     {"group",             required_argument, nullptr, 'g' },
     {"working-directory", required_argument, nullptr, 'w' },
+    {"keep",              required_argument, nullptr, 'k' },
+    {"node",              required_argument, nullptr, 'n' },
+    {"listen",            required_argument, nullptr, 'l' },
+    {"max-line",          required_argument, nullptr, 'm' },
+    {"peer",              required_argument, nullptr, 'p' },
+    {"ring",              required_argument, nullptr, 'r' },
     {"version",           no_argument,       nullptr, 'V' },
     {"help",              no_argument,       nullptr, 'h' },
     {nullptr,             0,                 nullptr, 0}
@@ -669,10 +2359,12 @@ namespace {
 
 int main(int argc, char *argv[]) noexcept {
   bool fork_daemon = false;
+  bool takeover = false;
+  std::string listen_host, listen_service;
 
   // Get the command line options.
   int opt;
-  while ((opt = getopt_long(argc, argv, "dg:s:w:u:Vh?", longopts,
+  while ((opt = getopt_long(argc, argv, "dg:k:l:m:n:p:r:s:tw:u:Vh?", longopts,
                             nullptr)) != -1) {
     switch (opt) {
     case 'd':
@@ -685,9 +2377,71 @@ int main(int argc, char *argv[]) noexcept {
     case 'h':
       help();
       return EXIT_SUCCESS;
+    case 'k': {
+      const auto lines = atol(optarg);
+      if (lines <= 0) {
+        std::cerr << "Invalid number of lines to keep \"" << optarg << "\""
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      recent.resize(lines);
+      break;
+    }
+    case 'l':
+      // Links aren't authenticated, so only take them from this host unless
+      // told otherwise.
+      if (not split_address(optarg, listen_host, listen_service))
+        listen_host = "127.0.0.1";
+      break;
+    case 'm': {
+      const auto bytes = atol(optarg);
+      if (bytes < 256) {
+        std::cerr << "Invalid line length \"" << optarg
+                  << "\", at least 256 bytes" << std::endl;
+        return EXIT_FAILURE;
+      }
+      max_line = bytes;
+      break;
+    }
+    case 'n':
+      node_name = optarg;
+      if (node_name.empty() or
+          node_name.find_first_of(" \t\n") != node_name.npos) {
+        std::cerr << "Invalid node name \"" << optarg << "\"" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'p': {
+      peer to = {"", "", "", 0, 1, {}, 0};
+      if (not split_address(optarg, to.host, to.service)) {
+        std::cerr << "Invalid peer \"" << optarg << "\", expected host:port"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      peers.push_back(to);
+      break;
+    }
+    case 'r': {
+#ifdef HAVE_SHMRING
+      const auto kbytes = atol(optarg);
+      if (kbytes < 16) {
+        std::cerr << "Invalid shared memory size \"" << optarg
+                  << "\", at least 16 kilobytes" << std::endl;
+        return EXIT_FAILURE;
+      }
+      ring_size = static_cast<size_t>(kbytes) * 1024;
+#else
+      std::cerr << "Shared memory isn't supported by this build" << std::endl;
+      return EXIT_FAILURE;
+#endif // HAVE_SHMRING
+      break;
+    }
     case 's':
       sock_path = optarg;
       break;
+    case 't':
+      takeover = true;
+      break;
     case 'u':
       chat_user = optarg;
       break;
@@ -719,7 +2473,49 @@ int main(int argc, char *argv[]) noexcept {
     if (fork_daemon) daemon();
     else umask(0117);
 
-    open_unix_socket();
+#ifdef HAVE_SHMRING
+    // Before taking over, the clients of the old server are offered it.
+    if (ring_size > 0) ring = new shmring(ring_size);
+#endif // HAVE_SHMRING
+
+    // Before taking over too, so not finding a peer doesn't lose the chat.
+    resolve_peers();
+
+    /* Use the socket handed to us by the service manager, take over from
+     * a running server or create our own socket.
+     */
+    const int activated_fd = listen_fds();
+    if (activated_fd >= 0) {
+      chat_server.attach(activated_fd);
+      socket_activated = true;
+      syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO),
+             "Using socket passed by the service manager");
+    } else if (not takeover or not request_takeover()) {
+      open_unix_socket();
+    }
+    open_takeover_socket();
+    load_state();
+
+    // Link with other servers, before giving up root for a low port.
+    if (not listen_service.empty()) {
+      chat_server.listen(listen_host == "*" ? nullptr : listen_host.c_str(),
+                         listen_service.c_str());
+    }
+    if (not listen_service.empty() or not peers.empty()) {
+      if (node_name.empty()) {
+        char hostname[256] = "";
+        gethostname(hostname, sizeof(hostname) - 1);
+        node_name = hostname;
+      }
+      node_epoch = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+      if (pipe2(tick_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        throw std::runtime_error(std::string("Unable to create pipe: ") +
+                                 strerror(errno));
+      }
+      chat_server.watch(tick_pipe[0]);
+    }
 
     // Change the group of the socket and of us.
     if (not chat_group.empty())
@@ -745,6 +2541,7 @@ int main(int argc, char *argv[]) noexcept {
   signal(SIGINT,  sig_handler);
   signal(SIGTERM, sig_handler);
   signal(SIGHUP,  sig_handler);
+  signal(SIGALRM, sig_handler);
   // Needed for clients that suddenly disconnect.
   signal(SIGPIPE, SIG_IGN);
 
@@ -756,19 +2553,37 @@ int main(int argc, char *argv[]) noexcept {
             << sock_path << std::endl;
 #endif // DEBUG
 
+  if (tick_pipe[0] >= 0) tick();
+
   // The main loop.
   while (running) {
     chat_server.process_requests();
+#ifdef HAVE_SHMRING
+    if (ring_waiting) pass_rings();
+#endif // HAVE_SHMRING
   }
 
   // Cleanup.
+  if (handed_off) {
+    // The socket now belongs to the new server.
+    syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO),
+           "Local chat service handed off");
+    closelog();
+    return EXIT_SUCCESS;
+  }
+
   syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), "Cleaning up local chat service");
   chat_server.close();
   if (setuid(saved_uid) == -1) {
     syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_NOTICE),
            "Unable to restore UID: %s", strerror(errno));
   }
-  if (unlink(sock_path.c_str()) == -1) {
+  save_state();
+  if (takeover_fd >= 0) {
+    close(takeover_fd);
+    unlink(takeover_path().c_str());
+  }
+  if (not socket_activated and unlink(sock_path.c_str()) == -1) {
     syslog(LOG_MAKEPRI(LOG_DAEMON, LOG_WARNING),
            "Failed to clean up socket %s: %s",
            sock_path.c_str(),
@@ -32,6 +32,9 @@
  */
 
 #include "nstream"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 #include <cerrno>
 #include <cstring>
@@ -43,6 +46,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstdio>
+#include <list>
+
+#include <algorithm>
+#include <cstdint>
 
 //#define DEBUG_NSTREAM 1
 #ifdef DEBUG_NSTREAM
@@ -109,6 +116,176 @@ sockets::ionotready::ionotready () noexcept {
 sockets::ionotready::~ionotready() noexcept {
 }
 
+/******************************************************************************
+ * File descriptor passing
+ */
+
+namespace {
+  /*******************
+   * set_nonblocking *
+   *******************/
+
+  void set_nonblocking(int fd) {
+    auto flags = fcntl(fd, F_GETFL, 0);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      throw sockets::exception(std::string("Setting nonblocking failed: ") +
+                               strerror(errno));
+  }
+
+  /***************
+   * pack/unpack *
+   ***************/
+
+  void pack(std::string &buffer, const std::string &value) {
+    /* Append a length prefixed string to the buffer.
+     */
+    uint32_t len = static_cast<uint32_t>(value.size());
+    buffer.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    buffer.append(value);
+  }
+
+  std::string unpack(const std::string &buffer, size_t &pos) {
+    uint32_t len;
+    if (pos + sizeof(len) > buffer.size())
+      throw sockets::exception("Malformed handoff record");
+    memcpy(&len, buffer.data() + pos, sizeof(len));
+    pos += sizeof(len);
+
+    if (pos + len > buffer.size())
+      throw sockets::exception("Malformed handoff record");
+    std::string result(buffer, pos, len);
+    pos += len;
+    return result;
+  }
+
+  /* The largest handoff record we'll accept. Unsent output is split into
+   * records this size, well inside the control socket's send buffer.
+   */
+  const size_t max_record = 65536;
+}
+
+/********************
+ * sockets::send_fd *
+ ********************/
+
+void sockets::send_fd(int sockfd, int fd, const std::string &data) {
+  struct msghdr msg;
+  struct iovec iov;
+  char ctrl[CMSG_SPACE(sizeof(int))];
+  char empty = '\0';
+
+  memset(&msg, 0, sizeof(msg));
+  memset(ctrl, 0, sizeof(ctrl));
+
+  // At least one byte of real data has to be sent with the descriptor.
+  if (data.empty()) {
+    iov.iov_base = &empty;
+    iov.iov_len = 1;
+  } else {
+    iov.iov_base = const_cast<char *>(data.data());
+    iov.iov_len = data.size();
+  }
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (fd >= 0) {
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) < 0)
+    throw sockets::exception(std::string("Unable to pass descriptor: ") +
+                             strerror(errno));
+}
+
+/********************
+ * sockets::recv_fd *
+ ********************/
+
+bool sockets::recv_fd(int sockfd, int &fd, std::string &data) {
+  struct msghdr msg;
+  struct iovec iov;
+  char ctrl[CMSG_SPACE(sizeof(int))];
+  std::vector<char> buffer(max_record);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &buffer.front();
+  iov.iov_len = buffer.size();
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  fd = -1;
+  auto res = recvmsg(sockfd, &msg, 0);
+  if (res < 0)
+    throw sockets::exception(std::string("Unable to receive descriptor: ") +
+                             strerror(errno));
+  if (res == 0) return false;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    if (fd >= 0) ::close(fd);
+    throw sockets::exception("Handoff record was truncated");
+  }
+
+  data.assign(&buffer.front(), res);
+  return true;
+}
+
+/********************
+ * sockets::getline *
+ ********************/
+
+std::istream &sockets::getline(std::istream &ios, std::string &line,
+                               size_t max, bool &cut, char delim) {
+  typedef std::istream::traits_type traits;
+
+  line.clear();
+  cut = false;
+
+  std::istream::sentry ready(ios, true);
+  if (not ready) return ios;
+
+  auto state = std::ios::goodbit;
+  try {
+    auto buf = ios.rdbuf();
+    for (;;) {
+      const auto ch = buf->sbumpc();
+      if (traits::eq_int_type(ch, traits::eof())) {
+        state |= (line.empty() ? std::ios::eofbit | std::ios::failbit
+                               : std::ios::eofbit);
+        break;
+      }
+      if (traits::to_char_type(ch) == delim) break;
+
+      line.push_back(traits::to_char_type(ch));
+      if (line.size() >= max) {
+        cut = true;
+        break;
+      }
+    }
+  } catch (...) {
+    // Like the standard streams, the exception is only passed on if asked.
+    if (ios.exceptions() & std::ios::badbit) throw;
+    state |= std::ios::badbit;
+  }
+
+  ios.setstate(state);
+  return ios;
+}
+
 /******************************************************************************
  * class sockets::socketbuf
  */
@@ -119,7 +296,8 @@ sockets::ionotready::~ionotready() noexcept {
 
 sockets::socketbuf::socketbuf(size_t buffer)
   : _fd(-1), _rflags(0), _sflags(0), _obuf(buffer), _ibuf(buffer),
-    _notready(false) {
+    _notready(false), _keep_fds(false), _unpack(false), _bol(true),
+    _uring(nullptr), _hangup(false) {
 
   // Setup the stream buffers.
   char *end = &_ibuf.front() + _ibuf.size();
@@ -131,7 +309,8 @@ sockets::socketbuf::socketbuf(size_t buffer)
 
 sockets::socketbuf::socketbuf(int sockfd, size_t buffer)
   : _fd(sockfd), _rflags(0), _sflags(0), _obuf(buffer), _ibuf(buffer),
-    _notready(false) {
+    _notready(false), _keep_fds(false), _unpack(false), _bol(true),
+    _uring(nullptr), _hangup(false) {
   // Setup the stream buffers.
   char *end = &_ibuf.front() + _ibuf.size();
   setg(end, end, end);
@@ -218,9 +397,12 @@ sockets::socketbuf *sockets::socketbuf::open(const std::string &filename) {
   strncpy(addr.sun_path, filename.c_str(), sizeof(addr.sun_path) - 1);
   if (connect(_fd, reinterpret_cast<struct sockaddr *>(&addr),
               sizeof(struct sockaddr_un)) < 0) {
+    const int err = errno;
+    ::close(_fd);
+    _fd = -1;
     throw sockets::exception(
       std::string("Unable to connect to unix domain socket ") +
-      filename + ": " + strerror(errno));
+      filename + ": " + strerror(err));
   }
 
   return this;
@@ -236,6 +418,46 @@ void sockets::socketbuf::close() {
     ::close(_fd);
   }
   _fd = -1;
+  _pending.clear();
+
+  for (auto fd: _fds) ::close(fd);
+  _fds.clear();
+
+  _bol = true;
+  _block.clear();
+  _unpacked.clear();
+
+  // Reset the stream buffers.
+  char *end = &_ibuf.front() + _ibuf.size();
+  setg(end, end, end);
+
+  char *base = &_obuf.front();
+  setp(base, base + _obuf.size() - 1);
+}
+
+/******************************
+ * sockets::socketbuf::unsent *
+ ******************************/
+
+void sockets::socketbuf::unsent(std::string &input,
+                                std::string &output) const {
+  input.assign(gptr(), egptr());
+  output = _pending;
+  output.append(pbase(), pptr());
+}
+
+/*******************************
+ * sockets::socketbuf::release *
+ *******************************/
+
+int sockets::socketbuf::release(std::string &input, std::string &output) {
+  input.assign(gptr(), egptr());
+  output.swap(_pending);
+  output.append(pbase(), pptr());
+  _pending.clear();
+
+  auto fd = _fd;
+  _fd = -1;
 
   // Reset the stream buffers.
   char *end = &_ibuf.front() + _ibuf.size();
@@ -243,6 +465,44 @@ void sockets::socketbuf::close() {
 
   char *base = &_obuf.front();
   setp(base, base + _obuf.size() - 1);
+
+  return fd;
+}
+
+/*******************************
+ * sockets::socketbuf::restore *
+ *******************************/
+
+void sockets::socketbuf::restore(const std::string &input,
+                                 const std::string &output) {
+  if (not input.empty()) {
+    if (input.size() > _ibuf.size()) _ibuf.resize(input.size());
+    std::copy(input.begin(), input.end(), _ibuf.begin());
+    setg(&_ibuf.front(), &_ibuf.front(), &_ibuf.front() + input.size());
+  }
+
+  if (not output.empty()) sputn(output.data(), output.size());
+}
+
+/*******************************
+ * sockets::socketbuf::deliver *
+ *******************************/
+
+void sockets::socketbuf::deliver(const char *data, size_t len) {
+  /* Append input received elsewhere to any input we haven't read yet.
+   */
+  const size_t avail = static_cast<size_t>(egptr() - gptr());
+
+  if (avail + len > _ibuf.size()) {
+    std::vector<char> buffer(avail + len);
+    std::copy(gptr(), egptr(), buffer.begin());
+    _ibuf.swap(buffer);
+  } else if (avail > 0 and gptr() != &_ibuf.front()) {
+    std::memmove(&_ibuf.front(), gptr(), avail);
+  }
+
+  std::copy(data, data + len, _ibuf.begin() + avail);
+  setg(&_ibuf.front(), &_ibuf.front(), &_ibuf.front() + avail + len);
 }
 
 /********************************
@@ -275,45 +535,114 @@ int sockets::socketbuf::sync() {
 
 sockets::socketbuf::int_type sockets::socketbuf::underflow() {
   if (gptr() >= egptr()) {
+    // Input is being delivered to us, see if there's more on the way.
+    if (_hangup) return traits_type::eof();
+    if (_uring) throw sockets::ionotready();
+
     // The buffer has been exhausted, read more in from the socket.
-    auto res = recv(_fd, &_ibuf.front(), _ibuf.size(), _rflags);
+    do {
+      auto res = (_keep_fds ? recv_keeping_fds() :
+                  recv(_fd, &_ibuf.front(), _ibuf.size(), _rflags));
 
-    if (res == 0) {
-      // End of file, usually it was disconnected.
+      if (res == 0) {
+        // End of file, usually it was disconnected.
 #ifdef DEBUG_NSTREAM
-      std::clog << "sockbuf::underflow eof" << std::endl;
+        std::clog << "sockbuf::underflow eof" << std::endl;
 #endif
-      return traits_type::eof();
+        return traits_type::eof();
 
-    } else if (res < 0) {
-      if (errno == EAGAIN or errno == EWOULDBLOCK) {
-        /*  If the socket is non-blocking then we can try again to read
-         * the socket or throw an ionotready exception.
-         */
+      } else if (res < 0) {
+        if (errno == EAGAIN or errno == EWOULDBLOCK) {
+          /*  If the socket is non-blocking then we can try again to read
+           * the socket or throw an ionotready exception.
+           */
 #ifdef DEBUG_NSTREAM
-        std::clog << "sockbuf::underflow eagain" << std::endl;
+          std::clog << "sockbuf::underflow eagain" << std::endl;
 #endif
-        throw sockets::ionotready();
-      } else {
+          throw sockets::ionotready();
+        } else {
 #ifdef DEBUG_NSTREAM
-        std::clog << "sockbuf::underflow: " << strerror(errno) << std::endl;
+          std::clog << "sockbuf::underflow: " << strerror(errno) << std::endl;
 #endif
-        // We got an io error.
-        throw sockets::exception((std::string("Socket read error: ") +
-                                  strerror(errno)));
+          // We got an io error.
+          throw sockets::exception((std::string("Socket read error: ") +
+                                    strerror(errno)));
+        }
       }
-    }
 
 #ifdef DEBUG_NSTREAM
-    std::clog << "sockbuf::underflow: " << res << " bytes" << std::endl;
+      std::clog << "sockbuf::underflow: " << res << " bytes" << std::endl;
 #endif
-    // Update the buffer.
-    setg(&_ibuf.front(), &_ibuf.front(), &_ibuf.front() + res);
+      if (not _unpack) {
+        // Update the buffer.
+        setg(&_ibuf.front(), &_ibuf.front(), &_ibuf.front() + res);
+
+      } else {
+        /* Read from the input with its blocks unpacked. There's nothing
+         * to read yet if all that came was some of a block.
+         */
+        _unpacked.clear();
+        decode(&_ibuf.front(), res);
+        if (not _unpacked.empty()) {
+          char *start = &_unpacked.front();
+          setg(start, start, start + _unpacked.size());
+        }
+      }
+    } while (gptr() >= egptr());
   }
 
   return traits_type::to_int_type(*gptr());
 }
 
+/****************************************
+ * sockets::socketbuf::recv_keeping_fds *
+ ****************************************/
+
+ssize_t sockets::socketbuf::recv_keeping_fds() {
+  // Read like recv, keeping any descriptors passed with the input.
+  const size_t max_fds = 4;
+  struct msghdr msg;
+  struct iovec iov;
+  char ctrl[CMSG_SPACE(max_fds * sizeof(int))];
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &_ibuf.front();
+  iov.iov_len = _ibuf.size();
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  const auto res = recvmsg(_fd, &msg, _rflags | MSG_CMSG_CLOEXEC);
+  if (res < 0) return res;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET or cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      _fds.push_back(fd);
+    }
+  }
+  return res;
+}
+
+/*******************************
+ * sockets::socketbuf::take_fd *
+ *******************************/
+
+int sockets::socketbuf::take_fd() {
+  if (_fds.empty()) return -1;
+
+  const int fd = _fds.front();
+  _fds.pop_front();
+  return fd;
+}
+
 /******************************
  * sockets::socketbuf::oflush *
  ******************************/
@@ -322,23 +651,87 @@ bool sockets::socketbuf::oflush() {
   auto wlen = pptr() - pbase();
   char *buf = pbase();
 
+#ifdef HAVE_IO_URING
+  if (_uring) {
+    /* Queue the output to be sent with everything else, up to max_pending
+     * the same as when we send it ourself.
+     */
+    if (wlen > 0) {
+      if (_uring->queued(_fd) + wlen > max_pending) return false;
+      _uring->send(_fd, buf, static_cast<size_t>(wlen));
+    }
+
+    char *base = &_obuf.front();
+    setp(base, base + _obuf.size() - 1);
+    return true;
+  }
+#endif
+
+  char *base = &_obuf.front();
+
+  if (not _pending.empty()) {
+    // Earlier output is still waiting, this has to go out after it.
+    if (_pending.size() + wlen > max_pending) return false;
+    _pending.append(buf, wlen);
+    setp(base, base + _obuf.size() - 1);
+    return drain();
+  }
+
   // Write the entire buffer to the socket.
-  do {
-    auto wrote = send(_fd, buf,
-                      (wlen >= 0 ? static_cast<size_t>(wlen) : 0),
+  while (wlen > 0) {
+    auto wrote = send(_fd, buf, static_cast<size_t>(wlen),
                       _sflags | MSG_NOSIGNAL);
-    if (wrote == -1) return false;
+    if (wrote == -1) {
+      if (errno != EAGAIN and errno != EWOULDBLOCK) return false;
+
+      /* The socket isn't ready for more, hold on to the rest until it is
+       * rather than losing it or sending it twice.
+       */
+      _pending.assign(buf, wlen);
+      break;
+    }
     buf += wrote;
     wlen -= wrote;
-  } while (wlen);
+  }
 
   // Reset the buffers.
-  char *base = &_obuf.front();
   setp(base, base + _obuf.size() - 1);
 
   return true;
 }
 
+/*****************************
+ * sockets::socketbuf::drain *
+ *****************************/
+
+bool sockets::socketbuf::drain() {
+  size_t sent = 0;
+  while (sent < _pending.size()) {
+    auto wrote = send(_fd, _pending.data() + sent, _pending.size() - sent,
+                      _sflags | MSG_NOSIGNAL);
+    if (wrote == -1) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) break;
+      return false;
+    }
+    sent += wrote;
+  }
+
+  _pending.erase(0, sent);
+  return true;
+}
+
+/******************************
+ * sockets::socketbuf::queued *
+ ******************************/
+
+size_t sockets::socketbuf::queued() const {
+  size_t waiting = _pending.size() + (pptr() - pbase());
+#ifdef HAVE_IO_URING
+  if (_uring) waiting += _uring->queued(_fd);
+#endif
+  return waiting;
+}
+
 /******************************************************************************
  * class sockets::iostream
  */
@@ -502,6 +895,14 @@ void sockets::connection::close() {
   ios.close();
 }
 
+std::string sockets::connection::save() const {
+  return std::string();
+}
+
+void sockets::connection::restore(const std::string &state) {
+  (void)state;
+}
+
 /******************************************************************************
  * class sockets::server_base
  */
@@ -510,7 +911,8 @@ void sockets::connection::close() {
  * sockets::server_base::server_base *
  *************************************/
 
-sockets::server_base::server_base() : sockfd(-1) {
+sockets::server_base::server_base()
+  : sockfd(-1), _uring(nullptr), _uring_tried(false) {
   FD_ZERO(&active_fd_set);
 
   timeout.tv_sec = 10;
@@ -522,6 +924,9 @@ sockets::server_base::server_base() : sockfd(-1) {
  **************************************/
 
 sockets::server_base::~server_base() noexcept {
+#ifdef HAVE_IO_URING
+  delete _uring;
+#endif
   FD_ZERO(&active_fd_set);
   ::close(sockfd);
 }
@@ -569,7 +974,7 @@ void sockets::server_base::open(const char *hostname, const char *service) {
     throw sockets::exception((std::string("Unable able to bind to ") +
                           hostname + ":" + service).c_str());
 
-  if (listen(sockfd, 1) == -1)
+  if (::listen(sockfd, SOMAXCONN) == -1)
     throw sockets::exception((std::string("Unable able to listen to ") +
                           hostname + ":" + service).c_str());
 
@@ -605,7 +1010,7 @@ void sockets::server_base::open(const std::string &filename) {
                              filename + ": " + strerror(errno));
   }
 
-  if (listen(sockfd, 1) == -1)
+  if (::listen(sockfd, SOMAXCONN) == -1)
     throw sockets::exception(std::string("Unable able to listen to ") +
                              filename + ": " + strerror(errno));
 
@@ -623,14 +1028,295 @@ void sockets::server_base::open(const std::string &filename) {
   FD_SET(sockfd, &active_fd_set);
 }
 
+/********************************
+ * sockets::server_base::attach *
+ ********************************/
+
+void sockets::server_base::attach(int fd) {
+  sockfd = fd;
+  set_nonblocking(sockfd);
+
+  // Initialize the set of active sockets.
+  FD_ZERO(&active_fd_set);
+  FD_SET(sockfd, &active_fd_set);
+  for (auto &it: _clients) FD_SET(it.first, &active_fd_set);
+  for (auto &it: _watched) FD_SET(it, &active_fd_set);
+  for (auto &it: _listeners) FD_SET(it, &active_fd_set);
+
+#ifdef HAVE_IO_URING
+  if (_uring) _uring->accept(sockfd);
+#endif
+}
+
+/********************************
+ * sockets::server_base::listen *
+ ********************************/
+
+void sockets::server_base::listen(const char *hostname,
+                                  const char *service) {
+  struct addrinfo hints;
+  struct addrinfo *info, *iter;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int res = getaddrinfo(hostname, service, &hints, &info);
+  if (res != 0)
+    throw sockets::exception(std::string(hostname ? hostname : "*") + ":" +
+                             service + ": " + gai_strerror(res));
+
+  for (iter = info; iter != NULL; iter = iter->ai_next) {
+    fd = socket(iter->ai_family, iter->ai_socktype | SOCK_CLOEXEC,
+                iter->ai_protocol);
+    if (fd == -1) continue;
+
+    // Don't wait out old connections to the address after a restart.
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(fd, iter->ai_addr, iter->ai_addrlen) == 0 and
+        ::listen(fd, SOMAXCONN) == 0)
+      break;
+
+    ::close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(info);
+
+  if (fd == -1)
+    throw sockets::exception(std::string("Unable to listen on ") +
+                             (hostname ? hostname : "*") + ":" + service +
+                             ": " + strerror(errno));
+
+  set_nonblocking(fd);
+  _listeners.push_back(fd);
+  FD_SET(fd, &active_fd_set);
+#ifdef HAVE_IO_URING
+  if (_uring) _uring->accept(fd);
+#endif
+}
+
+/*****************************
+ * sockets::server_base::add *
+ *****************************/
+
+sockets::connection *sockets::server_base::add(int fd) {
+  return accepted(fd);
+}
+
 /*******************************
  * sockets::server_base::close *
  *******************************/
 
 void sockets::server_base::close() {
+#ifdef HAVE_IO_URING
+  if (_uring and sockfd >= 0) _uring->cancel(sockfd);
+  if (_uring) for (auto fd: _listeners) _uring->cancel(fd);
+#endif
   FD_ZERO(&active_fd_set);
   ::close(sockfd);
   sockfd = -1;
+
+  for (auto fd: _listeners) ::close(fd);
+  _listeners.clear();
+}
+
+/*********************************
+ * sockets::server_base::handoff *
+ *********************************/
+
+void sockets::server_base::handoff(int ctlfd) {
+  /* Each record is sent as a single packet, the first byte identifies what
+   * the record is.
+   *   L - The listening socket.
+   *   C - A client connection with its state and unread input.
+   *   O - Some of the unsent output for the client before it.
+   *   S - Some of the state of the server itself.
+   *   E - The end of the handoff.
+   * Nothing is closed until every client has been sent, if the handoff
+   * fails we carry on serving them.
+   */
+#ifdef HAVE_IO_URING
+  // Get everything off the ring and back into the stream buffers.
+  const bool had_uring = (_uring != nullptr);
+  if (_uring) stop_uring();
+#endif
+
+  try {
+    send_fd(ctlfd, sockfd, "L");
+
+    for (auto &it: _clients) {
+      std::string record("C"), input, output;
+
+      pack(record, it.second->save());
+      it.second->ios._sockbuf.unsent(input, output);
+      pack(record, input);
+      if (record.size() > max_record)
+        throw sockets::exception("Client state is too large to hand off");
+      send_fd(ctlfd, it.first, record);
+
+      for (size_t pos = 0; pos < output.size(); pos += max_record - 1)
+        send_fd(ctlfd, -1, 'O' + output.substr(pos, max_record - 1));
+    }
+
+    const std::string state(save());
+    for (size_t pos = 0; pos < state.size(); pos += max_record - 1)
+      send_fd(ctlfd, -1, 'S' + state.substr(pos, max_record - 1));
+
+  } catch (...) {
+#ifdef HAVE_IO_URING
+    // Go back to the ring we were using.
+    if (had_uring) _uring_tried = false;
+#endif
+    throw;
+  }
+
+  // The new server has them all now.
+  for (auto &it: _clients) {
+    std::string input, output;
+    auto fd = it.second->ios._sockbuf.release(input, output);
+
+    FD_CLR(fd, &active_fd_set);
+    ::close(fd);
+    delete it.second;
+  }
+  _clients.clear();
+
+  /* Our other listening sockets are closed before the end so the new
+   * server is free to open its own.
+   */
+  for (auto fd: _listeners) {
+    FD_CLR(fd, &active_fd_set);
+    ::close(fd);
+  }
+  _listeners.clear();
+
+  send_fd(ctlfd, -1, "E");
+
+  FD_CLR(sockfd, &active_fd_set);
+  ::close(sockfd);
+  sockfd = -1;
+}
+
+/**********************************
+ * sockets::server_base::takeover *
+ **********************************/
+
+void sockets::server_base::takeover(int ctlfd) {
+  std::list<connection *> pending;
+
+  /* Nothing is sent to the clients until we have them all, the old server
+   * keeps them if the handoff fails.
+   */
+  std::list<std::pair<connection *, std::string>> unsent;
+  std::string state;
+
+  for (;;) {
+    int fd;
+    std::string record;
+
+    if (not recv_fd(ctlfd, fd, record))
+      throw sockets::exception("Handoff ended prematurely");
+    if (record.empty()) continue;
+
+    if (record[0] == 'L') {
+      if (fd < 0) throw sockets::exception("No listening socket handed off");
+      attach(fd);
+
+    } else if (record[0] == 'C') {
+      if (fd < 0) continue;
+
+      size_t pos = 1;
+      std::string state(unpack(record, pos));
+      std::string input(unpack(record, pos));
+
+      set_nonblocking(fd);
+      auto conn = new_connection(fd);
+      conn->restore(state);
+      conn->ios._sockbuf.restore(input, "");
+      _clients[fd] = conn;
+      FD_SET(fd, &active_fd_set);
+#ifdef HAVE_IO_URING
+      if (_uring) {
+        conn->ios._sockbuf._uring = _uring;
+        _uring->recv(fd);
+      }
+#endif
+
+      if (not input.empty()) pending.push_back(conn);
+      unsent.emplace_back(conn, "");
+
+    } else if (record[0] == 'O') {
+      // More output for the client we were just given.
+      if (not unsent.empty()) unsent.back().second.append(record, 1);
+
+    } else if (record[0] == 'S') {
+      state.append(record, 1);
+
+    } else if (record[0] == 'E') {
+      break;
+    }
+  }
+
+  for (auto &it: unsent)
+    if (not it.second.empty()) it.first->ios._sockbuf.restore("", it.second);
+  restore(state);
+
+  // Process any complete lines that were waiting in the old server.
+  for (auto &conn: pending) conn->recv();
+}
+
+/*******************************
+ * sockets::server_base::watch *
+ *******************************/
+
+void sockets::server_base::watch(int fd) {
+  _watched.push_back(fd);
+  FD_SET(fd, &active_fd_set);
+#ifdef HAVE_IO_URING
+  if (_uring) _uring->poll(fd);
+#endif
+}
+
+/*********************************
+ * sockets::server_base::unwatch *
+ *********************************/
+
+void sockets::server_base::unwatch(int fd) {
+  _watched.erase(std::remove(_watched.begin(), _watched.end(), fd),
+                 _watched.end());
+  FD_CLR(fd, &active_fd_set);
+#ifdef HAVE_IO_URING
+  if (_uring) _uring->cancel(fd);
+#endif
+}
+
+/*******************************
+ * sockets::server_base::event *
+ *******************************/
+
+void sockets::server_base::event(int fd) {
+  (void)fd;
+}
+
+/******************************
+ * sockets::server_base::save *
+ ******************************/
+
+std::string sockets::server_base::save() const {
+  return std::string();
+}
+
+/*********************************
+ * sockets::server_base::restore *
+ *********************************/
+
+void sockets::server_base::restore(const std::string &state) {
+  (void)state;
 }
 
 /******************************************
@@ -638,8 +1324,31 @@ void sockets::server_base::close() {
  ******************************************/
 
 void sockets::server_base::process_requests() {
+#ifdef HAVE_IO_URING
+  // Use io_uring if the kernel supports it.
+  if (not _uring_tried) start_uring();
+  if (_uring) {
+    process_uring();
+    return;
+  }
+#endif
+
+  /* Clients with output waiting are watched until they can take more, any
+   * that fell too far behind or failed are dropped.
+   */
+  fd_set write_fd_set;
+  FD_ZERO(&write_fd_set);
+
+  std::vector<int> failed;
+  for (auto &it: _clients) {
+    if (not it.second->ios) failed.push_back(it.first);
+    else if (it.second->ios._sockbuf.pending())
+      FD_SET(it.first, &write_fd_set);
+  }
+  for (auto fd: failed) remove(fd);
+
   fd_set read_fd_set = active_fd_set;
-  if (::select(FD_SETSIZE, &read_fd_set, NULL, NULL, NULL) < 0) {
+  if (::select(FD_SETSIZE, &read_fd_set, &write_fd_set, NULL, NULL) < 0) {
     if (errno == EINTR)
       return;
     else
@@ -647,18 +1356,29 @@ void sockets::server_base::process_requests() {
                                strerror(errno));
   }
 
+  // Send the output that was waiting on the sockets now ready for it.
+  for (auto i = 0; i < FD_SETSIZE; ++i)
+    if (FD_ISSET (i, &write_fd_set)) {
+      auto client = _clients.find(i);
+      if (client != _clients.end() and
+          not client->second->ios._sockbuf.drain())
+        client->second->ios.setstate(std::ios::badbit);
+    }
+
   /* Service all the sockets with input pending. */
   for (auto i = 0; i < FD_SETSIZE; ++i)
     if (FD_ISSET (i, &read_fd_set)) {
 
-      if (i == sockfd) {
-        // Connection request on original socket.
+      if (i == sockfd or
+          std::find(_listeners.begin(), _listeners.end(), i) !=
+          _listeners.end()) {
+        // Connection request on one of our listening sockets.
         int newfd;
-        struct sockaddr_in clientname;
+        struct sockaddr_storage clientname;
 
         // Attempt to accept the connection.
         socklen_t size = sizeof(clientname);
-        newfd = accept(sockfd,
+        newfd = accept(i,
                        reinterpret_cast<struct sockaddr *>(&clientname),
                        &size);
         if (newfd < 0) {
@@ -667,33 +1387,275 @@ void sockets::server_base::process_requests() {
           return;
         }
 
-        // Add it to the clients lists.
-        FD_SET(newfd, &active_fd_set);
-        _clients[newfd] = new_connection(newfd);
-        try {
-          _clients[newfd]->connect(newfd);
-        } catch (std::exception &err) {
-          std::clog << "Exception: " << err.what() << std::endl;
-        }
+        accepted(newfd);
+
+      } else if (std::find(_watched.begin(), _watched.end(), i) !=
+                 _watched.end()) {
+        // Input on one of the extra descriptors we're watching.
+        event(i);
 
       } else {
+        /* Data arriving on an already-connected socket. The client may
+         * have been removed while handling an earlier event.
+         */
+        auto client = _clients.find(i);
+        if (client == _clients.end()) continue;
+
+        client->second->recv();
+        if (not client->second->ios or client->second->ios.eof())
+          remove(i);
+      }
+    }
+}
+
+/**********************************
+ * sockets::server_base::accepted *
+ **********************************/
+
+sockets::connection *sockets::server_base::accepted(int newfd) {
+  /* Accepted sockets don't always inherit the non-blocking flag from the
+   * listening socket, without it a single client can stall the server.
+   */
+  try {
+    set_nonblocking(newfd);
+  } catch (std::exception &err) {
+    std::clog << "Exception: " << err.what() << std::endl;
+    ::close(newfd);
+    return nullptr;
+  }
+
+  // Add it to the clients lists.
+  FD_SET(newfd, &active_fd_set);
+  auto conn = new_connection(newfd);
+  _clients[newfd] = conn;
+
+#ifdef HAVE_IO_URING
+  if (_uring) {
+    conn->ios._sockbuf._uring = _uring;
+    _uring->recv(newfd);
+  }
+#endif
+
+  try {
+    conn->connect(newfd);
+  } catch (std::exception &err) {
+    std::clog << "Exception: " << err.what() << std::endl;
+  }
+
+  return conn;
+}
+
+/********************************
+ * sockets::server_base::remove *
+ ********************************/
+
+void sockets::server_base::remove(int fd) {
+  auto client = _clients.find(fd);
+  if (client == _clients.end()) return;
 
-        /* Data arriving on an already-connected socket. */
-        _clients[i]->recv();
-        if (not _clients[i]->ios or _clients[i]->ios.eof()) {
 #ifdef DEBUG_NSTREAM
-          std::clog << "Connection closed" << std::endl;
+  std::clog << "Connection closed" << std::endl;
 #endif
 
-          auto tmp = _clients[i];
-          _clients.erase(i);  // Remove the client from our list.
-          delete tmp; // Destroy the client.
-          FD_CLR(i, &active_fd_set);
-        }
+#ifdef HAVE_IO_URING
+  if (_uring) _uring->cancel(fd);
+#endif
+
+  auto tmp = client->second;
+  _clients.erase(client);  // Remove the client from our list.
+  delete tmp; // Destroy the client.
+  FD_CLR(fd, &active_fd_set);
+}
+
+#ifdef HAVE_IO_URING
+
+/*************************************
+ * sockets::server_base::start_uring *
+ *************************************/
+
+void sockets::server_base::start_uring() {
+  _uring_tried = true;
+
+  try {
+    _uring = new uring();
+  } catch (std::exception &err) {
+    std::clog << "Using select, " << err.what() << std::endl;
+    return;
+  }
+
+  // Arm everything we're already serving.
+  if (sockfd >= 0) _uring->accept(sockfd);
+  for (auto fd: _listeners) _uring->accept(fd);
+  for (auto &it: _clients) {
+    auto &sockbuf = it.second->ios._sockbuf;
+    sockbuf._uring = _uring;
+    _uring->recv(it.first);
+
+    // Output still waiting to be sent goes out on the ring first.
+    if (not sockbuf._pending.empty()) {
+      _uring->send(it.first, sockbuf._pending.data(), sockbuf._pending.size());
+      sockbuf._pending.clear();
+    }
+  }
+  for (auto &it: _watched) _uring->poll(it);
+}
+
+/************************************
+ * sockets::server_base::stop_uring *
+ ************************************/
+
+void sockets::server_base::stop_uring() {
+  /* Cancel everything on the ring and collect whatever completes in the
+   * mean time, then switch all the clients back to doing their own IO.
+   */
+  uring *ring = _uring;
+  _uring = nullptr;
+
+  ring->cancel_all();
+
+  std::vector<uring::event> events;
+  while (not ring->idle()) {
+    ring->wait(events);
+
+    for (auto &evt: events) {
+      if (evt.op == uring::OP_ACCEPT and evt.res >= 0) {
+        accepted(evt.res);
+
+      } else if (evt.op == uring::OP_RECV) {
+        auto client = _clients.find(evt.fd);
+        if (client == _clients.end()) continue;
+
+        if (evt.res > 0)
+          client->second->ios._sockbuf.deliver(evt.data.data(),
+                                               evt.data.size());
+        else if (evt.res == 0)
+          client->second->ios._sockbuf.hangup();
+      }
+    }
+  }
+
+  std::vector<int> ready;
+  for (auto &it: _clients) {
+    auto &sockbuf = it.second->ios._sockbuf;
+    const std::string output(ring->take(it.first));
+
+    sockbuf._uring = nullptr;
+    if (not output.empty()) {
+      sockbuf.sputn(output.data(), static_cast<std::streamsize>(output.size()));
+      sockbuf.pubsync();
+    }
+
+    if (sockbuf._hangup or sockbuf.in_avail() > 0) ready.push_back(it.first);
+  }
+  delete ring;
+
+  // Process any input that arrived while we were shutting down.
+  for (auto fd: ready) {
+    auto client = _clients.find(fd);
+    if (client == _clients.end()) continue;
+
+    client->second->recv();
+    if (not client->second->ios or client->second->ios.eof()) remove(fd);
+  }
+}
+
+/***************************************
+ * sockets::server_base::process_uring *
+ ***************************************/
+
+void sockets::server_base::process_uring() {
+  std::vector<uring::event> events;
+  std::vector<int> polled;
+  bool fallback = false;
+
+  // Clients that fell too far behind or failed are dropped.
+  std::vector<int> failed;
+  for (auto &it: _clients)
+    if (not it.second->ios) failed.push_back(it.first);
+  for (auto fd: failed) remove(fd);
+
+  _uring->wait(events);
+
+  for (auto &evt: events) {
+    switch (evt.op) {
+    case uring::OP_ACCEPT:
+      if (evt.res >= 0) {
+        accepted(evt.res);
+      } else if (evt.res == -EINVAL) {
+        // The kernel doesn't support multishot requests.
+        fallback = true;
+      } else {
+        std::clog << "Unable to accept connection: "
+                  << strerror(-evt.res) << std::endl;
       }
+
+      if (not evt.more and not fallback and
+          (evt.fd == sockfd or
+           std::find(_listeners.begin(), _listeners.end(), evt.fd) !=
+           _listeners.end()))
+        _uring->accept(evt.fd);
+      break;
+
+    case uring::OP_RECV: {
+      auto client = _clients.find(evt.fd);
+      if (client == _clients.end()) break;
+
+      auto &sockbuf = client->second->ios._sockbuf;
+      if (evt.res > 0) {
+        sockbuf.deliver(evt.data.data(), evt.data.size());
+      } else if (evt.res == -EINVAL) {
+        fallback = true;
+        break;
+      } else if (evt.res != -ENOBUFS and evt.res != -ECANCELED) {
+        // The client hung up or there was an error.
+        sockbuf.hangup();
+      }
+
+      client->second->recv();
+      if (not client->second->ios or client->second->ios.eof()) {
+        remove(evt.fd);
+      } else if (not evt.more and not fallback) {
+        _uring->recv(evt.fd);
+      }
+      break;
     }
+
+    case uring::OP_POLL:
+      // Handled last, these can hand everything off to another process.
+      polled.push_back(evt.fd);
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  if (fallback) {
+    std::clog << "io_uring multishot requests not supported, using select"
+              << std::endl;
+    stop_uring();
+  }
+
+  for (auto fd: polled) {
+    if (std::find(_watched.begin(), _watched.end(), fd) == _watched.end())
+      continue;
+
+    event(fd);
+  }
+
+  // Re-arm any watched descriptors whose poll has finished.
+  if (_uring) {
+    for (auto &evt: events) {
+      if (evt.op == uring::OP_POLL and not evt.more and
+          std::find(_watched.begin(), _watched.end(), evt.fd) !=
+          _watched.end())
+        _uring->poll(evt.fd);
+    }
+  }
 }
 
+#endif // HAVE_IO_URING
+
 /*************************************
  * sockets::server_base::operator () *
  *************************************/
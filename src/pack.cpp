@@ -0,0 +1,353 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "nstream"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/* A packed block starts at the beginning of a line with a byte the server
+ * never starts a line with, followed by the codec and the lengths of the
+ * text before and after it was packed, least significant byte first.
+ */
+
+namespace {
+  const char block_mark = '\x1d';
+  const size_t header_size = 10;
+
+  // Blocks are bulk transfers, not whole files.
+  const size_t max_block = 4 * 1024 * 1024;
+
+  /* Both ends start every block already knowing these, so even a short
+   * block can refer back to the phrases the server sends over and over.
+   * Changing it is changing the codec, it needs a new name.
+   */
+  const std::string dictionary =
+    "? All server commands start with the '/' character.\n"
+    "? Type '/help' to get a list of chat commands.\n"
+    "? Your session could not be resumed, messages sent while you were away "
+    "are lost.\n"
+    "? Lines are no longer kept.\n"
+    "? Unknown chat command '/\n"
+    "http://https://www. .com .org .net /usr/ /var/log/ /etc/ /home/ "
+    "error warning failed unable cannot permission denied not found "
+    "systemd kernel disk memory server service restart reboot update "
+    "please thanks thank you sorry hello hi hey ok okay yes no sure "
+    "what where when why how who which there their they this that with "
+    "have has had was were will would could should about from into just "
+    "like know think going been some than then them your you're it's "
+    "don't can't I'm the and for are but not all any can her one our out "
+    "! ^root: ! root: root: "
+    " has left the chat.\n"
+    " has joined the chat.\n"
+    "#1#2#3#4#5#6#7#8#9#10";
+
+  inline uint32_t read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  inline uint32_t hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - 12);
+  }
+
+  void put32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out.push_back(char(value >> (8 * i)));
+  }
+
+  uint32_t get32(const char *p) {
+    const auto *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+  }
+
+  void put_length(std::string &out, size_t len) {
+    // What didn't fit in the token's nibble, 255 at a time.
+    for (; len >= 255; len -= 255) out.push_back(char(255));
+    out.push_back(char(len));
+  }
+
+  bool get_length(const char *&in, const char *end, size_t &len) {
+    unsigned char byte;
+    do {
+      if (in >= end) return false;
+      byte = static_cast<unsigned char>(*in++);
+      len += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  /*************
+   * lz_encode *
+   *************/
+
+  void lz_encode(const std::string &text, std::string &out) {
+    /* Each sequence is a token, the literals and where to copy a match
+     * from. The token's high nibble is the number of literals and its low
+     * one the length of the match less 4, either continued after it if it
+     * reaches 15. The match is copied from up to 64K back, which may reach
+     * into the dictionary. The last sequence is only literals.
+     */
+    static const std::vector<uint32_t> primed = [] {
+      // Position + 1 of a hash, the dictionary's hashed once for all.
+      std::vector<uint32_t> table(1 << 12, 0);
+      for (size_t pos = 0; pos + 4 <= dictionary.size(); ++pos)
+        table[hash(read32(dictionary.data() + pos))] = pos + 1;
+      return table;
+    }();
+
+    std::string buf;
+    buf.reserve(dictionary.size() + text.size());
+    buf = dictionary;
+    buf += text;
+    const size_t start = dictionary.size();
+    const size_t end = buf.size();
+    const char *base = buf.data();
+    auto table = primed;
+    out.reserve(out.size() + text.size());
+
+    size_t anchor = start, pos = start, misses = 0;
+    const size_t last_match = (end > start + 12 ? end - 12 : start);
+
+    auto emit = [&](size_t literals, size_t offset, size_t match) {
+      const size_t lit_nibble = std::min<size_t>(literals, 15);
+      const size_t match_nibble = (offset ? std::min<size_t>(match - 4, 15)
+                                          : 0);
+      out.push_back(char((lit_nibble << 4) | match_nibble));
+      if (lit_nibble == 15) put_length(out, literals - 15);
+      out.append(base + anchor, literals);
+      if (offset) {
+        out.push_back(char(offset));
+        out.push_back(char(offset >> 8));
+        if (match_nibble == 15) put_length(out, match - 4 - 15);
+      }
+    };
+
+    while (pos < last_match) {
+      const auto h = hash(read32(base + pos));
+      size_t ref = table[h];
+      table[h] = pos + 1;
+
+      if (ref == 0 or pos - (ref - 1) > 65535 or
+          read32(base + ref - 1) != read32(base + pos)) {
+        // Step faster through text that isn't packing.
+        pos += 1 + (misses++ >> 6);
+        continue;
+      }
+      ref--;
+      misses = 0;
+
+      // Take in what matches either side, leaving the end as literals.
+      while (pos > anchor and ref > 0 and base[pos - 1] == base[ref - 1]) {
+        --pos;
+        --ref;
+      }
+      size_t match = 4;
+      while (pos + match < end - 5 and base[ref + match] == base[pos + match])
+        ++match;
+
+      emit(pos - anchor, pos - ref, match);
+      pos += match;
+      anchor = pos;
+    }
+    emit(end - anchor, 0, 0);
+  }
+
+  /*************
+   * lz_decode *
+   *************/
+
+  bool lz_decode(const char *in, size_t size, size_t length,
+                 std::string &text) {
+    const size_t limit = dictionary.size() + length;
+    std::string buf(limit, '\0');
+    memcpy(&buf[0], dictionary.data(), dictionary.size());
+    char *out = &buf[0] + dictionary.size();
+    const char *out_end = &buf[0] + limit;
+    const char *end = in + size;
+
+    while (in < end) {
+      const auto token = static_cast<unsigned char>(*in++);
+
+      size_t literals = token >> 4;
+      if (literals == 15 and not get_length(in, end, literals)) return false;
+      if (literals > size_t(end - in) or literals > size_t(out_end - out))
+        return false;
+      memcpy(out, in, literals);
+      out += literals;
+      in += literals;
+      if (in == end) break; // The last sequence has no match.
+
+      if (end - in < 2) return false;
+      const size_t offset = static_cast<unsigned char>(in[0]) |
+        (static_cast<unsigned char>(in[1]) << 8);
+      in += 2;
+
+      size_t match = token & 0x0f;
+      if (match == 15 and not get_length(in, end, match)) return false;
+      match += 4;
+      if (offset == 0 or offset > size_t(out - buf.data()) or
+          match > size_t(out_end - out))
+        return false;
+
+      // The match may overlap what it's copying.
+      const char *from = out - offset;
+      if (offset >= match) {
+        memcpy(out, from, match);
+        out += match;
+      } else {
+        for (size_t i = 0; i < match; ++i) *out++ = from[i];
+      }
+    }
+
+    if (out != out_end) return false;
+    text.assign(buf, dictionary.size(), length);
+    return true;
+  }
+}
+
+/******************
+ * sockets::codec *
+ ******************/
+
+sockets::codec_t sockets::codec(const std::string &name) {
+  if (name == "lz") return CODEC_LZ;
+  return CODEC_NONE;
+}
+
+/***********************
+ * sockets::codec_name *
+ ***********************/
+
+std::string sockets::codec_name(codec_t codec) {
+  switch (codec) {
+  case CODEC_LZ: return "lz";
+  default: return "none";
+  }
+}
+
+/***********************
+ * sockets::pack_block *
+ ***********************/
+
+bool sockets::pack_block(codec_t codec, const std::string &text,
+                         std::string &block) {
+  if (codec != CODEC_LZ or text.size() < pack_threshold or
+      text.size() > max_block)
+    return false;
+
+  block.assign(1, block_mark);
+  block.push_back('L');
+  put32(block, text.size());
+  put32(block, 0);
+  lz_encode(text, block);
+
+  // Not worth it if it's barely any smaller.
+  if (block.size() + block.size() / 8 >= text.size()) return false;
+
+  const size_t size = block.size() - header_size;
+  for (int i = 0; i < 4; ++i) block[6 + i] = char(size >> (8 * i));
+  return true;
+}
+
+/*************************
+ * sockets::unpack_block *
+ *************************/
+
+bool sockets::unpack_block(codec_t codec, const char *data, size_t size,
+                           size_t length, std::string &text) {
+  if (codec != CODEC_LZ or length > max_block) return false;
+  return lz_decode(data, size, length, text);
+}
+
+/******************************************************************************
+ * class sockets::socketbuf
+ */
+
+/******************************
+ * sockets::socketbuf::decode *
+ ******************************/
+
+void sockets::socketbuf::decode(const char *data, size_t len) {
+  /* Copy the input as it arrives into _unpacked, unpacking the blocks in
+   * it. A block may arrive a piece at a time, it's kept until it's whole.
+   */
+  const char *end = data + len;
+
+  while (data < end) {
+    if (_block.empty()) {
+      if (_bol and *data == block_mark) {
+        _block.push_back(*data++);
+        continue;
+      }
+
+      // Up to the end of the line.
+      const auto eol = static_cast<const char *>(memchr(data, '\n',
+                                                        end - data));
+      const char *next = (eol ? eol + 1 : end);
+      _unpacked.append(data, next);
+      _bol = (eol != nullptr);
+      data = next;
+      continue;
+    }
+
+    size_t want = header_size - _block.size();
+    if (_block.size() >= header_size) {
+      want = header_size + get32(&_block[6]) - _block.size();
+    }
+    const auto take = std::min<size_t>(want, end - data);
+    _block.append(data, take);
+    data += take;
+
+    if (_block.size() == header_size) {
+      if (get32(&_block[2]) > max_block or get32(&_block[6]) > max_block)
+        throw sockets::exception("Packed input is too large");
+    }
+    if (_block.size() < header_size or
+        _block.size() < header_size + get32(&_block[6]))
+      continue;
+
+    // The whole block is here.
+    const auto codec = (_block[1] == 'L' ? CODEC_LZ : CODEC_NONE);
+    std::string text;
+    if (not sockets::unpack_block(codec, _block.data() + header_size,
+                            _block.size() - header_size, get32(&_block[2]),
+                            text))
+      throw sockets::exception("Unable to unpack the input");
+
+    _unpacked += text;
+    _bol = (text.empty() or text.back() == '\n');
+    _block.clear();
+  }
+}
@@ -0,0 +1,232 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Measures when packing bulk transfers pays off. Chat lines are sent over
+ * a unix socket to a stream unpacking its input, as they are and packed,
+ * for a range of sizes. Packing starts to pay once the time saved sending
+ * fewer bytes covers the time spent packing and unpacking them.
+ */
+
+#include "nstream"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+  typedef std::chrono::steady_clock bench_clock;
+
+  /**************
+   * chat_lines *
+   **************/
+
+  std::string chat_lines(size_t size) {
+    // Numbered lines from a handful of users, like a replay sends.
+    static const std::vector<std::string> users = {
+      "root", "alice", "bob", "carol", "dave"
+    };
+    static const std::vector<std::string> words = {
+      "the", "disk", "is", "full", "again", "on", "server", "can", "you",
+      "restart", "it", "thanks", "I", "think", "kernel", "update", "broke",
+      "the", "network", "yes", "no", "maybe", "later", "logs", "are", "in",
+      "/var/log/syslog", "error", "warning", "what", "about", "backup",
+      "job", "failed", "last", "night", "ok", "checking", "now", "done"
+    };
+    std::mt19937 random(size);
+    std::string text;
+    uint64_t seq = 1000;
+
+    while (text.size() < size) {
+      std::string line = '#' + std::to_string(seq++) + ' ' +
+        users[random() % users.size()] + ':';
+      const auto count = 3 + random() % 12;
+      for (size_t i = 0; i < count; ++i)
+        line += ' ' + words[random() % words.size()];
+      text += line + '\n';
+    }
+
+    // Whole lines, cut down to the size if one is too long.
+    if (text.size() > size) {
+      const auto end = text.rfind('\n', size - 1);
+      if (end == text.npos or end == 0) text.resize(size - 1), text += '\n';
+      else text.resize(end + 1);
+    }
+    return text;
+  }
+
+  /*************
+   * open_pair *
+   *************/
+
+  int open_pair(const std::string &path, sockets::iostream &reader) {
+    // A socket to write to and a stream reading the other end of it.
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    unlink(path.c_str());
+    if (listener == -1 or
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 or
+        listen(listener, 1) == -1)
+      throw sockets::exception(std::string("Unable to listen: ") +
+                               strerror(errno));
+
+    reader.open(path);
+    const int writer = accept(listener, nullptr, nullptr);
+    close(listener);
+    unlink(path.c_str());
+    if (writer == -1)
+      throw sockets::exception(std::string("Unable to accept: ") +
+                               strerror(errno));
+
+    // Enough room for the biggest transfer to be written before it's read.
+    const int room = 1024 * 1024;
+    setsockopt(writer, SOL_SOCKET, SO_SNDBUF, &room, sizeof(room));
+    setsockopt(reader.socket(), SOL_SOCKET, SO_RCVBUF, &room, sizeof(room));
+
+    reader.unpack_input();
+    return writer;
+  }
+
+  /************
+   * transfer *
+   ************/
+
+  double transfer(int writer, sockets::iostream &reader,
+                  const std::string &text, bool packed, size_t rounds,
+                  size_t &sent) {
+    /* Microseconds to send text and read it back a line at a time, packing
+     * it first if asked. The lines read back have to be the text, numbers
+     * from a broken codec are no use.
+     */
+    const auto lines = std::count(text.begin(), text.end(), '\n');
+    std::string block, line, back;
+    const auto start = bench_clock::now();
+
+    for (size_t round = 0; round < rounds; ++round) {
+      const std::string *out = &text;
+      if (packed and sockets::pack_block(sockets::CODEC_LZ, text, block))
+        out = &block;
+      sent = out->size();
+
+      for (size_t done = 0; done < out->size();) {
+        const auto res = write(writer, out->data() + done,
+                               out->size() - done);
+        if (res <= 0)
+          throw sockets::exception(std::string("Unable to write: ") +
+                                   strerror(errno));
+        done += res;
+      }
+      back.clear();
+      for (auto count = 0; count < lines and getline(reader, line); ++count)
+        back += line + '\n';
+      if (back != text)
+        throw sockets::exception(std::string("The lines read back from ") +
+                                 (packed ? "packing " : "sending ") +
+                                 std::to_string(text.size()) +
+                                 " bytes don't match what was sent");
+    }
+
+    const std::chrono::duration<double, std::micro> took =
+      bench_clock::now() - start;
+    return took.count() / rounds;
+  }
+}
+
+/******************************************************************************
+ * Entry Point
+ */
+
+int main(int argc, char *argv[]) {
+  // The link speed in megabits a second to figure the time on the wire.
+  const double mbits = (argc > 1 ? atof(argv[1]) : 100.0);
+  const std::string path = "/tmp/packbench." + std::to_string(getpid());
+
+  try {
+    sockets::iostream reader;
+    const int writer = open_pair(path, reader);
+
+    std::cout << "Packing chat lines with lz, over a " << mbits
+              << " Mbit/s link\n\n"
+              << std::setw(8) << "bytes" << std::setw(10) << "packed"
+              << std::setw(12) << "plain us" << std::setw(12) << "packed us"
+              << std::setw(12) << "wire us" << std::setw(10) << "pays"
+              << std::endl;
+
+    size_t break_even = 0;
+    for (size_t size = 32; size <= 256 * 1024; size *= 2) {
+      const auto text = chat_lines(size);
+      const size_t rounds = std::max<size_t>(20, (16 * 1024 * 1024) / size);
+      size_t plain_bytes, packed_bytes;
+
+      const auto plain = transfer(writer, reader, text, false, rounds,
+                                  plain_bytes);
+      const auto packed = transfer(writer, reader, text, true, rounds,
+                                   packed_bytes);
+
+      // The time saved on the wire against the time spent packing.
+      const double saved = (plain_bytes - packed_bytes) * 8.0 / mbits;
+      const bool pays = (packed_bytes < plain_bytes and
+                         packed - plain < saved);
+      if (pays and break_even == 0) break_even = text.size();
+
+      std::cout << std::setw(8) << text.size()
+                << std::setw(10) << packed_bytes
+                << std::fixed << std::setprecision(2)
+                << std::setw(12) << plain << std::setw(12) << packed
+                << std::setw(12) << saved
+                << std::setw(10) << (pays ? "yes" : "no") << std::endl;
+    }
+
+    std::cout << "\nPacking pays from about " << break_even
+              << " bytes, the threshold is " << sockets::pack_threshold
+              << "." << std::endl;
+    close(writer);
+
+  } catch (std::exception &err) {
+    std::cerr << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,349 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Checks packing and unpacking bulk transfers. Blocks have to come back as
+ * the text they were packed from, and anything the other end sends that
+ * isn't a good block has to be refused without reading or writing past
+ * it. Run by "make check".
+ */
+
+#include "nstream"
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+  unsigned failures = 0;
+
+  const size_t header_size = 10; // The mark, codec and two lengths.
+
+  /*********
+   * check *
+   *********/
+
+  void check(bool ok, const std::string &what) {
+    if (ok) return;
+    std::cerr << "FAIL: " << what << std::endl;
+    failures++;
+  }
+
+  /**************
+   * chat_lines *
+   **************/
+
+  std::string chat_lines(size_t size, unsigned seed) {
+    // Lines like the server sends, numbered and from a few users.
+    static const std::vector<std::string> words = {
+      "root:", "alice:", "bob:", "the", "disk", "is", "full", "again",
+      "restart", "kernel", "update", "/var/log/syslog", "error", "ok",
+      "has joined the chat.", "has left the chat.", "thanks", "done"
+    };
+    std::mt19937 random(seed);
+    std::string text;
+    uint64_t seq = seed;
+
+    while (text.size() < size) {
+      text += '#' + std::to_string(seq++);
+      const auto count = 2 + random() % 10;
+      for (size_t i = 0; i < count; ++i)
+        text += ' ' + words[random() % words.size()];
+      text += '\n';
+    }
+    return text;
+  }
+
+  /****************
+   * random_bytes *
+   ****************/
+
+  std::string random_bytes(size_t size, unsigned seed) {
+    std::mt19937 random(seed);
+    std::string text(size, '\0');
+    for (auto &ch: text) ch = static_cast<char>(random());
+    return text;
+  }
+
+  /*********
+   * texts *
+   *********/
+
+  std::vector<std::string> texts() {
+    // Text that packs well, badly and not at all.
+    std::vector<std::string> result;
+    for (size_t size = 1; size <= 512 * 1024; size *= 3) {
+      result.push_back(chat_lines(size, size));
+      result.push_back(std::string(size, 'x') + '\n');
+      result.push_back(random_bytes(size, size) + '\n');
+    }
+    result.push_back(std::string(70000, 'a') + '\n' + chat_lines(70000, 7));
+    return result;
+  }
+
+  /**************
+   * round_trip *
+   **************/
+
+  void round_trip() {
+    size_t packed = 0;
+    for (auto &text: texts()) {
+      const auto size = std::to_string(text.size());
+      std::string block, back;
+
+      check(not sockets::pack_block(sockets::CODEC_NONE, text, block),
+            "packed " + size + " bytes without a codec");
+      // Text that wouldn't get much smaller is sent as it is.
+      if (not sockets::pack_block(sockets::CODEC_LZ, text, block)) continue;
+      packed++;
+
+      check(text.size() >= sockets::pack_threshold,
+            "packed " + size + " bytes, under the threshold");
+      check(block.size() > header_size and block.size() < text.size(),
+            "packing " + size + " bytes didn't make them smaller");
+      check(sockets::unpack_block(sockets::CODEC_LZ,
+                                  block.data() + header_size,
+                                  block.size() - header_size, text.size(),
+                                  back) and back == text,
+            "unpacking " + size + " bytes didn't give them back");
+      check(not sockets::unpack_block(sockets::CODEC_NONE,
+                                      block.data() + header_size,
+                                      block.size() - header_size,
+                                      text.size(), back),
+            "unpacked " + size + " bytes without a codec");
+    }
+    check(packed > 0, "nothing was packed");
+
+    std::string block;
+    check(sockets::pack_block(sockets::CODEC_LZ, chat_lines(4096, 1), block),
+          "refused to pack 4096 bytes of chat lines");
+    check(not sockets::pack_block(sockets::CODEC_LZ,
+                                  std::string(5 * 1024 * 1024, 'x'), block),
+          "packed a block over the limit");
+  }
+
+  /***********
+   * corrupt *
+   ***********/
+
+  void corrupt() {
+    /* Blocks that were cut short, claim the wrong length or were damaged
+     * on the way. Damage may still decode to something, as long as it's
+     * no more than the length asked for.
+     */
+    std::mt19937 random(2026);
+
+    for (auto size: {300, 5000, 100000}) {
+      const auto text = chat_lines(size, size);
+      std::string block, back;
+      if (not sockets::pack_block(sockets::CODEC_LZ, text, block)) {
+        check(false, "refused to pack " + std::to_string(size) + " bytes");
+        continue;
+      }
+      const std::string data(block, header_size);
+      const auto what = " a block of " + std::to_string(text.size()) +
+        " bytes";
+
+      for (size_t cut = 0; cut < data.size(); cut += 1 + cut / 16)
+        check(not sockets::unpack_block(sockets::CODEC_LZ, data.data(), cut,
+                                        text.size(), back),
+              "unpacked" + what + " cut to " + std::to_string(cut));
+
+      check(not sockets::unpack_block(sockets::CODEC_LZ, data.data(),
+                                      data.size(), text.size() + 1, back),
+            "unpacked" + what + " longer than it is");
+      check(not sockets::unpack_block(sockets::CODEC_LZ, data.data(),
+                                      data.size(), text.size() - 1, back),
+            "unpacked" + what + " shorter than it is");
+      check(not sockets::unpack_block(sockets::CODEC_LZ, data.data(),
+                                      data.size(), 1u << 30, back),
+            "unpacked" + what + " claiming to be huge");
+
+      for (int round = 0; round < 2000; ++round) {
+        std::string damaged(data);
+        for (int hits = 1 + random() % 4; hits > 0; --hits)
+          damaged[random() % damaged.size()] = static_cast<char>(random());
+        if (sockets::unpack_block(sockets::CODEC_LZ, damaged.data(),
+                                  damaged.size(), text.size(), back))
+          check(back.size() == text.size(),
+                "damaged" + what + " unpacked to the wrong length");
+      }
+    }
+
+    for (int round = 0; round < 2000; ++round) {
+      std::string back;
+      const auto junk = random_bytes(random() % 512, round);
+      if (sockets::unpack_block(sockets::CODEC_LZ, junk.data(), junk.size(),
+                                random() % 4096, back))
+        check(back.size() < 4096, "junk unpacked to the wrong length");
+    }
+  }
+
+  /*************
+   * open_pair *
+   *************/
+
+  int open_pair(sockets::iostream &reader) {
+    // A socket to write to and a stream unpacking what it reads from it.
+    const std::string path = "/tmp/packtest." + std::to_string(getpid());
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    unlink(path.c_str());
+    if (listener == -1 or
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 or
+        listen(listener, 1) == -1)
+      throw sockets::exception(std::string("Unable to listen: ") +
+                               strerror(errno));
+
+    reader.open(path);
+    const int writer = accept(listener, nullptr, nullptr);
+    close(listener);
+    unlink(path.c_str());
+    if (writer == -1)
+      throw sockets::exception(std::string("Unable to accept: ") +
+                               strerror(errno));
+
+    reader.unpack_input();
+    return writer;
+  }
+
+  /*************
+   * write_all *
+   *************/
+
+  void write_all(int fd, const std::string &data) {
+    for (size_t done = 0; done < data.size();) {
+      const auto res = write(fd, data.data() + done, data.size() - done);
+      if (res <= 0)
+        throw sockets::exception(std::string("Unable to write: ") +
+                                 strerror(errno));
+      done += res;
+    }
+  }
+
+  /**********
+   * decode *
+   **********/
+
+  void decode() {
+    /* Plain lines and blocks mixed together, read through input buffers
+     * small enough that every block arrives a piece at a time.
+     */
+    std::string sent, expected, block;
+    for (unsigned part = 0; part < 12; ++part) {
+      const auto text = chat_lines(200 + part * 700, part);
+      if (part % 3 != 0 and
+          sockets::pack_block(sockets::CODEC_LZ, text, block)) {
+        sent += block;
+      } else {
+        sent += text;
+      }
+      expected += text;
+
+      // Only a block mark at the start of a line starts a block.
+      const std::string marked = "mid \x1d line\n";
+      sent += marked;
+      expected += marked;
+    }
+
+    for (size_t buffer: {1, 2, 3, 7, 10, 11, 64, 1024, 65536}) {
+      sockets::iostream reader(buffer);
+      const int writer = open_pair(reader);
+      write_all(writer, sent);
+      close(writer);
+
+      std::string line, back;
+      while (getline(reader, line)) back += line + '\n';
+      check(back == expected, "decoding through a buffer of " +
+            std::to_string(buffer) + " bytes didn't give the lines back");
+    }
+
+    // Blocks the other end got wrong stop the input, not the reader.
+    std::string bad = chat_lines(2000, 1);
+    check(sockets::pack_block(sockets::CODEC_LZ, bad, block),
+          "refused to pack 2000 bytes");
+    std::vector<std::string> broken = {
+      block.substr(0, header_size) + std::string(block.size(), '\xff'),
+      block.substr(0, 2) + std::string("\xff\xff\xff\x7f") +
+        block.substr(6),
+      block.substr(0, 6) + std::string("\xff\xff\xff\x7f") +
+        block.substr(10),
+      block.substr(0, 1) + 'Z' + block.substr(2)
+    };
+    for (size_t index = 0; index < broken.size(); ++index) {
+      sockets::iostream reader;
+      const int writer = open_pair(reader);
+      write_all(writer, "before\n" + broken[index] + "after\n");
+      close(writer);
+
+      std::string line, back;
+      try {
+        while (getline(reader, line)) back += line + '\n';
+      } catch (sockets::exception &err) {
+        // As good as failing the stream.
+      }
+      check((back.empty() or back == "before\n") and not reader,
+            "a broken block " + std::to_string(index) + " was accepted");
+    }
+  }
+}
+
+/******************************************************************************
+ * Entry Point
+ */
+
+int main() {
+  try {
+    round_trip();
+    corrupt();
+    decode();
+  } catch (std::exception &err) {
+    std::cerr << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,265 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rules.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+/******************************************************************************
+ * class rules
+ */
+
+/****************
+ * rules::rules *
+ ****************/
+
+rules::rules() : _built(false) {
+}
+
+/***************
+ * rules::load *
+ ***************/
+
+void rules::load(const std::string &path) {
+  std::ifstream file(path);
+  if (not file)
+    throw std::runtime_error("Unable to open rules file " + path);
+
+  std::string line;
+  size_t number = 0;
+  while (getline(file, line)) {
+    number++;
+
+    auto fail = [&](const std::string &why) {
+      throw std::runtime_error(path + ":" + std::to_string(number) + ": " +
+                               why);
+    };
+
+    size_t at = line.find_first_not_of(" \t");
+    if (at == line.npos or line[at] == '#') continue;
+
+    // The pattern, quoted or up to the first space.
+    std::string pattern;
+    bool at_start = false, at_end = false;
+    const bool quoted = (line[at] == '"');
+    if (quoted) at++;
+    if (at < line.size() and line[at] == '^') {
+      at_start = true;
+      at++;
+    }
+
+    for (; at < line.size(); at++) {
+      const char ch = line[at];
+      if (quoted ? ch == '"' : (ch == ' ' or ch == '\t')) break;
+
+      if (ch == '\\' and at + 1 < line.size()) {
+        pattern += line[++at];
+      } else if (ch == '$' and
+                 (at + 1 == line.size() or
+                  (quoted ? line[at + 1] == '"'
+                          : (line[at + 1] == ' ' or line[at + 1] == '\t')))) {
+        at_end = true;
+      } else {
+        pattern += ch;
+      }
+    }
+
+    if (quoted) {
+      if (at >= line.size()) fail("missing the closing quote");
+      at++;
+    }
+    if (pattern.empty()) fail("empty pattern");
+
+    // The action and what it works with.
+    at = line.find_first_not_of(" \t", at);
+    if (at == line.npos) fail("missing an action");
+    auto end = line.find_first_of(" \t", at);
+    const auto action = line.substr(at, end - at);
+
+    std::string argument;
+    if (end != line.npos) {
+      end = line.find_first_not_of(" \t", end);
+      if (end != line.npos) argument = line.substr(end);
+    }
+
+    if (action == "say") {
+      add(pattern, at_start, at_end, A_SAY, argument);
+    } else if (action == "pipe") {
+      if (argument.empty()) fail("pipe needs a command");
+      add(pattern, at_start, at_end, A_PIPE, argument);
+    } else {
+      fail("unknown action '" + action + "'");
+    }
+  }
+}
+
+/**************
+ * rules::add *
+ **************/
+
+void rules::add(const std::string &pattern, bool at_start, bool at_end,
+                action_t action, const std::string &argument) {
+  _rules.push_back({pattern, at_start, at_end, action, argument});
+  _built = false;
+}
+
+/****************
+ * rules::match *
+ ****************/
+
+void rules::match(std::string_view line, std::vector<size_t> &matched) {
+  matched.clear();
+  if (_rules.empty()) return;
+  if (not _built) build();
+
+  // One pass over the line finds every pattern in it.
+  int32_t state = 0;
+  for (size_t index = 0; index < line.size(); index++) {
+    state = _next[state * 256 + static_cast<uint8_t>(line[index])];
+
+    for (auto id: _found[state]) {
+      const auto &r = _rules[id];
+      if (r.at_start and index + 1 != r.pattern.size()) continue;
+      if (r.at_end and index + 1 != line.size()) continue;
+      matched.push_back(id);
+    }
+  }
+
+  // A rule fires once a line, in the order they were given.
+  std::sort(matched.begin(), matched.end());
+  matched.erase(std::unique(matched.begin(), matched.end()), matched.end());
+}
+
+/*****************
+ * rules::expand *
+ *****************/
+
+std::string rules::expand(std::string_view text, std::string_view line) {
+  /* Lines are "name: text", "! name: text" for private messages, or
+   * "name has joined the chat." and the like from the server.
+   */
+  std::string_view body = line;
+  if (body.compare(0, 2, "! ") == 0) body.remove_prefix(2);
+
+  std::string_view name, said = line;
+  const auto colon = body.find(": ");
+  const auto space = body.find(' ');
+  if (colon != body.npos and colon < space) {
+    name = body.substr(0, colon);
+    said = body.substr(colon + 2);
+  } else {
+    name = body.substr(0, space);
+  }
+
+  std::string result;
+  for (size_t at = 0; at < text.size(); at++) {
+    if (text[at] != '$') {
+      result += text[at];
+      continue;
+    }
+
+    const auto rest = text.substr(at + 1);
+    if (rest.compare(0, 4, "name") == 0) {
+      result += name;
+      at += 4;
+    } else if (rest.compare(0, 4, "text") == 0) {
+      result += said;
+      at += 4;
+    } else if (rest.compare(0, 4, "line") == 0) {
+      result += line;
+      at += 4;
+    } else if (rest.compare(0, 1, "$") == 0) {
+      result += '$';
+      at += 1;
+    } else {
+      result += '$';
+    }
+  }
+
+  return result;
+}
+
+/****************
+ * rules::build *
+ ****************/
+
+void rules::build() {
+  // Start with a trie of all the patterns, -1 where there's no way on.
+  _next.assign(256, -1);
+  _found.assign(1, {});
+
+  for (uint32_t id = 0; id < _rules.size(); id++) {
+    int32_t state = 0;
+    for (auto ch: _rules[id].pattern) {
+      auto &next = _next[state * 256 + static_cast<uint8_t>(ch)];
+      if (next < 0) {
+        next = static_cast<int32_t>(_found.size());
+        _found.emplace_back();
+        _next.resize(_next.size() + 256, -1);
+      }
+      state = _next[state * 256 + static_cast<uint8_t>(ch)];
+    }
+    _found[state].push_back(id);
+  }
+
+  /* Fill in the missing transitions breadth first from where the longest
+   * suffix would have gone, turning the trie into a DFA.
+   */
+  std::vector<int32_t> fail(_found.size(), 0);
+  std::vector<int32_t> queue;
+
+  for (int ch = 0; ch < 256; ch++) {
+    auto &next = _next[ch];
+    if (next < 0) next = 0;
+    else queue.push_back(next);
+  }
+
+  for (size_t head = 0; head < queue.size(); head++) {
+    const auto state = queue[head];
+    for (int ch = 0; ch < 256; ch++) {
+      auto &next = _next[state * 256 + ch];
+      const auto fallback = _next[fail[state] * 256 + ch];
+      if (next < 0) {
+        next = fallback;
+      } else {
+        fail[next] = fallback;
+        const auto &more = _found[fallback];
+        _found[next].insert(_found[next].end(), more.begin(), more.end());
+        queue.push_back(next);
+      }
+    }
+  }
+
+  _built = true;
+}
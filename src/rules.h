@@ -0,0 +1,103 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#ifndef _LCHAT_RULES_H
+#define _LCHAT_RULES_H
+
+/** Pattern triggered rules for bots.
+ *
+ *  A rules file has one rule per line, a pattern followed by an action:
+ *
+ *    # Comments and blank lines are ignored.
+ *    ": !fortune$"           pipe exec fortune-helper.sh
+ *    " has joined the chat.$" say /msg $name Type !fortune for a fortune
+ *
+ *  Patterns are plain text, quoted when they hold spaces, and match
+ *  anywhere in a chat line unless anchored with a leading ^ or trailing $.
+ *  All the patterns are compiled into a single Aho-Corasick automaton so a
+ *  line is scanned once no matter how many rules there are.
+ */
+class rules {
+public:
+  typedef enum {
+    A_SAY,  // Send the templated text to the chat.
+    A_PIPE  // Pass the line to a helper process.
+  } action_t;
+
+  struct rule {
+    std::string pattern;
+    bool at_start, at_end;
+    action_t action;
+    std::string argument;
+  };
+
+  rules();
+
+  /** Load the rules from a file, throws std::runtime_error naming the line
+   * of any rule that doesn't make sense.
+   */
+  void load(const std::string &path);
+
+  void add(const std::string &pattern, bool at_start, bool at_end,
+           action_t action, const std::string &argument);
+
+  bool empty() const { return _rules.empty(); }
+  size_t size() const { return _rules.size(); }
+  const rule &operator[](size_t index) const { return _rules[index]; }
+
+  /** Find the rules matching a line, in the order they were added.
+   */
+  void match(std::string_view line, std::vector<size_t> &matched);
+
+  /** Fill in a template for a line. $name is who the line is from, $text is
+   * what they said, $line the whole line and $$ a dollar sign.
+   */
+  static std::string expand(std::string_view text, std::string_view line);
+
+private:
+  std::vector<rule> _rules;
+
+  // The automaton, built the first time it's needed.
+  bool _built;
+  std::vector<int32_t> _next; // The next state for state * 256 + byte.
+  std::vector<std::vector<uint32_t>> _found; // Rules ending at each state.
+
+  void build();
+};
+
+#endif /* _LCHAT_RULES_H */
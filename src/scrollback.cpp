@@ -0,0 +1,196 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "scrollback.h"
+#include <cstring>
+
+/******************************************************************************
+ * class scrollback
+ */
+
+/**************************
+ * scrollback::scrollback *
+ **************************/
+
+scrollback::scrollback(size_t capacity, size_t chunk_size)
+  : _lines(capacity ? capacity : 1), _head(0), _count(0), _first(0),
+    _first_chunk(0), _chunk_size(chunk_size), _spare{nullptr, 0, 0, 0} {
+}
+
+/***************************
+ * scrollback::~scrollback *
+ ***************************/
+
+scrollback::~scrollback() noexcept {}
+
+/********************
+ * scrollback::push *
+ ********************/
+
+void scrollback::push(const std::string &line, uint32_t tag) {
+  if (_count == _lines.size()) evict();
+
+  record &rec = _lines[(_head + _count) % _lines.size()];
+  rec = store(line);
+  rec.tag = tag;
+  _count++;
+}
+
+/*********************
+ * scrollback::clear *
+ *********************/
+
+void scrollback::clear() {
+  _first += _count;
+  _head = 0;
+  _count = 0;
+  _first_chunk += _chunks.size();
+  _chunks.clear();
+}
+
+/**************************
+ * scrollback::operator[] *
+ **************************/
+
+std::string_view scrollback::operator[](size_t index) const {
+  const record &rec = at(index);
+  const chunk &chk = _chunks[rec.chunk - _first_chunk];
+  return std::string_view(chk.data.get() + rec.offset, rec.length);
+}
+
+/********************
+ * scrollback::find *
+ ********************/
+
+size_t scrollback::find(std::string_view text, size_t before) const {
+  /* The lines sharing a chunk sit next to each other in it, so all of them
+   * are searched with one memmem over the chunk. Matches running across the
+   * end of a line are passed over.
+   */
+  if (before > _count) before = _count;
+  if (text.empty()) return (before ? before - 1 : npos);
+
+  while (before > 0) {
+    const uint64_t id = at(before - 1).chunk;
+
+    // The oldest line before this one in the same chunk.
+    size_t lo = 0, hi = before - 1;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (at(mid).chunk < id) lo = mid + 1;
+      else hi = mid;
+    }
+
+    const char *data = _chunks[id - _first_chunk].data.get();
+    const char *end = data + at(before - 1).offset + at(before - 1).length;
+    const char *pos = data + at(lo).offset;
+
+    size_t found = npos, line = lo;
+    while (pos < end) {
+      const char *hit = static_cast<const char *>(
+        memmem(pos, end - pos, text.data(), text.size()));
+      if (not hit) break;
+
+      // Find the line the match starts in.
+      const size_t offset = hit - data;
+      while (at(line).offset + at(line).length <= offset) line++;
+
+      const record &rec = at(line);
+      if (offset + text.size() <= rec.offset + rec.length) found = line;
+
+      // Carry on from the next line, one match a line is enough.
+      if (++line >= before) break;
+      pos = data + at(line).offset;
+    }
+
+    if (found != npos) return found;
+    before = lo;
+  }
+
+  return npos;
+}
+
+/*********************
+ * scrollback::evict *
+ *********************/
+
+void scrollback::evict() {
+  const record &rec = _lines[_head];
+  _head = (_head + 1) % _lines.size();
+  _count--;
+  _first++;
+
+  chunk &chk = _chunks[rec.chunk - _first_chunk];
+  chk.lines--;
+
+  /* Lines are stored in order, so chunks empty out from the front. The
+   * chunk still being filled is never released.
+   */
+  while (_chunks.size() > 1 and _chunks.front().lines == 0) {
+    if (_chunks.front().size == _chunk_size)
+      _spare = std::move(_chunks.front());
+    _chunks.pop_front();
+    _first_chunk++;
+  }
+}
+
+/*********************
+ * scrollback::store *
+ *********************/
+
+scrollback::record scrollback::store(const std::string &line) {
+  const size_t len = line.length();
+
+  if (_chunks.empty() or _chunks.back().size - _chunks.back().used < len) {
+    // Start a new chunk, lines longer than a chunk get one of their own.
+    if (len <= _chunk_size and _spare.data) {
+      _chunks.push_back(std::move(_spare));
+      _spare = chunk{nullptr, 0, 0, 0};
+    } else {
+      const size_t size = (len > _chunk_size ? len : _chunk_size);
+      _chunks.push_back(chunk{std::unique_ptr<char[]>(new char[size]),
+                              size, 0, 0});
+    }
+    _chunks.back().used = 0;
+    _chunks.back().lines = 0;
+  }
+
+  chunk &chk = _chunks.back();
+  record rec{_first_chunk + _chunks.size() - 1,
+             static_cast<uint32_t>(chk.used), static_cast<uint32_t>(len), 0};
+
+  if (len) memcpy(chk.data.get() + chk.used, line.data(), len);
+  chk.used += len;
+  chk.lines++;
+  return rec;
+}
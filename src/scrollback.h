@@ -0,0 +1,117 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#ifndef _LCHAT_SCROLLBACK_H
+#define _LCHAT_SCROLLBACK_H
+
+/** A fixed size ring of chat lines.
+ *
+ *  Line records are kept in a ring, so appending a line and evicting the
+ * oldest one are constant time and any line can be reached by its index.
+ * The text itself is packed into large chunks that are released, oldest
+ * first, once every line in them has been evicted.
+ */
+class scrollback {
+public:
+  explicit scrollback(size_t capacity, size_t chunk_size = 65536);
+  virtual ~scrollback() noexcept;
+
+  void push(const std::string &line, uint32_t tag = 0);
+  void clear();
+
+  /** The number of lines currently held. */
+  size_t size() const { return _count; }
+  size_t capacity() const { return _lines.size(); }
+  bool empty() const { return _count == 0; }
+
+  /** Access a line, 0 is the oldest line held and size() - 1 the newest.
+   */
+  std::string_view operator[](size_t index) const;
+
+  /** The tag given with a line when it was pushed. */
+  uint32_t tag(size_t index) const { return at(index).tag; }
+
+  /** Search back for a line containing the text, from the line before
+   * index before towards the oldest. Returns the index of the line found or
+   * npos.
+   */
+  size_t find(std::string_view text, size_t before) const;
+
+  static const size_t npos = static_cast<size_t>(-1);
+
+  /** The number of lines ever evicted. Adding it to an index gives a number
+   * that stays with the line for as long as it's held.
+   */
+  uint64_t first() const { return _first; }
+
+private:
+  struct record {
+    uint64_t chunk;   // Sequence number of the chunk holding the text.
+    uint32_t offset;  // Start of the text in the chunk.
+    uint32_t length;  // Length of the text.
+    uint32_t tag;     // Whatever the owner wants to keep with the line.
+  };
+
+  struct chunk {
+    std::unique_ptr<char[]> data;
+    size_t size;      // Allocated size.
+    size_t used;      // Bytes handed out to lines.
+    size_t lines;     // Lines still referencing this chunk.
+  };
+
+  std::vector<record> _lines; // Ring of line records.
+  size_t _head;               // Index of the oldest line.
+  size_t _count;              // Number of lines held.
+  uint64_t _first;            // Number of lines evicted.
+
+  std::deque<chunk> _chunks;  // Text arena, oldest chunk first.
+  uint64_t _first_chunk;      // Sequence number of _chunks.front().
+  size_t _chunk_size;
+  chunk _spare;               // Last released chunk, kept for reuse.
+
+  const record &at(size_t index) const {
+    return _lines[(_head + index) % _lines.size()];
+  }
+
+  void evict();
+  record store(const std::string &line);
+};
+
+#endif // _LCHAT_SCROLLBACK_H
@@ -0,0 +1,388 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "shmring.h"
+#include <algorithm>
+#include <stdexcept>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010 // Linux 5.1, missing from older headers.
+#endif
+
+namespace {
+  const uint32_t ring_magic = 0x6c636872; // "lchr"
+  const uint32_t ring_version = 1;
+
+  // The header has a cache line to itself, the lines follow.
+  const size_t data_offset = 64;
+
+  // Each line starts with its number and length.
+  struct record {
+    uint64_t seq;
+    uint32_t len;
+    uint32_t reserved;
+  };
+
+  inline size_t record_size(size_t len) {
+    return (sizeof(record) + len + 7) & ~size_t(7);
+  }
+
+  /* A line may take up a quarter of the ring at most. A reader is safe as
+   * long as it's further behind the last line published than the ring
+   * less a line being written over it.
+   */
+  inline size_t max_record(size_t capacity) { return capacity / 4; }
+
+  long futex(uint32_t *addr, int op, uint32_t value,
+             const timespec *timeout = nullptr) {
+    return syscall(SYS_futex, addr, op, value, timeout, nullptr, 0);
+  }
+}
+
+struct shmring::header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t head;  // Bytes ever written, published after each line.
+  uint64_t last;  // The number of the last line written.
+  uint32_t futex; // Bumped to wake the readers.
+  uint32_t reserved;
+};
+
+/******************************************************************************
+ * class shmring
+ */
+
+/********************
+ * shmring::shmring *
+ ********************/
+
+shmring::shmring(size_t capacity)
+  : _header(nullptr), _data(nullptr), _capacity((capacity + 7) & ~size_t(7)),
+    _mapped(data_offset + _capacity), _fd(-1), _shared(-1), _writer(true),
+    _dirty(false), _tail(0), _event(-1), _stopping(false) {
+
+  static_assert(sizeof(header) <= data_offset,
+                "The ring header outgrew its cache line");
+
+  if (_capacity < 4096)
+    throw std::runtime_error("The shared memory ring is too small");
+
+  _fd = memfd_create("lchat", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (_fd == -1)
+    throw std::runtime_error(std::string("Unable to create shared memory: ") +
+                             strerror(errno));
+
+  // The clients mustn't be able to change its size out from under us.
+  if (ftruncate(_fd, static_cast<off_t>(_mapped)) == -1 or
+      fcntl(_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1) {
+    const int err = errno;
+    ::close(_fd);
+    throw std::runtime_error(std::string("Unable to size shared memory: ") +
+                             strerror(err));
+  }
+
+  void *mem = mmap(nullptr, _mapped, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   _fd, 0);
+  if (mem == MAP_FAILED) {
+    const int err = errno;
+    ::close(_fd);
+    throw std::runtime_error(std::string("Unable to map shared memory: ") +
+                             strerror(err));
+  }
+
+  /* Only our own mapping may write to the ring. A client can open its
+   * descriptor again for writing through /proc, so it's the seal that
+   * keeps it from mapping the ring for writing and forging lines.
+   */
+  if (fcntl(_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == -1) {
+    const int err = errno;
+    munmap(mem, _mapped);
+    ::close(_fd);
+    throw std::runtime_error(std::string("Unable to seal shared memory: ") +
+                             strerror(err));
+  }
+  _header = static_cast<header *>(mem);
+  _data = static_cast<char *>(mem) + data_offset;
+
+  _header->magic = ring_magic;
+  _header->version = ring_version;
+  _header->capacity = _capacity;
+  _header->head = 0;
+  _header->last = 0;
+  _header->futex = 0;
+
+  /* Opened again read only for the clients, so they aren't handed our
+   * own descriptor. It's done now while we're still allowed to open our
+   * own descriptors through /proc.
+   */
+  const std::string path = "/proc/self/fd/" + std::to_string(_fd);
+  _shared = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (_shared == -1) {
+    const int err = errno;
+    munmap(mem, _mapped);
+    ::close(_fd);
+    throw std::runtime_error(std::string("Unable to share memory: ") +
+                             strerror(err));
+  }
+}
+
+shmring::shmring(int fd, uint64_t from)
+  : _header(nullptr), _data(nullptr), _capacity(0), _mapped(0), _fd(fd),
+    _shared(-1), _writer(false), _dirty(false), _tail(0), _event(-1),
+    _stopping(false) {
+
+  struct stat st;
+  if (fstat(_fd, &st) == -1 or
+      static_cast<size_t>(st.st_size) <= data_offset + 4096) {
+    ::close(_fd);
+    throw std::runtime_error("Not a shared memory ring");
+  }
+
+  _mapped = static_cast<size_t>(st.st_size);
+  void *mem = mmap(nullptr, _mapped, PROT_READ, MAP_SHARED, _fd, 0);
+  if (mem == MAP_FAILED) {
+    const int err = errno;
+    ::close(_fd);
+    throw std::runtime_error(std::string("Unable to map shared memory: ") +
+                             strerror(err));
+  }
+  _header = static_cast<header *>(mem);
+  _data = static_cast<char *>(mem) + data_offset;
+
+  if (_header->magic != ring_magic or _header->version != ring_version or
+      _header->capacity != _mapped - data_offset) {
+    munmap(mem, _mapped);
+    ::close(_fd);
+    throw std::runtime_error("Not a shared memory ring");
+  }
+  _capacity = _header->capacity;
+
+  /* Lines written since the ring was passed to us are ours too. If that
+   * was too long ago next says they're lost.
+   */
+  const auto head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+  _tail = std::min(from, head);
+}
+
+/*********************
+ * shmring::~shmring *
+ *********************/
+
+shmring::~shmring() noexcept {
+  if (_waiter.joinable()) {
+    // Everyone waiting on the ring wakes, the others just wait again.
+    _stopping = true;
+    futex(&_header->futex, FUTEX_WAKE, INT_MAX);
+    _waiter.join();
+  }
+  if (_event >= 0) ::close(_event);
+
+  munmap(_header, _mapped);
+  ::close(_fd);
+  if (_shared >= 0) ::close(_shared);
+}
+
+/*****************
+ * shmring::head *
+ *****************/
+
+uint64_t shmring::head() const {
+  return __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+}
+
+/*****************
+ * shmring::push *
+ *****************/
+
+bool shmring::push(uint64_t seq, const std::string &text) {
+  const auto size = record_size(text.size());
+  if (not _writer or size > max_record(_capacity)) return false;
+
+  const record rec = {seq, static_cast<uint32_t>(text.size()), 0};
+  const auto head = _header->head;
+
+  copy_in(head, &rec, sizeof(rec));
+  copy_in(head + sizeof(rec), text.data(), text.size());
+  __atomic_store_n(&_header->last, seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&_header->head, head + size, __ATOMIC_RELEASE);
+
+  _dirty = true;
+  return true;
+}
+
+/*****************
+ * shmring::wake *
+ *****************/
+
+void shmring::wake() {
+  if (not _dirty) return;
+  _dirty = false;
+
+  __atomic_add_fetch(&_header->futex, 1, __ATOMIC_RELEASE);
+  futex(&_header->futex, FUTEX_WAKE, INT_MAX);
+}
+
+/*****************
+ * shmring::next *
+ *****************/
+
+shmring::result_t shmring::next(uint64_t &seq, std::string &text) {
+  const auto limit = _capacity - max_record(_capacity);
+
+  auto head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+  if (_tail == head) return EMPTY;
+  if (head - _tail > limit) {
+    return skip(head, seq);
+  }
+
+  record rec;
+  copy_out(_tail, &rec, sizeof(rec));
+  if (record_size(rec.len) > max_record(_capacity)) {
+    return skip(head, seq);
+  }
+  text.resize(rec.len);
+  copy_out(_tail + sizeof(rec), &text[0], rec.len);
+
+  // Make sure the writer didn't catch up with us while we were copying.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  head = __atomic_load_n(&_header->head, __ATOMIC_RELAXED);
+  if (head - _tail > limit) {
+    return skip(head, seq);
+  }
+
+  _tail += record_size(rec.len);
+  seq = rec.seq;
+  return LINE;
+}
+
+/*****************
+ * shmring::skip *
+ *****************/
+
+shmring::result_t shmring::skip(uint64_t head, uint64_t &seq) {
+  /* Carry on reading from the newest line. The last number is read after
+   * head, so it may be for a line after it that we'll read again.
+   */
+  _tail = head;
+  seq = __atomic_load_n(&_header->last, __ATOMIC_ACQUIRE);
+  return LOST;
+}
+
+/******************
+ * shmring::watch *
+ ******************/
+
+int shmring::watch() {
+  if (_event >= 0) return _event;
+
+  _event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (_event == -1)
+    throw std::runtime_error(std::string("Unable to create eventfd: ") +
+                             strerror(errno));
+
+  _waiter = std::thread(&shmring::wait_loop, this);
+  return _event;
+}
+
+/******************
+ * shmring::clear *
+ ******************/
+
+void shmring::clear() {
+  uint64_t count;
+  if (read(_event, &count, sizeof(count)) == -1) {}
+}
+
+/*********************
+ * shmring::copy_out *
+ *********************/
+
+void shmring::copy_out(uint64_t pos, void *dest, size_t len) const {
+  // Copy out of the ring, in two pieces if it wraps around.
+  const auto offset = pos % _capacity;
+  const auto first = std::min<size_t>(len, _capacity - offset);
+
+  memcpy(dest, _data + offset, first);
+  memcpy(static_cast<char *>(dest) + first, _data, len - first);
+}
+
+/********************
+ * shmring::copy_in *
+ ********************/
+
+void shmring::copy_in(uint64_t pos, const void *src, size_t len) {
+  const auto offset = pos % _capacity;
+  const auto first = std::min<size_t>(len, _capacity - offset);
+
+  memcpy(_data + offset, src, first);
+  memcpy(_data, static_cast<const char *>(src) + first, len - first);
+}
+
+/**********************
+ * shmring::wait_loop *
+ **********************/
+
+void shmring::wait_loop() {
+  /* Runs in its own thread, turning wakes on the futex into something the
+   * reader can poll along with everything else it waits on.
+   */
+  auto seen = __atomic_load_n(&_header->futex, __ATOMIC_ACQUIRE);
+
+  /* We can't change the futex to wake ourself when we're stopping, so the
+   * wait times out now and then to check.
+   */
+  const timespec timeout = {0, 250000000};
+
+  while (not _stopping) {
+    futex(&_header->futex, FUTEX_WAIT, seen, &timeout);
+
+    const auto now = __atomic_load_n(&_header->futex, __ATOMIC_ACQUIRE);
+    if (now != seen) {
+      seen = now;
+      const uint64_t one = 1;
+      if (write(_event, &one, sizeof(one)) == -1) {}
+    }
+  }
+}
@@ -0,0 +1,126 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <cstdint>
+
+#ifndef _LCHAT_SHMRING_H
+#define _LCHAT_SHMRING_H
+
+/** Chat lines shared with the clients through memory.
+ *
+ *  The server writes every line meant for everyone once into a ring in a
+ * memfd sealed against writing by anyone else, and passes a read only
+ * descriptor for it to the clients that ask. Each client maps the ring and
+ * reads the lines itself, so fanning a line out costs the server one copy
+ * and one futex wake instead of a send per client.
+ *
+ *  Lines are records of their number, length and text, laid end to end and
+ * wrapping around the ring. The count of bytes ever written is published
+ * after each record. A reader that falls a whole ring behind has lost lines
+ * and is told so, it can ask the server for them again.
+ */
+class shmring {
+public:
+  typedef enum {LINE, EMPTY, LOST} result_t;
+
+  /** Create a ring holding capacity bytes of lines to write into. */
+  explicit shmring(size_t capacity);
+
+  /** Map a ring passed to us to read from, taking ownership of fd.
+   * Reading starts at from, as given by head when it was passed.
+   */
+  shmring(int fd, uint64_t from);
+
+  shmring(const shmring &other) = delete;
+  ~shmring() noexcept;
+
+  /** A read only descriptor for the ring to pass to the clients. */
+  int shared() const { return _shared; }
+
+  size_t capacity() const { return _capacity; }
+
+  /** Where the next line will be written. */
+  uint64_t head() const;
+
+  /** Add a line to the ring. Returns false if it's too long for it, it
+   * has to go to the clients some other way.
+   */
+  bool push(uint64_t seq, const std::string &text);
+
+  /** Wake the readers if anything was added since the last time. Lines
+   * are usually added in bursts, so this is called once after each.
+   */
+  void wake();
+
+  /** Read the next line. LOST means lines were written over before we got
+   * to them and seq is set to the number of the newest line. Reading
+   * carries on from about there, lines up to seq may still follow.
+   */
+  result_t next(uint64_t &seq, std::string &text);
+
+  /** A descriptor that becomes readable when lines are added. A thread is
+   * started to wait on the ring's futex for us, the descriptor is only
+   * ours to poll and read.
+   */
+  int watch();
+
+  /** Drain the descriptor from watch after it became readable. */
+  void clear();
+
+private:
+  struct header;
+
+  header *_header;
+  char *_data;
+  size_t _capacity;
+  size_t _mapped;
+  int _fd, _shared;
+
+  bool _writer;
+  bool _dirty;    // Written since the last wake.
+  uint64_t _tail; // Where we're reading from.
+
+  int _event;                  // Tells the reader lines were added.
+  std::thread _waiter;         // Waits on the futex and writes to _event.
+  std::atomic<bool> _stopping;
+
+  void copy_out(uint64_t pos, void *dest, size_t len) const;
+  void copy_in(uint64_t pos, const void *src, size_t len);
+  result_t skip(uint64_t head, uint64_t &seq);
+  void wait_loop();
+};
+
+#endif // _LCHAT_SHMRING_H
@@ -0,0 +1,577 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "nstream"
+#include "uring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+  /* There is no glibc wrapper for the io_uring system calls and we don't
+   * want to depend on liburing for the handful of things we need.
+   */
+
+  int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+  }
+
+  int io_uring_register(int fd, unsigned opcode, void *arg,
+                        unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg,
+                                    nr_args));
+  }
+
+  inline unsigned load_acquire(const unsigned *ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+  }
+
+  inline void store_release(unsigned *ptr, unsigned value) {
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+  }
+
+  const unsigned short buffer_group = 0;
+
+  /* Request user data. The operation is kept in the low 3 bits, then the
+   * file descriptor and a serial number in the high 32 bits so completions
+   * from a closed socket can't be confused with a new socket reusing the
+   * descriptor. Sends use a pointer to their record, which is always
+   * aligned, so their operation bits are always OP_SEND.
+   */
+
+  uint64_t make_key(int fd, sockets::uring::op_t op, uint32_t serial) {
+    return (static_cast<uint64_t>(serial) << 32) |
+      (static_cast<uint64_t>(fd & 0x1fffffff) << 3) |
+      static_cast<uint64_t>(op);
+  }
+
+  int key_fd(uint64_t key) {
+    return static_cast<int>((key >> 3) & 0x1fffffff);
+  }
+
+  sockets::uring::op_t key_op(uint64_t key) {
+    return static_cast<sockets::uring::op_t>(key & 0x7);
+  }
+}
+
+/******************************************************************************
+ * class sockets::uring
+ */
+
+/*************************
+ * sockets::uring::uring *
+ *************************/
+
+sockets::uring::uring(unsigned entries, unsigned buffers,
+                      unsigned buffer_size)
+  : _fd(-1), _sq_head(nullptr), _sq_tail(nullptr), _sq_mask(nullptr),
+    _sq_array(nullptr), _sqes(nullptr), _sq_local_tail(0), _sq_entries(0),
+    _cq_head(nullptr), _cq_tail(nullptr), _cq_mask(nullptr), _cqes(nullptr),
+    _sq_ring(MAP_FAILED), _cq_ring(MAP_FAILED),
+    _sq_ring_size(0), _cq_ring_size(0), _sqes_size(0),
+    _buf_ring(nullptr), _buf_ring_size(0), _buf_count(buffers),
+    _buf_size(buffer_size), _serial(0), _inflight(0), _stopping(false) {
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  _fd = io_uring_setup(entries, &params);
+  if (_fd < 0)
+    throw sockets::exception(std::string("io_uring setup failed: ") +
+                             strerror(errno));
+
+  // Map the submission and completion rings into our memory.
+  _sq_entries = params.sq_entries;
+  _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (_cq_ring_size > _sq_ring_size) _sq_ring_size = _cq_ring_size;
+    _cq_ring_size = 0;
+  }
+
+  _sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+  if (_sq_ring == MAP_FAILED) {
+    unmap();
+    throw sockets::exception(std::string("io_uring mmap failed: ") +
+                             strerror(errno));
+  }
+
+  if (_cq_ring_size == 0) {
+    _cq_ring = _sq_ring;
+  } else {
+    _cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+    if (_cq_ring == MAP_FAILED) {
+      unmap();
+      throw sockets::exception(std::string("io_uring mmap failed: ") +
+                               strerror(errno));
+    }
+  }
+
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    _sqes = nullptr;
+    unmap();
+    throw sockets::exception(std::string("io_uring mmap failed: ") +
+                             strerror(errno));
+  }
+  _sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+  char *sq = static_cast<char *>(_sq_ring);
+  _sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  _sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  _sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  _sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  _sq_local_tail = *_sq_tail;
+
+  char *cq = static_cast<char *>(_cq_ring);
+  _cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  _cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  _cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  /* Register the ring of buffers the kernel picks from when data arrives.
+   * The number of buffers must be a power of 2.
+   */
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  _buf_ring_size = _buf_count * sizeof(struct io_uring_buf);
+  _buf_ring_size = (_buf_ring_size + page - 1) / page * page;
+  void *ring = mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    unmap();
+    throw sockets::exception(std::string("io_uring mmap failed: ") +
+                             strerror(errno));
+  }
+  _buf_ring = static_cast<struct io_uring_buf_ring *>(ring);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(_buf_ring);
+  reg.ring_entries = _buf_count;
+  reg.bgid = buffer_group;
+  if (io_uring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    auto err = errno;
+    unmap();
+    throw sockets::exception(
+      std::string("io_uring provided buffers not supported: ") +
+      strerror(err));
+  }
+
+  _buffers.resize(static_cast<size_t>(_buf_count) * _buf_size);
+  __atomic_store_n(&_buf_ring->tail, 0, __ATOMIC_RELEASE);
+  for (unsigned i = 0; i < _buf_count; ++i)
+    recycle(static_cast<unsigned short>(i));
+}
+
+/**************************
+ * sockets::uring::~uring *
+ **************************/
+
+sockets::uring::~uring() noexcept {
+  unmap();
+
+  // Any sends still in flight were cancelled when the ring closed.
+  for (auto &it: _out) {
+    if (it.second.inflight) delete it.second.inflight;
+  }
+}
+
+/*************************
+ * sockets::uring::unmap *
+ *************************/
+
+void sockets::uring::unmap() noexcept {
+  if (_buf_ring) munmap(_buf_ring, _buf_ring_size);
+  if (_sqes) munmap(_sqes, _sqes_size);
+  if (_cq_ring != MAP_FAILED and _cq_ring != _sq_ring)
+    munmap(_cq_ring, _cq_ring_size);
+  if (_sq_ring != MAP_FAILED) munmap(_sq_ring, _sq_ring_size);
+  if (_fd >= 0) ::close(_fd);
+
+  _buf_ring = nullptr;
+  _sqes = nullptr;
+  _cq_ring = _sq_ring = MAP_FAILED;
+  _fd = -1;
+}
+
+/**************************
+ * sockets::uring::accept *
+ **************************/
+
+void sockets::uring::accept(int fd) {
+  arm(fd, OP_ACCEPT);
+}
+
+/************************
+ * sockets::uring::recv *
+ ************************/
+
+void sockets::uring::recv(int fd) {
+  arm(fd, OP_RECV);
+}
+
+/************************
+ * sockets::uring::poll *
+ ************************/
+
+void sockets::uring::poll(int fd) {
+  arm(fd, OP_POLL);
+}
+
+/**************************
+ * sockets::uring::cancel *
+ **************************/
+
+void sockets::uring::cancel(int fd) {
+  auto key = _keys.find(fd);
+  if (key != _keys.end()) {
+    auto sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = key->second;
+    sqe->user_data = make_key(fd, OP_CANCEL, 0);
+    _keys.erase(key);
+  }
+
+  // Drop any output, the socket is going away.
+  auto out = _out.find(fd);
+  if (out != _out.end()) {
+    if (out->second.inflight) out->second.inflight->orphaned = true;
+    _out.erase(out);
+  }
+}
+
+/******************************
+ * sockets::uring::cancel_all *
+ ******************************/
+
+void sockets::uring::cancel_all() {
+  /* The keys are kept so anything that completes before the cancellation
+   * is still handed back by wait.
+   */
+  for (auto &key: _keys) {
+    auto sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = key.second;
+    sqe->user_data = make_key(key.first, OP_CANCEL, 0);
+  }
+
+  // Sends to clients that aren't reading could otherwise never finish.
+  for (auto &out: _out) {
+    if (out.second.inflight == nullptr) continue;
+
+    auto sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(out.second.inflight);
+    sqe->user_data = make_key(out.first, OP_CANCEL, 0);
+  }
+
+  _stopping = true;
+}
+
+/************************
+ * sockets::uring::send *
+ ************************/
+
+void sockets::uring::send(int fd, const char *data, size_t len) {
+  auto &out = _out[fd];
+  if (out.pending.empty() and out.inflight == nullptr) _dirty.push_back(fd);
+  out.pending.append(data, len);
+}
+
+/**************************
+ * sockets::uring::queued *
+ **************************/
+
+size_t sockets::uring::queued(int fd) const {
+  auto out = _out.find(fd);
+  if (out == _out.end()) return 0;
+
+  size_t result = out->second.pending.size();
+  if (out->second.inflight)
+    result += (out->second.inflight->data.size() -
+               out->second.inflight->offset);
+  return result;
+}
+
+/************************
+ * sockets::uring::take *
+ ************************/
+
+std::string sockets::uring::take(int fd) {
+  auto out = _out.find(fd);
+  if (out == _out.end()) return std::string();
+
+  std::string result;
+  result.swap(out->second.pending);
+  return result;
+}
+
+/************************
+ * sockets::uring::wait *
+ ************************/
+
+void sockets::uring::wait(std::vector<event> &events) {
+  events.clear();
+
+  /* Submit one send per socket with queued output. Only one send is ever in
+   * flight for a socket, anything queued behind it waits for it to complete
+   * which keeps the output in order even when a send is short.
+   */
+  if (not _stopping) {
+    for (auto fd: _dirty) {
+      auto out = _out.find(fd);
+      if (out == _out.end() or out->second.inflight or
+          out->second.pending.empty())
+        continue;
+
+      auto rec = new send_rec{fd, std::string(), 0, false};
+      rec->data.swap(out->second.pending);
+      out->second.inflight = rec;
+      submit_send(rec);
+    }
+    _dirty.clear();
+  }
+
+  submit(1);
+
+  // Reap the completions.
+  unsigned head = *_cq_head;
+  const unsigned tail = load_acquire(_cq_tail);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+    const uint64_t key = cqe->user_data;
+    const int res = cqe->res;
+    const unsigned flags = cqe->flags;
+    const op_t op = key_op(key);
+
+    if (op == OP_CANCEL) continue;
+
+    if (op == OP_SEND) {
+      auto rec = reinterpret_cast<send_rec *>(key);
+      _inflight--;
+
+      if (rec->orphaned) {
+        delete rec;
+        continue;
+      }
+
+      if (res > 0) {
+        rec->offset += static_cast<size_t>(res);
+        if (rec->offset < rec->data.size()) {
+          // A short send, send the rest before anything else.
+          submit_send(rec);
+          continue;
+        }
+      }
+
+      auto out = _out.find(rec->fd);
+      if (out != _out.end()) {
+        out->second.inflight = nullptr;
+        if (res == -ECANCELED) {
+          // Keep what wasn't sent so it can be taken.
+          out->second.pending.insert(0, rec->data, rec->offset,
+                                     std::string::npos);
+        } else if (res < 0) {
+          out->second.pending.clear();
+        } else if (not out->second.pending.empty()) {
+          _dirty.push_back(rec->fd);
+        }
+      }
+      delete rec;
+      continue;
+    }
+
+    const int fd = key_fd(key);
+    const bool more = (flags & IORING_CQE_F_MORE);
+    auto current = _keys.find(fd);
+    const bool is_current = (current != _keys.end() and
+                             current->second == key);
+
+    if (not more) {
+      _armed.erase(key);
+      if (is_current) _keys.erase(current);
+    }
+
+    event evt{op, fd, res, more, std::string()};
+    if (flags & IORING_CQE_F_BUFFER) {
+      const auto bid =
+        static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+      if (res > 0)
+        evt.data.assign(&_buffers[static_cast<size_t>(bid) * _buf_size],
+                        static_cast<size_t>(res));
+      recycle(bid);
+    }
+
+    if (is_current) {
+      events.push_back(std::move(evt));
+    } else if (op == OP_ACCEPT and res >= 0) {
+      // A connection accepted after we stopped listening.
+      ::close(res);
+    }
+  }
+  store_release(_cq_head, head);
+}
+
+/***************************
+ * sockets::uring::get_sqe *
+ ***************************/
+
+struct io_uring_sqe *sockets::uring::get_sqe() {
+  if (_sq_local_tail - load_acquire(_sq_head) >= _sq_entries) {
+    // The submission queue is full, hand what we have to the kernel.
+    submit(0);
+    if (_sq_local_tail - load_acquire(_sq_head) >= _sq_entries)
+      throw sockets::exception("io_uring submission queue is full");
+  }
+
+  const unsigned index = _sq_local_tail & *_sq_mask;
+  struct io_uring_sqe *sqe = &_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  _sq_array[index] = index;
+  _sq_local_tail++;
+
+  return sqe;
+}
+
+/**************************
+ * sockets::uring::submit *
+ **************************/
+
+void sockets::uring::submit(unsigned wait_for) {
+  store_release(_sq_tail, _sq_local_tail);
+
+  const unsigned to_submit = _sq_local_tail - load_acquire(_sq_head);
+  const int res = io_uring_enter(_fd, to_submit, wait_for,
+                                 wait_for ? IORING_ENTER_GETEVENTS : 0);
+  if (res < 0) {
+    // Interrupted by a signal or the completion queue is backed up.
+    if (errno == EINTR or errno == EAGAIN or errno == EBUSY) return;
+    throw sockets::exception(std::string("io_uring enter failed: ") +
+                             strerror(errno));
+  }
+}
+
+/***********************
+ * sockets::uring::arm *
+ ***********************/
+
+void sockets::uring::arm(int fd, op_t op) {
+  const uint64_t key = make_key(fd, op, ++_serial);
+  _keys[fd] = key;
+  _armed.insert(key);
+
+  auto sqe = get_sqe();
+  sqe->fd = fd;
+  sqe->user_data = key;
+
+  switch (op) {
+  case OP_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    break;
+  case OP_RECV:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    break;
+  case OP_POLL:
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    break;
+  default:
+    break;
+  }
+}
+
+/*******************************
+ * sockets::uring::submit_send *
+ *******************************/
+
+void sockets::uring::submit_send(send_rec *rec) {
+  auto sqe = get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = rec->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(rec->data.data() + rec->offset);
+  sqe->len = static_cast<unsigned>(rec->data.size() - rec->offset);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = reinterpret_cast<uint64_t>(rec);
+  _inflight++;
+}
+
+/***************************
+ * sockets::uring::recycle *
+ ***************************/
+
+void sockets::uring::recycle(unsigned short bid) {
+  /* Hand a buffer back to the kernel. Only the address, length and id are
+   * written, the reserved field of the first entry is the ring's tail. The
+   * entries are indexed from the start of the ring rather than through
+   * bufs[], the header declares it behind an empty struct that takes a byte
+   * in C++.
+   */
+  const unsigned short tail = _buf_ring->tail;
+  struct io_uring_buf *buf =
+    reinterpret_cast<struct io_uring_buf *>(_buf_ring) +
+    (tail & (_buf_count - 1));
+
+  buf->addr = reinterpret_cast<uint64_t>(
+    &_buffers[static_cast<size_t>(bid) * _buf_size]);
+  buf->len = _buf_size;
+  buf->bid = bid;
+
+  __atomic_store_n(&_buf_ring->tail, static_cast<unsigned short>(tail + 1),
+                   __ATOMIC_RELEASE);
+}
@@ -0,0 +1,167 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#ifndef _SOCKETS_URING_H
+#define _SOCKETS_URING_H
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+namespace sockets {
+
+  /** A minimal io_uring event queue for the socket server.
+   *
+   *  Accepting and receiving use multishot requests, so one request keeps
+   * producing completions until it is cancelled. Received data lands in a
+   * ring of provided buffers shared with the kernel. Output is queued per
+   * socket and all the queued sends are submitted together the next time
+   * wait is called, so fanning a message out to many clients costs a single
+   * system call.
+   */
+  class uring {
+  public:
+    typedef enum {
+      OP_SEND = 0, OP_ACCEPT = 1, OP_RECV = 2, OP_POLL = 3, OP_CANCEL = 4
+    } op_t;
+
+    /** A completed request handed back by wait. Sends are handled
+     * internally and are never returned.
+     */
+    struct event {
+      op_t op;
+      int fd;
+      int res;      // Result of the request, a negative errno on failure.
+      bool more;    // The request is still armed.
+      std::string data;
+    };
+
+    /** Setup the ring. Throws sockets::exception if the kernel doesn't
+     * support what we need.
+     */
+    uring(unsigned entries = 256, unsigned buffers = 256,
+          unsigned buffer_size = 2048);
+    uring(const uring &other) = delete;
+    ~uring() noexcept;
+
+    void accept(int fd);
+    void recv(int fd);
+    void poll(int fd);
+
+    /** Cancel the armed request on fd and drop any queued output.
+     */
+    void cancel(int fd);
+
+    /** Cancel everything and stop submitting sends, used before shutting
+     * the ring down. Keep calling wait until idle returns true.
+     */
+    void cancel_all();
+    bool idle() const { return _armed.empty() and _inflight == 0; }
+
+    /** Queue output for the socket fd.
+     */
+    void send(int fd, const char *data, size_t len);
+
+    /** The amount of output for fd that hasn't been sent yet.
+     */
+    size_t queued(int fd) const;
+
+    /** Remove and return output for fd that hasn't been submitted yet.
+     */
+    std::string take(int fd);
+
+    /** Submit all the queued requests and wait for at least one to
+     * complete.
+     */
+    void wait(std::vector<event> &events);
+
+  private:
+    struct send_rec {
+      int fd;
+      std::string data;
+      size_t offset;
+      bool orphaned;
+    };
+
+    struct outq {
+      std::string pending;
+      send_rec *inflight = nullptr;
+    };
+
+    int _fd;
+
+    // Submission queue.
+    unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+    io_uring_sqe *_sqes;
+    unsigned _sq_local_tail, _sq_entries;
+
+    // Completion queue.
+    unsigned *_cq_head, *_cq_tail, *_cq_mask;
+    io_uring_cqe *_cqes;
+
+    void *_sq_ring, *_cq_ring;
+    size_t _sq_ring_size, _cq_ring_size, _sqes_size;
+
+    // Provided receive buffers.
+    io_uring_buf_ring *_buf_ring;
+    size_t _buf_ring_size;
+    std::vector<char> _buffers;
+    unsigned _buf_count, _buf_size;
+
+    // Armed multishot requests.
+    uint32_t _serial;
+    std::map<int, uint64_t> _keys;
+    std::set<uint64_t> _armed;
+
+    // Queued output.
+    std::map<int, outq> _out;
+    std::vector<int> _dirty;
+    unsigned _inflight;
+    bool _stopping;
+
+    io_uring_sqe *get_sqe();
+    void submit(unsigned wait_for);
+    void arm(int fd, op_t op);
+    void submit_send(send_rec *rec);
+    void recycle(unsigned short bid);
+    void unmap() noexcept;
+  };
+}
+
+#endif /* _SOCKETS_URING_H */
@@ -0,0 +1,128 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "wrap.h"
+#include <cwchar>
+
+namespace {
+
+  /* Measure the character at the start of text, returning its length in
+   * bytes and setting width to the columns it takes when written at column
+   * col. Curses shows control characters as ^X and expands tabs.
+   */
+  size_t measure(std::string_view text, std::mbstate_t &state, int col,
+                 int &width) {
+    wchar_t wc;
+    size_t len = std::mbrtowc(&wc, text.data(), text.size(), &state);
+
+    if (len == static_cast<size_t>(-1) or len == static_cast<size_t>(-2)) {
+      // Not valid in the current locale, take it a byte at a time.
+      state = std::mbstate_t();
+      width = 1;
+      return 1;
+    }
+
+    if (len == 0) len = 1;
+    if (wc == L'\t') {
+      width = 8 - col % 8;
+    } else {
+      width = wcwidth(wc);
+      if (width < 0) width = 2;
+    }
+    return len;
+  }
+}
+
+/******************************************************************************
+ * class wrap_cache
+ */
+
+/**************************
+ * wrap_cache::wrap_cache *
+ **************************/
+
+wrap_cache::wrap_cache(size_t capacity)
+  : _entries(capacity ? capacity : 1, entry{0, 0, {}}) {
+}
+
+/***************************
+ * wrap_cache::~wrap_cache *
+ ***************************/
+
+wrap_cache::~wrap_cache() noexcept {}
+
+/********************
+ * wrap_cache::rows *
+ ********************/
+
+const std::vector<uint32_t> &wrap_cache::rows(uint64_t id,
+                                              std::string_view line,
+                                              int width) {
+  entry &ent = _entries[id % _entries.size()];
+
+  if (ent.id != id or ent.width != width) {
+    ent.id = id;
+    ent.width = width;
+    wrap(line, width, ent.starts);
+  }
+
+  return ent.starts;
+}
+
+/********************
+ * wrap_cache::wrap *
+ ********************/
+
+void wrap_cache::wrap(std::string_view line, int width,
+                      std::vector<uint32_t> &starts) {
+  std::mbstate_t state = std::mbstate_t();
+  int col = 0, chwidth;
+  size_t pos = 0;
+
+  starts.clear();
+  starts.push_back(0);
+
+  while (pos < line.size()) {
+    const size_t len = measure(line.substr(pos), state, col, chwidth);
+
+    // A character that doesn't fit starts the next row.
+    if (width > 0 and col > 0 and col + chwidth > width) {
+      starts.push_back(static_cast<uint32_t>(pos));
+      col = 0;
+      if (line[pos] == '\t') chwidth = 8;
+    }
+
+    col += chwidth;
+    pos += len;
+  }
+}
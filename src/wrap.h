@@ -0,0 +1,73 @@
+/*                                                                  -*- c++ -*-
+ * Copyright © 2026 Ron R Wills <ron@digitalcombine.ca>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#ifndef _LCHAT_WRAP_H
+#define _LCHAT_WRAP_H
+
+/** Remembers where lines wrap in a window.
+ *
+ *  Working out where a line wraps means measuring the display width of
+ * every character in it, so it's done once per line and window width. The
+ * entries are kept in a ring keyed by the line's id, an entry is reused
+ * once the line it was for has left the scrollback. Changing the width
+ * invalidates every entry without touching them.
+ */
+class wrap_cache {
+public:
+  explicit wrap_cache(size_t capacity);
+  virtual ~wrap_cache() noexcept;
+
+  /** The byte offsets where each row of the line starts when it's wrapped
+   * to width columns. There is always at least one row starting at 0.
+   */
+  const std::vector<uint32_t> &rows(uint64_t id, std::string_view line,
+                                    int width);
+
+private:
+  struct entry {
+    uint64_t id;
+    int width;                   // 0 if the entry was never used.
+    std::vector<uint32_t> starts;
+  };
+
+  std::vector<entry> _entries;
+
+  static void wrap(std::string_view line, int width,
+                   std::vector<uint32_t> &starts);
+};
+
+#endif // _LCHAT_WRAP_H